@@ -0,0 +1,326 @@
+/* broker.c */
+/* fan-out of a DVR media stream to several local clients */
+
+/* TaniDVR
+ * Copyright (c) 2011-2015 Daniel Mealha Cabrita
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "log.h"
+#include "network.h"
+#include "filetools.h"
+#include "broker.h"
+
+/* max frames handed to a single writev() call */
+#define BROKER_IOV_MAX 64
+
+static void broker_frame_unref (broker_frame_t *frame)
+{
+	if (--(frame->refcnt) == 0)
+		free (frame);
+}
+
+static void broker_client_push (broker_client_t *cl, broker_frame_t *frame)
+{
+	cl->q[(cl->q_pos + cl->q_n) % BROKER_CLIENT_MAX_FRAMES] = frame;
+	cl->q_n++;
+	cl->q_len += frame->len;
+	frame->refcnt++;
+}
+
+/* releases the first queued frame */
+static void broker_client_pop (broker_client_t *cl)
+{
+	broker_frame_t *frame = cl->q[cl->q_pos];
+
+	cl->q_len -= frame->len - cl->q_sent;
+	cl->q_sent = 0;
+	cl->q_pos = (cl->q_pos + 1) % BROKER_CLIENT_MAX_FRAMES;
+	cl->q_n--;
+	broker_frame_unref (frame);
+}
+
+/* drops all the queued frames, except a partially sent one
+   (which must be completed, otherwise the client loses sync) */
+static void broker_client_drop_queued (broker_client_t *cl)
+{
+	unsigned int keep = (cl->q_sent > 0) ? 1 : 0;
+	broker_frame_t *frame;
+
+	while (cl->q_n > keep) {
+		frame = cl->q[(cl->q_pos + cl->q_n - 1) % BROKER_CLIENT_MAX_FRAMES];
+		cl->q_len -= frame->len;
+		cl->q_n--;
+		broker_frame_unref (frame);
+	}
+}
+
+static void broker_client_close (broker_t *brk, broker_client_t *cl)
+{
+	while (cl->q_n > 0)
+		broker_client_pop (cl);
+	close (cl->fd);
+	cl->fd = -1;
+	log_printf (LOGT_INFO, "Client disconnected (channel %d).\n", brk->channel);
+}
+
+/* sends as much queued data as the client takes without blocking */
+static void broker_client_flush (broker_t *brk, broker_client_t *cl)
+{
+	struct iovec iov[BROKER_IOV_MAX];
+	broker_frame_t *frame;
+	unsigned int n_iov;
+	ssize_t sent;
+
+	while (cl->q_n > 0) {
+		for (n_iov = 0; (n_iov < cl->q_n) && (n_iov < BROKER_IOV_MAX); n_iov++) {
+			frame = cl->q[(cl->q_pos + n_iov) % BROKER_CLIENT_MAX_FRAMES];
+			iov[n_iov].iov_base = frame->data;
+			iov[n_iov].iov_len = frame->len;
+		}
+		iov[0].iov_base = (uint8_t *) iov[0].iov_base + cl->q_sent;
+		iov[0].iov_len -= cl->q_sent;
+
+		/* SIGPIPE is ignored (see shtools), a dropped client shows up as EPIPE */
+		sent = writev (cl->fd, iov, n_iov);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				return;
+			broker_client_close (brk, cl);
+			return;
+		}
+
+		while ((sent > 0) && (cl->q_n > 0)) {
+			frame = cl->q[cl->q_pos];
+			if ((size_t) sent < (frame->len - cl->q_sent)) {
+				cl->q_sent += sent;
+				cl->q_len -= sent;
+				return;	/* socket buffer is full */
+			}
+			sent -= frame->len - cl->q_sent;
+			broker_client_pop (cl);
+		}
+	}
+}
+
+/* releases the cached GOP */
+static void broker_gop_clear (broker_t *brk)
+{
+	while (brk->gop_n > 0)
+		broker_frame_unref (brk->gop[--(brk->gop_n)]);
+	brk->gop_len = 0;
+}
+
+/* caches a frame of the current GOP, a key frame starts a new one */
+static void broker_gop_add (broker_t *brk, broker_frame_t *frame, bool key_frame)
+{
+	if (key_frame == true)
+		broker_gop_clear (brk);
+	else if (brk->gop_n == 0)
+		return;	/* nothing to add to, wait for a key frame */
+
+	if ((brk->gop_n == BROKER_GOP_MAX_FRAMES) || ((brk->gop_len + frame->len) > BROKER_GOP_MAX_LEN)) {
+		/* GOP too long, useless if incomplete */
+		broker_gop_clear (brk);
+		return;
+	}
+	brk->gop[brk->gop_n++] = frame;
+	brk->gop_len += frame->len;
+	frame->refcnt++;
+}
+
+static void broker_accept (broker_t *brk)
+{
+	broker_client_t *cl;
+	unsigned int j;
+	int fd;
+	int i;
+
+	while ((fd = net_accept_nonblocking (brk->listen_fd)) >= 0) {
+		for (i = 0; (i < BROKER_MAX_CLIENTS) && (brk->client[i].fd >= 0); i++);
+		if (i == BROKER_MAX_CLIENTS) {
+			log_printf (LOGT_WARNING, "Too many clients, connection refused (channel %d).\n", brk->channel);
+			close (fd);
+			continue;
+		}
+		cl = &(brk->client[i]);
+		cl->fd = fd;
+		cl->q_pos = 0;
+		cl->q_n = 0;
+		cl->q_sent = 0;
+		cl->q_len = 0;
+
+		/* start with the cached GOP, if any, otherwise at the next key frame */
+		cl->wait_key = (brk->gop_n == 0);
+		for (j = 0; j < brk->gop_n; j++)
+			broker_client_push (cl, brk->gop[j]);
+		log_printf (LOGT_INFO, "Client connected (channel %d).\n", brk->channel);
+	}
+}
+
+/* starts listening for clients.
+   address: "[<host>:]<port>" (TCP) or "unix:<path>" (Unix-domain socket).
+   index: added to the TCP port, or replaces "%N" in path
+   (one broker per channel, see outfile_expand_name).
+   returns NULL if error (already logged) */
+broker_t *broker_open (const char *address, int index, int channel)
+{
+	broker_t *brk;
+	char host[256];
+	const char *port_p;
+	long port;
+	char *endp;
+	int i;
+
+	if ((brk = malloc (sizeof (broker_t))) == NULL)
+		return NULL;
+	brk->channel = channel;
+	brk->unix_path[0] = '\0';
+	brk->gop_n = 0;
+	brk->gop_len = 0;
+	for (i = 0; i < BROKER_MAX_CLIENTS; i++)
+		brk->client[i].fd = -1;
+
+	if (strncmp (address, "unix:", 5) == 0) {
+		if (outfile_expand_name (brk->unix_path, sizeof (brk->unix_path), address + 5, index) != 0) {
+			log_printf (LOGT_FATAL, "Listening socket path too long.\n");
+			free (brk);
+			return NULL;
+		}
+		brk->listen_fd = net_listen_unix (brk->unix_path);
+		if (brk->listen_fd < 0) {
+			log_printf (LOGT_FATAL, "Unable to listen at %s (channel %d).\n", brk->unix_path, channel);
+			free (brk);
+			return NULL;
+		}
+		log_printf (LOGT_INFO, "Listening at %s (channel %d).\n", brk->unix_path, channel);
+		return brk;
+	}
+
+	/* "[<host>:]<port>", host may be an IPv6 address (hence the last ':') */
+	host[0] = '\0';
+	if ((port_p = strrchr (address, ':')) != NULL) {
+		if ((size_t) (port_p - address) >= sizeof (host)) {
+			log_printf (LOGT_FATAL, "Invalid listening address.\n");
+			free (brk);
+			return NULL;
+		}
+		memcpy (host, address, port_p - address);
+		host[port_p - address] = '\0';
+		port_p++;
+	} else {
+		port_p = address;
+	}
+	port = strtol (port_p, &endp, 10);
+	if ((*port_p == '\0') || (*endp != '\0') || (port < 1) || ((port + index) > 65535)) {
+		log_printf (LOGT_FATAL, "Invalid listening port.\n");
+		free (brk);
+		return NULL;
+	}
+	port += index;
+
+	brk->listen_fd = net_listen_tcp ((host[0] != '\0') ? host : NULL, port);
+	if (brk->listen_fd < 0) {
+		log_printf (LOGT_FATAL, "Unable to listen at port %ld (channel %d).\n", port, channel);
+		free (brk);
+		return NULL;
+	}
+	log_printf (LOGT_INFO, "Listening at port %ld (channel %d).\n", port, channel);
+	return brk;
+}
+
+/* accepts new clients and sends pending data, without blocking */
+void broker_service (broker_t *brk)
+{
+	int i;
+
+	broker_accept (brk);
+	for (i = 0; i < BROKER_MAX_CLIENTS; i++) {
+		if (brk->client[i].fd >= 0)
+			broker_client_flush (brk, &(brk->client[i]));
+	}
+}
+
+/* queues a chunk of stream data to every client, then sends whatever
+   the clients take without blocking.
+   key_frame: true if data starts a key (I-)frame, a lagging client
+   (see BROKER_CLIENT_MAX_*) resumes from such frames only.
+   newly connected clients start with the GOP cached so far (see BROKER_GOP_*).
+   returns ==0 ok, !=0 error */
+int broker_send_frame (broker_t *brk, const uint8_t *data_p, size_t data_len, bool key_frame)
+{
+	broker_frame_t *frame;
+	broker_client_t *cl;
+	int i;
+
+	broker_accept (brk);
+
+	if ((frame = malloc (sizeof (broker_frame_t) + data_len)) == NULL)
+		return 1;
+	frame->refcnt = 1;
+	frame->len = data_len;
+	memcpy (frame->data, data_p, data_len);
+	broker_gop_add (brk, frame, key_frame);
+
+	for (i = 0; i < BROKER_MAX_CLIENTS; i++) {
+		cl = &(brk->client[i]);
+		if (cl->fd < 0)
+			continue;
+
+		if ((cl->q_n == BROKER_CLIENT_MAX_FRAMES) || ((cl->q_len + data_len) > BROKER_CLIENT_MAX_QUEUED)) {
+			/* lagging client: skip ahead, do not stall the others */
+			if (cl->wait_key == false)
+				log_printf (LOGT_WARNING, "Client is too slow, skipping to the next key frame (channel %d).\n", brk->channel);
+			broker_client_drop_queued (cl);
+			cl->wait_key = true;
+		}
+		if (cl->wait_key == true) {
+			if (key_frame == false)
+				continue;
+			cl->wait_key = false;
+		}
+		broker_client_push (cl, frame);
+	}
+	broker_frame_unref (frame);
+
+	broker_service (brk);
+	return 0;
+}
+
+void broker_close (broker_t *brk)
+{
+	int i;
+
+	for (i = 0; i < BROKER_MAX_CLIENTS; i++) {
+		if (brk->client[i].fd >= 0)
+			broker_client_close (brk, &(brk->client[i]));
+	}
+	broker_gop_clear (brk);
+	close (brk->listen_fd);
+	if (brk->unix_path[0] != '\0')
+		unlink (brk->unix_path);
+	free (brk);
+}
@@ -0,0 +1,76 @@
+/* broker.h */
+/* fan-out of a DVR media stream to several local clients */
+
+/* TaniDVR
+ * Copyright (c) 2011-2015 Daniel Mealha Cabrita
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BROKER_H
+#define BROKER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define BROKER_MAX_CLIENTS 32
+
+/* frames queued per client, a client lagging beyond any of those
+   skips ahead to the next key frame */
+#define BROKER_CLIENT_MAX_FRAMES 512
+#define BROKER_CLIENT_MAX_QUEUED (4 * 1048576)
+
+/* cache of the last GOP (frames since the last key frame),
+   replayed to newly connected clients so that they start at once.
+   a longer GOP is not cached (new clients wait for the next key frame) */
+#define BROKER_GOP_MAX_FRAMES (BROKER_CLIENT_MAX_FRAMES / 2)
+#define BROKER_GOP_MAX_LEN (BROKER_CLIENT_MAX_QUEUED / 2)
+
+/* a chunk of stream data, shared (not copied) by all the clients */
+typedef struct {
+	unsigned int refcnt;
+	size_t len;
+	uint8_t data[];
+} broker_frame_t;
+
+typedef struct {
+	int fd;				/* -1: unused slot */
+	bool wait_key;			/* true: skipping frames until the next key frame */
+	broker_frame_t *q[BROKER_CLIENT_MAX_FRAMES];	/* circular */
+	unsigned int q_pos;		/* first queued frame */
+	unsigned int q_n;		/* queued frames */
+	size_t q_sent;			/* bytes already sent from q[q_pos] */
+	size_t q_len;			/* bytes queued (not sent) */
+} broker_client_t;
+
+typedef struct {
+	int channel;		/* informative only */
+
+	/* PRIVATE */
+	int listen_fd;
+	char unix_path[108];	/* Unix-domain socket file, removed on close ("": none) */
+	broker_client_t client[BROKER_MAX_CLIENTS];
+	broker_frame_t *gop[BROKER_GOP_MAX_FRAMES];
+	unsigned int gop_n;	/* 0: nothing cached */
+	size_t gop_len;		/* bytes */
+} broker_t;
+
+extern broker_t *broker_open (const char *address, int index, int channel);
+extern int broker_send_frame (broker_t *brk, const uint8_t *data_p, size_t data_len, bool key_frame);
+extern void broker_service (broker_t *brk);
+extern void broker_close (broker_t *brk);
+
+#endif
+
@@ -23,6 +23,13 @@
 #include <poll.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #include "bufftools.h"
 
@@ -208,3 +215,248 @@ void btfifo_destroy (btfifo_t *btfifo)
 }
 
 
+
+/* BTRING - single-producer/single-consumer ring between threads */
+
+#define BTRING_LOAD(v) __atomic_load_n (&(v), __ATOMIC_SEQ_CST)
+#define BTRING_STORE(v,x) __atomic_store_n (&(v), (x), __ATOMIC_SEQ_CST)
+
+/* sleep until woken up (see btring_wakeup) or timeout_ms elapses.
+   cond_ok is re-evaluated after announcing the sleep,
+   so a wakeup issued in between is not lost. */
+#define BTRING_SLEEP_UNLESS(btring,sleeping,cond_ok,timeout_ms) { \
+	struct timespec ts; \
+	clock_gettime (CLOCK_REALTIME, &ts); \
+	ts.tv_sec += (timeout_ms) / 1000; \
+	ts.tv_nsec += ((timeout_ms) % 1000) * 1000000L; \
+	if (ts.tv_nsec >= 1000000000L) { \
+		ts.tv_sec++; \
+		ts.tv_nsec -= 1000000000L; \
+	} \
+	pthread_mutex_lock (&((btring)->lock)); \
+	BTRING_STORE((btring)->sleeping, 1); \
+	if (! (cond_ok)) \
+		pthread_cond_timedwait (&((btring)->cond), &((btring)->lock), &ts); \
+	BTRING_STORE((btring)->sleeping, 0); \
+	pthread_mutex_unlock (&((btring)->lock)); \
+}
+
+/* wakes up the other side, if sleeping */
+static void btring_wakeup (btring_t *btring, int *sleeping)
+{
+	if (BTRING_LOAD(*sleeping) != 0) {
+		pthread_mutex_lock (&(btring->lock));
+		pthread_cond_broadcast (&(btring->cond));
+		pthread_mutex_unlock (&(btring->lock));
+	}
+}
+
+/* BEFORE calling this, initialize btring_t parameters */
+/* returns: ==0, ok btring properly initialized; !=0, error */
+int btring_create (btring_t *btring)
+{
+	size_t bsize = BTRING_BUFF_MINSIZE;
+
+	while (bsize < btring->bsize)
+		bsize <<= 1;
+	btring->bsize = bsize;
+	btring->mask = bsize - 1;
+
+	if ((btring->b = malloc (btring->bsize)) == NULL)
+		return 1;
+	if (pthread_mutex_init (&(btring->lock), NULL) != 0) {
+		free (btring->b);
+		return 2;
+	}
+	if (pthread_cond_init (&(btring->cond), NULL) != 0) {
+		pthread_mutex_destroy (&(btring->lock));
+		free (btring->b);
+		return 3;
+	}
+
+	btring->head = 0;
+	btring->tail = 0;
+	btring->closed = 0;
+	btring->producer_sleeping = 0;
+	btring->consumer_sleeping = 0;
+
+	return 0;
+}
+
+/* PRODUCER: stores the whole data, waiting for free space if necessary.
+   returns: ==0 ok, !=0 ring closed (data not stored) */
+int btring_write (btring_t *btring, const uint8_t *data_p, size_t data_len)
+{
+	size_t head = btring->head;	/* written by this side only */
+	size_t f_len;
+	size_t offs;
+	size_t chunk;
+
+	while (data_len > 0) {
+		if (BTRING_LOAD(btring->closed) != 0)
+			return 1;
+
+		if ((f_len = btring->bsize - (head - BTRING_LOAD(btring->tail))) == 0) {
+			/* ring full */
+			BTRING_SLEEP_UNLESS(btring, producer_sleeping, ((btring->bsize != (head - BTRING_LOAD(btring->tail))) || (BTRING_LOAD(btring->closed) != 0)), 100);
+			continue;
+		}
+
+		if (f_len > data_len)
+			f_len = data_len;
+		offs = head & btring->mask;
+		chunk = ((offs + f_len) > btring->bsize) ? (btring->bsize - offs) : f_len;
+		memcpy (btring->b + offs, data_p, chunk);
+		memcpy (btring->b, data_p + chunk, f_len - chunk);
+
+		head += f_len;
+		data_p += f_len;
+		data_len -= f_len;
+		BTRING_STORE(btring->head, head);
+		btring_wakeup (btring, &(btring->consumer_sleeping));
+	}
+
+	return 0;
+}
+
+/* PRODUCER: returns how much can be written without waiting */
+size_t btring_get_free_len (btring_t *btring)
+{
+	return (btring->bsize - (btring->head - BTRING_LOAD(btring->tail)));
+}
+
+/* PRODUCER: waits until the consumer has taken all the stored data.
+   returns: ==0 ok (ring empty) ; !=0 ring closed with data left */
+int btring_wait_empty (btring_t *btring)
+{
+	while (BTRING_LOAD(btring->tail) != btring->head) {
+		if (BTRING_LOAD(btring->closed) != 0)
+			return 1;
+		BTRING_SLEEP_UNLESS(btring, producer_sleeping, ((BTRING_LOAD(btring->tail) == btring->head) || (BTRING_LOAD(btring->closed) != 0)), 100);
+	}
+	return 0;
+}
+
+/* CONSUMER: waits up to timeout_ms for data.
+   returns: >0 there is data ; ==0 no data (timeout) ;
+   <0 no data and producer is gone (no data will ever come) */
+int btring_wait_data (btring_t *btring, int timeout_ms)
+{
+	if (BTRING_LOAD(btring->head) != btring->tail)
+		return 1;
+
+	BTRING_SLEEP_UNLESS(btring, consumer_sleeping, ((BTRING_LOAD(btring->head) != btring->tail) || (BTRING_LOAD(btring->closed) != 0)), timeout_ms);
+
+	if (BTRING_LOAD(btring->head) != btring->tail)
+		return 1;
+	return ((BTRING_LOAD(btring->closed) != 0) ? -1 : 0);
+}
+
+/* CONSUMER: gets a view of the stored data (contiguous part only).
+   returns the length of data pointed by *data_p (0, if empty) */
+size_t btring_peek (btring_t *btring, uint8_t **data_p)
+{
+	size_t u_len = BTRING_LOAD(btring->head) - btring->tail;
+	size_t offs = btring->tail & btring->mask;
+
+	*data_p = btring->b + offs;
+	return (((offs + u_len) > btring->bsize) ? (btring->bsize - offs) : u_len);
+}
+
+/* CONSUMER: gets a view of all the stored data, as up to 2 chunks
+   (the ring may wrap around). iov must have room for 2 elements.
+   returns the number of iov elements filled (0, if empty) */
+int btring_peekv (btring_t *btring, struct iovec *iov)
+{
+	size_t u_len = BTRING_LOAD(btring->head) - btring->tail;
+	size_t offs = btring->tail & btring->mask;
+
+	if (u_len == 0)
+		return 0;
+	iov[0].iov_base = btring->b + offs;
+	if ((offs + u_len) <= btring->bsize) {
+		iov[0].iov_len = u_len;
+		return 1;
+	}
+	iov[0].iov_len = btring->bsize - offs;
+	iov[1].iov_base = btring->b;
+	iov[1].iov_len = u_len - iov[0].iov_len;
+	return 2;
+}
+
+/* CONSUMER: releases len bytes, previously obtained from btring_peek() or btring_peekv() */
+void btring_consume (btring_t *btring, size_t len)
+{
+	BTRING_STORE(btring->tail, btring->tail + len);
+	btring_wakeup (btring, &(btring->producer_sleeping));
+}
+
+/* either side: signals this side is gone */
+void btring_close (btring_t *btring)
+{
+	BTRING_STORE(btring->closed, 1);
+	pthread_mutex_lock (&(btring->lock));
+	pthread_cond_broadcast (&(btring->cond));
+	pthread_mutex_unlock (&(btring->lock));
+}
+
+bool btring_is_closed (btring_t *btring)
+{
+	return ((BTRING_LOAD(btring->closed) != 0) ? true : false);
+}
+
+/* BEFORE calling this, both threads must be done with btring */
+void btring_destroy (btring_t *btring)
+{
+	pthread_cond_destroy (&(btring->cond));
+	pthread_mutex_destroy (&(btring->lock));
+	free (btring->b);
+}
+
+/* rounds len up to what btmirror_alloc() accepts (multiple of page size) */
+size_t btmirror_round_len (size_t len)
+{
+	size_t page = sysconf (_SC_PAGESIZE);
+
+	return (((len + page - 1) / page) * page);
+}
+
+/* allocates len bytes of mirrored memory (2 * len of address space):
+   b[i] and b[i + len] are the same byte, for any i < len.
+   len must be a multiple of page size (see btmirror_round_len).
+   returns NULL if error, or if not supported by this system */
+uint8_t *btmirror_alloc (size_t len)
+{
+#if defined(__linux__) && defined(SYS_memfd_create)
+	uint8_t *b;
+	int fd;
+
+	if ((fd = syscall (SYS_memfd_create, "btmirror", 0)) < 0)
+		return NULL;
+	if (ftruncate (fd, len) != 0) {
+		close (fd);
+		return NULL;
+	}
+
+	/* reserve address space for both copies, then map the same pages onto each half */
+	if ((b = mmap (NULL, 2 * len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		close (fd);
+		return NULL;
+	}
+	if ((mmap (b, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) || \
+		(mmap (b + len, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+		munmap (b, 2 * len);
+		close (fd);
+		return NULL;
+	}
+	close (fd);	/* the mappings keep the memory */
+	return b;
+#else
+	return NULL;
+#endif
+}
+
+void btmirror_free (uint8_t *b, size_t len)
+{
+	munmap (b, 2 * len);
+}
@@ -21,6 +21,9 @@
 #include <stddef.h>
 #include <poll.h>
 #include <limits.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 #ifndef BUFFTOOLS_H
 #define BUFFTOOLS_H
@@ -54,5 +57,45 @@ extern size_t btfifo_get_free_len (btfifo_t *btfifo);
 extern size_t btfifo_get_stored_len (btfifo_t *btfifo);
 extern void btfifo_destroy (btfifo_t *btfifo);
 
+#define BTRING_BUFF_MINSIZE 4096
+
+/* single-producer/single-consumer ring, shared between two threads.
+   data positions are exchanged lock-free, the mutex/condition pair is used
+   only to put a thread to sleep when the ring is empty (consumer)
+   or full (producer). */
+typedef struct {
+	/* this must be initialized before calling btring_create() */
+	size_t bsize;	/* buffer size, rounded up to a power of 2 (>= BTRING_BUFF_MINSIZE) */
+
+	/* PRIVATE */
+	uint8_t *b;
+	size_t mask;		/* bsize - 1 */
+	size_t head;		/* total bytes written (written by producer only) - atomic access */
+	size_t tail;		/* total bytes consumed (written by consumer only) - atomic access */
+	int closed;		/* !=0, one of the sides is gone - atomic access */
+	int producer_sleeping;	/* !=0, producer waits for free space - atomic access */
+	int consumer_sleeping;	/* !=0, consumer waits for data - atomic access */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} btring_t;
+
+extern int btring_create (btring_t *btring);
+extern int btring_write (btring_t *btring, const uint8_t *data_p, size_t data_len);
+extern int btring_wait_data (btring_t *btring, int timeout_ms);
+extern size_t btring_get_free_len (btring_t *btring);
+extern int btring_wait_empty (btring_t *btring);
+extern size_t btring_peek (btring_t *btring, uint8_t **data_p);
+extern int btring_peekv (btring_t *btring, struct iovec *iov);
+extern void btring_consume (btring_t *btring, size_t len);
+extern void btring_close (btring_t *btring);
+extern bool btring_is_closed (btring_t *btring);
+extern void btring_destroy (btring_t *btring);
+
+/* mirrored memory: the same pages mapped twice in a row, so that data
+   wrapping around the end of a circular buffer is still contiguous */
+extern size_t btmirror_round_len (size_t len);
+extern uint8_t *btmirror_alloc (size_t len);
+extern void btmirror_free (uint8_t *b, size_t len);
+
 #endif
 
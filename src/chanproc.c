@@ -0,0 +1,617 @@
+/* chanproc.c */
+/* per-channel stream processing routines */
+
+/* TaniDVR
+ * Copyright (c) 2011-2015 Daniel Mealha Cabrita
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "mctools.h"
+#include "filetools.h"
+#include "chanproc.h"
+
+/* builds the name of the next output file into chp->filename.
+   returns ==0 ok, !=0 error (already logged) */
+static int chanproc_make_filename (chanproc_t *chp)
+{
+	int ret;
+
+	if ((chp->segment_duration != 0) || (chp->segment_size != 0)) {
+		ret = outfile_expand_name_time (chp->filename, sizeof (chp->filename), chp->filename_pattern, chp->channel, time (NULL));
+	} else {
+		ret = outfile_expand_name (chp->filename, sizeof (chp->filename), chp->filename_pattern, chp->channel);
+	}
+	if (ret != 0)
+		log_printf (LOGT_FATAL, "Output filename too long.\n");
+	return ret;
+}
+
+/* filename_pattern: "%N" is replaced by the channel number,
+   NULL for no output file (see chanproc_set_broker).
+   if segmenting (segment_duration or segment_size != 0),
+   strftime() conversions are also applied at each new file. */
+/* returns NULL if error */
+chanproc_t *chanproc_init (int channel, t_mc_format mc_format_out, bool ntsc_exact_60hz, tsproc_t tsproc, const char *filename_pattern, unsigned int segment_duration, uint64_t segment_size)
+{
+	chanproc_t *chp;
+
+	if ((chp = malloc (sizeof (chanproc_t))) == NULL)
+		return NULL;
+
+	chp->channel = channel;
+	chp->mc_format_in = MC_FORM_DVR_UNKNOWN;
+	chp->mc_format_out = mc_format_out;
+	chp->tsproc = tsproc;
+	chp->main_mkv_header_pending = true;
+	chp->dstf = NULL;
+	chp->mc_parms = NULL;
+	chp->tsc = NULL;
+	chp->outfile = NULL;
+	chp->broker = NULL;
+	chp->hls = NULL;
+	chp->idxw = NULL;
+	chp->hls_segment_ts = 0;
+	chp->hls_last_ts = 0;
+	chp->hls_gop_ts = 0;
+	chp->hls_gop_len = 0;
+	chp->sbuf_ts = NULL;
+	chp->sbuf_ts_len = 0;
+	chp->segment_duration = segment_duration;
+	chp->segment_size = segment_size;
+	chp->segment_start = time (NULL);
+	chp->segment_len = 0;
+	chp->segment_name_clash_warned = false;
+	chp->output_queue_len = 0;
+	chp->output_drop = OUTFILE_DROP_NONE;
+	chp->dropping = false;
+	chp->dropped_frames = 0;
+
+	if (filename_pattern != NULL) {
+		if (strlen (filename_pattern) >= sizeof (chp->filename_pattern)) {
+			log_printf (LOGT_FATAL, "Output filename too long.\n");
+			goto init_failed;
+		}
+		strcpy (chp->filename_pattern, filename_pattern);
+		if (chanproc_make_filename (chp) != 0)
+			goto init_failed;
+
+		if ((chp->outfile = outfile_open (chp->filename)) == NULL) {
+			log_printf (LOGT_FATAL, "Unable to open output for channel %d.\n", channel);
+			goto init_failed;
+		}
+	}
+	if ((chp->dstf = dstf_init ()) == NULL) {
+		log_printf (LOGT_FATAL, "Unable to allocate dstf.\n");
+		goto init_failed;
+	}
+	if ((chp->mc_parms = mc_init (mc_format_out, ntsc_exact_60hz)) == NULL) {
+		log_printf (LOGT_FATAL, "Unable to allocate mc_parms.\n");
+		goto init_failed;
+	}
+	if (tsproc != TSPROC_NONE) {
+		if ((chp->tsc = dt_tsproc_init (chp->mc_parms, tsproc)) == NULL) {
+			log_printf (LOGT_FATAL, "Unable to allocate tsproc.\n");
+			goto init_failed;
+		}
+	}
+
+	return chp;
+
+init_failed:
+	chanproc_close (chp);
+	return NULL;
+}
+
+/* completes MKV output (Cues, SeekHead, sizes), if output allows it */
+static void chanproc_finalize_mkv (chanproc_t *chp)
+{
+	uint8_t head[MKV_MAIN_HEADER_LEN];
+	uint8_t *tail;
+	size_t tail_len;
+	size_t tail_maxlen;
+
+	if (outfile_is_seekable (chp->outfile) == false)
+		return;
+
+	tail_maxlen = dt_finalize_mkv_len (chp->mc_parms);
+	if ((tail = malloc (tail_maxlen)) == NULL) {
+		log_printf (LOGT_ERROR, "Unable to allocate MKV index (channel %d).\n", chp->channel);
+		return;
+	}
+	if (dt_finalize_mkv (chp->mc_parms, tail, &tail_len, tail_maxlen, head) == 0) {
+		if ((outfile_write (chp->outfile, tail, tail_len) != 0) || \
+			(outfile_patch (chp->outfile, 0, head, chp->mc_parms->mkv_head_len) != 0))
+			log_printf (LOGT_ERROR, "Unable to finalize MKV output (channel %d).\n", chp->channel);
+	}
+	free (tail);
+}
+
+/* outputs the pending fMP4 fragment */
+static void chanproc_finalize_fmp4 (chanproc_t *chp)
+{
+	mc_frame_view_t view;
+	struct iovec iov[2];
+
+	if (dt_finalize_fmp4 (chp->mc_parms, chp->sbuf_2, sizeof (chp->sbuf_2), &view) != 0)
+		return;
+	iov[0].iov_base = view.head_p;
+	iov[0].iov_len = view.head_len;
+	iov[1].iov_base = view.body_p;
+	iov[1].iov_len = view.body_len;
+	if (outfile_writev (chp->outfile, iov, 2) != 0)
+		log_printf (LOGT_ERROR, "Unable to finalize fMP4 output (channel %d).\n", chp->channel);
+}
+
+/* closes the current output file and starts the next one.
+   if the new filename would be the same as the current one
+   (eg. more than one segment within the same second),
+   the current file is kept for now.
+   returns ==0 ok, !=0 error (already logged, processing should stop) */
+static int chanproc_next_segment (chanproc_t *chp)
+{
+	char filename_prev[FILENAME_MAX];
+
+	strcpy (filename_prev, chp->filename);
+	if (chanproc_make_filename (chp) != 0)
+		return 4;
+	if (strcmp (filename_prev, chp->filename) == 0) {
+		if (chp->segment_name_clash_warned == false) {
+			log_printf (LOGT_WARNING, "Next segment has the same filename (%s), "
+				"postponing (channel %d).\n", chp->filename, chp->channel);
+			chp->segment_name_clash_warned = true;
+		}
+		return 0;
+	}
+
+	if (chp->mc_format_out == MC_FORM_MKV)
+		chanproc_finalize_mkv (chp);
+	if (chp->mc_format_out == MC_FORM_FMP4)
+		chanproc_finalize_fmp4 (chp);
+	outfile_close (chp->outfile);
+	if ((chp->outfile = outfile_open (chp->filename)) == NULL) {
+		log_printf (LOGT_FATAL, "Unable to open output for channel %d: %s\n", chp->channel, chp->filename);
+		return 3;
+	}
+	if (chp->idxw != NULL) {
+		/* each file has its own index */
+		idx_writer_close (chp->idxw);
+		if ((chp->idxw = idx_create (chp->filename)) == NULL)
+			log_printf (LOGT_ERROR, "Unable to create index, no longer indexing (channel %d): %s" IDX_SUFFIX "\n", chp->channel, chp->filename);
+	}
+	log_printf (LOGT_INFO, "New segment (channel %d): %s\n", chp->channel, chp->filename);
+	if ((chp->output_queue_len != 0) && (outfile_set_async (chp->outfile, chp->output_queue_len) != 0))
+		log_printf (LOGT_WARNING, "Unable to set up output queue, writing synchronously (channel %d).\n", chp->channel);
+
+	/* each file is self-contained: MKV output starts with a new main header
+	   (fMP4: init segment) */
+	chp->main_mkv_header_pending = true;
+	chp->segment_start = time (NULL);
+	chp->segment_len = 0;
+	return 0;
+}
+
+/* serves the DVR stream (as received, regardless of mc_format_out)
+   to local clients, see broker_open() for address and index.
+   returns ==0 ok, !=0 error (already logged) */
+int chanproc_set_broker (chanproc_t *chp, const char *address, int index)
+{
+	if ((chp->broker = broker_open (address, index, chp->channel)) == NULL)
+		return 1;
+	return 0;
+}
+
+/* writes HLS output (see hls_open) instead of a single output file:
+   playlist_pattern names the playlist ("%N" is replaced by the channel number),
+   a new segment is started at the first I-frame past segment_duration (seconds).
+   REQUIRES: MC_FORM_FMP4 output, no output file (see chanproc_init).
+   returns ==0 ok, !=0 error (already logged) */
+int chanproc_set_hls (chanproc_t *chp, const char *playlist_pattern, unsigned int window, unsigned int segment_duration)
+{
+	char playlist[FILENAME_MAX];
+
+	if (outfile_expand_name (playlist, sizeof (playlist), playlist_pattern, chp->channel) != 0) {
+		log_printf (LOGT_FATAL, "Output filename too long.\n");
+		return 1;
+	}
+	if ((chp->hls = hls_open (playlist, window, segment_duration)) == NULL)
+		return 1;
+	hls_segment_name (chp->hls, chp->filename, sizeof (chp->filename));
+	if ((chp->outfile = outfile_open (chp->filename)) == NULL) {
+		log_printf (LOGT_FATAL, "Unable to open output for channel %d: %s\n", chp->channel, chp->filename);
+		return 1;
+	}
+	return 0;
+}
+
+/* completes the current HLS segment and starts the next one
+   (the current frame, an I-frame, starts it).
+   returns ==0 ok, !=0 error (already logged, processing should stop) */
+static int chanproc_next_hls_segment (chanproc_t *chp)
+{
+	outfile_close (chp->outfile);
+	hls_add_segment (chp->hls, (double) (chp->mc_parms->v_timestamp - chp->hls_segment_ts) / 1000000000);	/* failure is not fatal */
+
+	hls_segment_name (chp->hls, chp->filename, sizeof (chp->filename));
+	if ((chp->outfile = outfile_open (chp->filename)) == NULL) {
+		log_printf (LOGT_FATAL, "Unable to open output for channel %d: %s\n", chp->channel, chp->filename);
+		return 3;
+	}
+	if ((chp->output_queue_len != 0) && (outfile_set_async (chp->outfile, chp->output_queue_len) != 0))
+		log_printf (LOGT_WARNING, "Unable to set up output queue, writing synchronously (channel %d).\n", chp->channel);
+
+	chp->hls_segment_ts = chp->mc_parms->v_timestamp;
+	chp->segment_len = 0;
+	return 0;
+}
+
+/* completes the last HLS segment (if any) and the playlist */
+static void chanproc_close_hls (chanproc_t *chp)
+{
+	uint64_t last_period;
+
+	if (chp->outfile == NULL) {
+		/* chanproc_set_hls() failed */
+		hls_close (chp->hls);
+		return;
+	}
+	outfile_close (chp->outfile);
+	chp->outfile = NULL;
+	if (chp->segment_len > 0) {
+		/* the last frame lasts for a frame period */
+		last_period = (chp->mc_parms->dhav_fps != 0) ? (1000000000 / chp->mc_parms->dhav_fps) : 0;
+		hls_add_segment (chp->hls, (double) (chp->hls_last_ts + last_period - chp->hls_segment_ts) / 1000000000);
+	} else {
+		unlink (chp->filename);
+	}
+	hls_close (chp->hls);
+}
+
+/* writes a keyframe index (see idx_create) alongside each output file.
+   REQUIRES: an output file (not stdout), no HLS output.
+   returns ==0 ok, !=0 error (already logged) */
+int chanproc_set_index (chanproc_t *chp)
+{
+	if ((chp->idxw = idx_create (chp->filename)) == NULL) {
+		log_printf (LOGT_FATAL, "Unable to create index for channel %d: %s" IDX_SUFFIX "\n", chp->channel, chp->filename);
+		return 1;
+	}
+	return 0;
+}
+
+/* adds the current I-frame to the index.
+   a failure only stops indexing, the recording goes on */
+static void chanproc_index_frame (chanproc_t *chp, uint64_t offset, size_t frame_len)
+{
+	idx_entry_t entry;
+
+	entry.offset = offset;
+	entry.v_timestamp = chp->mc_parms->v_timestamp;
+	entry.epoch = chp->mc_parms->dhav_epoch;
+	entry.size = frame_len;
+	if (idx_append (chp->idxw, &entry) != 0) {
+		log_printf (LOGT_ERROR, "Unable to write index, no longer indexing (channel %d).\n", chp->channel);
+		idx_writer_close (chp->idxw);
+		chp->idxw = NULL;
+	}
+}
+
+/* MKV output: adds the audio track, if the stream has audio
+   (see dt_convert_frame_to_mkv) */
+void chanproc_set_audio (chanproc_t *chp, bool audio)
+{
+	chp->mc_parms->audio = audio;
+}
+
+/* makes output asynchronous (see outfile_set_async), queue_len bytes long.
+   drop: what to do when the queue is full.
+   returns ==0 ok, !=0 error (already logged, output remains synchronous) */
+int chanproc_set_output_queue (chanproc_t *chp, size_t queue_len, outfile_drop_t drop)
+{
+	chp->output_queue_len = queue_len;
+	chp->output_drop = drop;
+	if (outfile_set_async (chp->outfile, queue_len) != 0) {
+		log_printf (LOGT_ERROR, "Unable to set up output queue (channel %d).\n", chp->channel);
+		chp->output_queue_len = 0;
+		chp->output_drop = OUTFILE_DROP_NONE;
+		return 1;
+	}
+	return 0;
+}
+
+/* process a single, whole, frame from DVR:
+   convert it (if requested) and send the resulting data to output */
+/* returns ==0 ok, !=0 error (already logged) */
+static int chanproc_process_frame (chanproc_t *chp, uint8_t *frame_p, size_t frame_len)
+{
+	mc_frame_view_t view;
+	struct iovec iov[2];
+	bool segmenting = (chp->segment_duration != 0) || (chp->segment_size != 0);
+	bool init_segment = false;
+	bool converting = (chp->mc_format_out == MC_FORM_MKV) || (chp->mc_format_out == MC_FORM_FMP4) || (chp->mc_format_out == MC_FORM_MPEGTS);
+	size_t ts_len;
+	uint8_t *ts_p;
+	uint64_t idx_offset;
+	int dtconv_ret;
+	int outfwrite_ret;
+	int ret;
+
+	if ((converting == true) || (segmenting == true) || (chp->output_drop != OUTFILE_DROP_NONE) || (chp->broker != NULL) || (chp->idxw != NULL)) {
+		if (chp->mc_format_in == MC_FORM_DHAV) {
+			/* MC_FORM_DHAV */
+			dt_collect_dhav_frame_info (chp->mc_parms, frame_p, frame_len);
+		} else {
+			/* MC_FORM_RAW_H264 */
+			dt_collect_raw_h264_frame_info (chp->mc_parms, frame_p, frame_len);
+		}
+	}
+
+	/* segmented recording: switch files at I-frames only,
+	   so that every file starts with a complete picture */
+	if ((segmenting == true) && (chp->mc_parms->frame_type == FT_VIDEO_I_FRAME) && (chp->segment_len > 0)) {
+		if (((chp->segment_duration != 0) && ((time (NULL) - chp->segment_start) >= chp->segment_duration)) || \
+			((chp->segment_size != 0) && (chp->segment_len >= chp->segment_size))) {
+			if ((ret = chanproc_next_segment (chp)) != 0)
+				return ret;
+		}
+	}
+
+	if ((converting == true) && (chp->tsproc != TSPROC_NONE) && (chp->mc_format_in == MC_FORM_DHAV)) {
+		dt_tsproc_process (chp->tsc);
+		chp->mc_parms->v_timestamp = chp->tsc->v_timestamp; /* override with fixed timestamp */
+	}
+
+	/* clients never stall the DVR stream, lagging ones skip frames instead */
+	if (chp->broker != NULL) {
+		if (broker_send_frame (chp->broker, frame_p, frame_len, (chp->mc_parms->frame_type == FT_VIDEO_I_FRAME)) != 0)
+			log_printf (LOGT_WARNING, "Unable to queue frame to clients (channel %d).\n", chp->channel);
+	}
+	if (chp->outfile == NULL)
+		return 0;
+
+	/* output queue full: drop frames (instead of stalling the input),
+	   resuming at an I-frame, so that the output remains decodable */
+	if (chp->output_drop == OUTFILE_DROP_FRAMES) {
+		if (((chp->dropping == true) && (chp->mc_parms->frame_type != FT_VIDEO_I_FRAME)) || \
+			(outfile_would_block (chp->outfile, (chp->mc_format_out == MC_FORM_MPEGTS) ? MPEGTS_OUT_MAX_LEN(frame_len) : (frame_len + CHANPROC_CONV_OVERHEAD)) == true)) {
+			if (chp->dropping == false)
+				log_printf (LOGT_WARNING, "Output is too slow, dropping frames (channel %d).\n", chp->channel);
+			chp->dropping = true;
+			chp->dropped_frames++;
+			return 0;
+		}
+		if (chp->dropping == true) {
+			log_printf (LOGT_WARNING, "Output resumed, %" PRIu64 " frames dropped (channel %d).\n", chp->dropped_frames, chp->channel);
+			chp->dropping = false;
+			chp->dropped_frames = 0;
+		}
+	}
+
+	/* index: where the I-frame output starts (see below for MKV and fMP4) */
+	idx_offset = chp->segment_len;
+
+	if (chp->mc_format_out == MC_FORM_MKV) {
+		/* only the MKV headers are built, the frame body is written in place */
+		dtconv_ret = dt_convert_frame_to_mkv (chp->mc_parms, frame_p, frame_len, chp->sbuf_2, sizeof (chp->sbuf_2), chp->main_mkv_header_pending, \
+			(chp->mc_format_in == MC_FORM_DHAV) ? chp->mc_parms->v_codec : MCODEC_V_MPEG4_ISO_ASP, &view);
+		if (dtconv_ret < 0) {
+			log_printf (LOGT_FATAL, "dt_convert_frame_to_mkv failure: %d.\n", dtconv_ret);
+			return 2;
+		}
+		if (dtconv_ret == 0) {
+			chp->main_mkv_header_pending = false;
+			/* I-frames start a cluster, past the main header (if any) */
+			idx_offset = chp->mc_parms->mkv_cluster_pos;
+		}
+	} else if (chp->mc_format_out == MC_FORM_FMP4) {
+		/* frames are output a fragment (GOP) at a time */
+		if ((chp->mc_format_in != MC_FORM_DHAV) || (chp->mc_parms->v_codec != MCODEC_V_MPEG4_ISO_AVC)) {
+			log_printf (LOGT_FATAL, "fMP4 output requires H.264 (DHAV) input (channel %d).\n", chp->channel);
+			return 2;
+		}
+		dtconv_ret = dt_convert_frame_to_fmp4 (chp->mc_parms, frame_p, frame_len, chp->sbuf_2, sizeof (chp->sbuf_2), chp->main_mkv_header_pending, &view);
+		if (dtconv_ret < 0) {
+			log_printf (LOGT_FATAL, "dt_convert_frame_to_fmp4 failure: %d.\n", dtconv_ret);
+			return 2;
+		}
+		if (dtconv_ret == 0) {
+			init_segment = chp->main_mkv_header_pending;
+			chp->main_mkv_header_pending = false;
+		}
+		if ((dtconv_ret == 0) && (chp->hls != NULL)) {
+			chp->hls_last_ts = chp->mc_parms->v_timestamp;
+			if (init_segment == true) {
+				/* HLS: the init segment goes into a file of its own */
+				chp->hls_segment_ts = chp->mc_parms->v_timestamp;
+				chp->hls_gop_ts = chp->mc_parms->v_timestamp;
+				if (hls_write_init (chp->hls, view.head_p, view.head_len) != 0)
+					return 3;
+				return 0;
+			}
+		}
+	} else if (chp->mc_format_out == MC_FORM_MPEGTS) {
+		/* TS packets interleave the frame body with their headers,
+		   the whole output is built in sbuf_ts */
+		if (chp->sbuf_ts_len < MPEGTS_OUT_MAX_LEN(frame_len)) {
+			if ((ts_p = realloc (chp->sbuf_ts, MPEGTS_OUT_MAX_LEN(frame_len))) == NULL) {
+				log_printf (LOGT_FATAL, "Unable to allocate memory.\n");
+				return 2;
+			}
+			chp->sbuf_ts = ts_p;
+			chp->sbuf_ts_len = MPEGTS_OUT_MAX_LEN(frame_len);
+		}
+		dtconv_ret = dt_convert_frame_to_mpegts (chp->mc_parms, frame_p, frame_len, chp->sbuf_ts, &ts_len, chp->sbuf_ts_len, chp->main_mkv_header_pending, \
+			(chp->mc_format_in == MC_FORM_DHAV) ? chp->mc_parms->v_codec : MCODEC_V_MPEG4_ISO_ASP);
+		if (dtconv_ret < 0) {
+			log_printf (LOGT_FATAL, "dt_convert_frame_to_mpegts failure: %d.\n", dtconv_ret);
+			return 2;
+		}
+		if (dtconv_ret == 0)
+			chp->main_mkv_header_pending = false;
+		view.head_p = chp->sbuf_ts;
+		view.head_len = ts_len;
+		view.body_p = NULL;
+		view.body_len = 0;
+	} else {
+		view.head_p = NULL;
+		view.head_len = 0;
+		view.body_p = frame_p;
+		view.body_len = frame_len;
+	}
+
+	if ((view.head_len + view.body_len) == 0)
+		return 0;
+
+	/* WARNING: blocking IO here */
+	iov[0].iov_base = view.head_p;
+	iov[0].iov_len = view.head_len;
+	iov[1].iov_base = view.body_p;
+	iov[1].iov_len = view.body_len;
+	if ((outfwrite_ret = outfile_writev (chp->outfile, iov, 2)) != 0) {
+		log_printf (LOGT_FATAL, "Unable to write to target: %d.\n", outfwrite_ret);
+		return 3;
+	}
+	chp->segment_len += view.head_len + view.body_len;
+
+	if ((chp->idxw != NULL) && (chp->mc_parms->frame_type == FT_VIDEO_I_FRAME)) {
+		/* fMP4: the I-frame starts the fragment written next,
+		   right after the previous one (or the init segment) */
+		if (chp->mc_format_out == MC_FORM_FMP4)
+			idx_offset = chp->segment_len;
+		chanproc_index_frame (chp, idx_offset, frame_len);
+	}
+
+	/* HLS: an I-frame has just completed the previous fragment (GOP),
+	   cut the segment there if long enough, or if another GOP
+	   (as long as the last one) would exceed the target duration
+	   (EXTINF, rounded, must not exceed it) */
+	if ((chp->hls != NULL) && (chp->mc_parms->frame_type == FT_VIDEO_I_FRAME) && (view.body_len > 0)) {
+		chp->hls_gop_len = chp->mc_parms->v_timestamp - chp->hls_gop_ts;
+		chp->hls_gop_ts = chp->mc_parms->v_timestamp;
+		if ((chp->mc_parms->v_timestamp >= (chp->hls_segment_ts + ((uint64_t) chp->hls->segment_duration * 1000000000))) || \
+			((chp->mc_parms->v_timestamp + chp->hls_gop_len) >= (chp->hls_segment_ts + ((uint64_t) chp->hls->target_duration * 1000000000) + 500000000))) {
+			if ((ret = chanproc_next_hls_segment (chp)) != 0)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+/* feed stream data (partial data, and/or more than one frame) as received from DVR.
+   the media container type is identified from the first chunks of data. */
+/* returns ==0 ok, !=0 error (already logged, processing should stop) */
+int chanproc_feed (chanproc_t *chp, uint8_t *src_p, size_t src_len)
+{
+	dstf_t *dstf = chp->dstf;	/* alias */
+	uint8_t *frame_p;
+	size_t frame_len;
+	int dstf_ret;
+	int ret;
+
+	if (chp->mc_format_in == MC_FORM_DVR_UNKNOWN) {
+		/* collect data until there's enough to identify
+		   the type of container */
+		if ((dstf->sq_maxlen - dstf->sq_len) >= (2 * src_len)) {
+			/* append data into dstf */
+			if (dstf_append (dstf, src_p, src_len) != 0) {
+				log_printf (LOGT_FATAL, "Unable to queue stream data (channel %d, no buffer space).\n", chp->channel);
+				return 1;
+			}
+			src_len = 0;
+
+			/* search for pattern in data stored in dstf */
+			if ((chp->mc_format_in = identify_mc_format (dstf->sq_p + dstf->sq_offs, dstf->sq_len)) == MC_FORM_DVR_UNKNOWN)
+				return 0;	/* more data is necessary */
+		} else {
+			log_printf (LOGT_ERROR, "Unable to identify media container format "
+				"from incoming stream (channel %d). Software bug or unknown "
+				"media container. PLEASE CONTACT THE DEVELOPER AND REPORT.\n", chp->channel);
+			/* assume media container is DHAV, the most commonly found,
+			   and hope for the best */
+			chp->mc_format_in = MC_FORM_DHAV;
+		}
+	}
+
+	/* grab frames from stream (in place, no copy), convert (if requested),
+	   and send the resulting data */
+	dstf_ret = 0;
+	do {
+		if (chp->mc_format_in == MC_FORM_DHAV) {
+			/* MC_FORM_DHAV */
+			dstf_ret = dstf_process_dhav_stream_to_frames (dstf, src_p, (dstf_ret > 0) ? 0 : src_len, &frame_p, &frame_len);
+		} else {
+			/* MC_FORM_RAW_H264 */
+			dstf_ret = dstf_process_raw_h264_stream_to_frames (dstf, src_p, (dstf_ret > 0) ? 0 : src_len, &frame_p, &frame_len);
+		}
+
+		if (frame_len > 0) {
+			/* there's a frame to process */
+			if ((ret = chanproc_process_frame (chp, frame_p, frame_len)) != 0)
+				return ret;
+		}
+	} while (dstf_ret > 0);
+
+	if (dstf_ret < 0) {
+		log_printf (LOGT_FATAL, "dstf_process_(dhav|raw_h264)_stream_to_frames failure: %d.\n", dstf_ret);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* feed a single, whole, DHAV frame, already extracted from stream
+   (eg. demultiplexed from a stream carrying several channels).
+   returns ==0 ok, !=0 error (already logged, processing should stop) */
+int chanproc_feed_frame (chanproc_t *chp, uint8_t *frame_p, size_t frame_len)
+{
+	chp->mc_format_in = MC_FORM_DHAV;
+	return (chanproc_process_frame (chp, frame_p, frame_len));
+}
+
+/* accepts partially initialized chanproc_t (see chanproc_init) */
+void chanproc_close (chanproc_t *chp)
+{
+	if ((chp->mc_format_out == MC_FORM_MKV) && (chp->outfile != NULL) && (chp->mc_parms != NULL))
+		chanproc_finalize_mkv (chp);
+	if ((chp->mc_format_out == MC_FORM_FMP4) && (chp->outfile != NULL) && (chp->mc_parms != NULL))
+		chanproc_finalize_fmp4 (chp);
+	if (chp->hls != NULL)
+		chanproc_close_hls (chp);
+	if (chp->idxw != NULL)
+		idx_writer_close (chp->idxw);
+	if (chp->dstf != NULL)
+		dstf_close (chp->dstf);
+	if (chp->outfile != NULL)
+		outfile_close (chp->outfile);
+	if (chp->broker != NULL)
+		broker_close (chp->broker);
+	if (chp->tsc != NULL)
+		dt_tsproc_close (chp->tsc);
+	if (chp->mc_parms != NULL)
+		mc_close (chp->mc_parms);
+	if (chp->sbuf_ts != NULL)
+		free (chp->sbuf_ts);
+	free (chp);
+}
+
@@ -0,0 +1,97 @@
+/* chanproc.h */
+/* per-channel stream processing routines */
+
+/* TaniDVR
+ * Copyright (c) 2011-2015 Daniel Mealha Cabrita
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHANPROC_H
+#define CHANPROC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include "mctools.h"
+#include "filetools.h"
+#include "broker.h"
+#include "hls.h"
+#include "idxtools.h"
+
+/* worst case growth of a frame after conversion
+   (the container headers, see dt_convert_frame_to_mkv/fmp4),
+   MPEG-TS excepted (see MPEGTS_OUT_MAX_LEN) */
+#if (MKV_MAIN_HEADER_LEN + 64) > FMP4_HEAD_MAX_LEN
+#define CHANPROC_CONV_OVERHEAD (MKV_MAIN_HEADER_LEN + 64)
+#else
+#define CHANPROC_CONV_OVERHEAD FMP4_HEAD_MAX_LEN
+#endif
+
+/* everything required to turn the media stream of a single DVR channel
+   into its output: stream -> frames -> (conversion) -> output file */
+typedef struct {
+	int channel;			/* DVR channel (informative only) */
+	t_mc_format mc_format_in;	/* media container type - input from DVR (MC_FORM_DVR_UNKNOWN until identified) */
+	t_mc_format mc_format_out;	/* media container type - output */
+	tsproc_t tsproc;		/* type of timestamp correction */
+	bool main_mkv_header_pending;	/* MKV main header, or fMP4 init segment */
+
+	/* segmented recording: a new output file is started
+	   at the first I-frame past any of these limits (0: no limit) */
+	unsigned int segment_duration;	/* seconds */
+	uint64_t segment_size;		/* bytes */
+
+	/* asynchronous output, see chanproc_set_output_queue() */
+	size_t output_queue_len;	/* bytes, 0: synchronous output */
+	outfile_drop_t output_drop;
+
+	/* PRIVATE */
+	dstf_t *dstf;
+	t_mc_parms *mc_parms;
+	t_mc_tsproc *tsc;
+	t_outfile *outfile;	/* NULL: no output file (broker only) */
+	broker_t *broker;	/* NULL: none, see chanproc_set_broker() */
+	hls_t *hls;		/* NULL: none, see chanproc_set_hls() */
+	idx_writer_t *idxw;	/* NULL: none, see chanproc_set_index() */
+	uint64_t hls_segment_ts;	/* v_timestamp at the start of the current HLS segment */
+	uint64_t hls_last_ts;		/* v_timestamp of the last frame output */
+	uint64_t hls_gop_ts;		/* v_timestamp of the last I-frame */
+	uint64_t hls_gop_len;		/* last I-frame interval (nanoseconds) */
+	uint8_t sbuf_2[CHANPROC_CONV_OVERHEAD];	/* headers of the converted frame (not always necessary) */
+	uint8_t *sbuf_ts;		/* MPEG-TS output of a frame (packetized, thus copied), NULL until needed */
+	size_t sbuf_ts_len;
+	char filename_pattern[FILENAME_MAX];
+	char filename[FILENAME_MAX];	/* current output file */
+	time_t segment_start;		/* current output file opening time */
+	uint64_t segment_len;		/* current output file length */
+	bool segment_name_clash_warned;
+	bool dropping;			/* true: dropping frames until the next I-frame */
+	uint64_t dropped_frames;	/* in the current drop streak */
+} chanproc_t;
+
+extern chanproc_t *chanproc_init (int channel, t_mc_format mc_format_out, bool ntsc_exact_60hz, tsproc_t tsproc, const char *filename_pattern, unsigned int segment_duration, uint64_t segment_size);
+extern int chanproc_set_broker (chanproc_t *chp, const char *address, int index);
+extern int chanproc_set_hls (chanproc_t *chp, const char *playlist_pattern, unsigned int window, unsigned int segment_duration);
+extern int chanproc_set_index (chanproc_t *chp);
+extern void chanproc_set_audio (chanproc_t *chp, bool audio);
+extern int chanproc_set_output_queue (chanproc_t *chp, size_t queue_len, outfile_drop_t drop);
+extern int chanproc_feed (chanproc_t *chp, uint8_t *src_p, size_t src_len);
+extern int chanproc_feed_frame (chanproc_t *chp, uint8_t *frame_p, size_t frame_len);
+extern void chanproc_close (chanproc_t *chp);
+
+#endif
+
@@ -22,22 +22,32 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <strings.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <glob.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #include "log.h"
 #include "filetools.h"
 #include "mctools.h"
 #include "dvrcontrol.h"
+#include "idxtools.h"
 #include "config.h"	/* autotools-generated */
 
-/* this buffer MUST be > than T_MC_PARMS_DHAV_STF */
+/* this MUST be >= than STREAM_IN_READ_GRANULARITY */
 #define STREAM_IN_BUFFER_LEN 2000000
-/* this MUST be <= than T_MC_PARMS_DHAV_STF */
-#define STREAM_IN_FREAD_GRANULARITY 10000
+/* this MUST be <= than T_MC_PARMS_DHAV_STF.
+   input which cannot be mapped (pipes) is read in blocks up to this size */
+#define STREAM_IN_READ_GRANULARITY 262144
 
-/* must the large enough to hold at least one whole frame */
-/* this buffer MUST > than STREAM_IN_BUFFER_LEN */
-#define STREAM_OUT_BUFFER_LEN 3000000
+/* worst case growth of a frame after conversion
+   (the MKV headers, the frame body is written in place) */
+#define STREAM_OUT_OVERHEAD (MKV_MAIN_HEADER_LEN + 64)
 
 
 struct struct_command_options {
@@ -46,9 +56,46 @@ struct struct_command_options {
 	const char *out_file;		/* never NULL, if=="\0" uses stdout instead */
 	bool ntsc_exact_60hz;
 	tsproc_t tsproc;
+	bool audio;
+	int jobs;
+	uint32_t range_from;	/* DHAV EPOCH, 0: from the start */
+	uint32_t range_to;	/* DHAV EPOCH, 0: up to the end */
+	bool batch;
+	char **batch_inputs;	/* files, directories or glob patterns */
+	int batch_inputs_n;
 } command_options;
 
 
+/* parses a DVR time (as DHAV EPOCH): "YYYY-MM-DD HH:MM[:SS]"
+   (or with 'T' as separator), as is (no time zone conversion),
+   or "@<DHAV EPOCH>".
+   returns ==0 ok, !=0 error */
+static int parse_dhav_time (const char *str, uint32_t *epoch)
+{
+	struct tm tm;
+	unsigned long long int e;
+	time_t t;
+	int n;
+
+	if (*str == '@') {
+		if ((sscanf (str + 1, "%llu", &e) != 1) || (e == 0) || (e > UINT32_MAX))
+			return 1;
+		*epoch = e;
+		return 0;
+	}
+
+	memset (&tm, 0, sizeof (tm));
+	n = sscanf (str, "%d-%d-%d%*[ T]%d:%d:%d", &(tm.tm_year), &(tm.tm_mon), &(tm.tm_mday), &(tm.tm_hour), &(tm.tm_min), &(tm.tm_sec));
+	if (n < 5)
+		return 2;
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	if (((t = timegm (&tm)) <= 0) || ((uint64_t) t > UINT32_MAX))
+		return 3;
+	*epoch = t;
+	return 0;
+}
+
 void process_command_line_arguments (int argc, char **argv)
 {
 	int option_index = 0;
@@ -66,6 +113,11 @@ void process_command_line_arguments (int argc, char **argv)
 		{"out-file", 1, 0, 'o'},
 		{"sixty-hertz-ntsc", 0, 0, 'x'},
 		{"ts-proc", 1, 0, 'r'},
+		{"audio", 0, 0, 'A'},
+		{"jobs", 1, 0, 'j'},
+		{"batch", 0, 0, 'B'},
+		{"from", 1, 0, 'F'},
+		{"to", 1, 0, 'T'},
 		{0, 0, 0, 0}
 	};
 
@@ -73,8 +125,13 @@ void process_command_line_arguments (int argc, char **argv)
 	command_options.out_file = "\0";
 	command_options.ntsc_exact_60hz = false;
 	command_options.tsproc = TSPROC_DO_CORRECT;
+	command_options.audio = false;
+	command_options.jobs = 1;
+	command_options.batch = false;
+	command_options.range_from = 0;
+	command_options.range_to = 0;
 
-	while ((option = getopt_long (argc, argv, "hc:i:o:xr:", long_options, &option_index)) != EOF) {
+	while ((option = getopt_long (argc, argv, "hc:i:o:xr:Aj:BF:T:", long_options, &option_index)) != EOF) {
 		switch (option) {
 			case 'h':
 				printf ("dhav2mkv " VERSION "\n"
@@ -94,7 +151,8 @@ void process_command_line_arguments (int argc, char **argv)
 						"along with this program.  If not, see <http://www.gnu.org/licenses/>.\n"
 						"\n\n"
 						
-						"Usage: dhav2mkv [-i <input DHAV file>] [-o <output MKV file>] [(...)] [-h]\n\n"
+						"Usage: dhav2mkv [-i <input DHAV file>] [-o <output MKV file>] [(...)] [-h]\n"
+						"       dhav2mkv -B [-o <output directory>] [(...)] <input> [<input> (...)]\n\n"
 						"-i, --in-file\n\t<input DHAV file> (default: empty -- uses stdin)\n\n"
 						"-o, --out-file\n\t<output MKV file> (default: empty -- uses stdout)\n\n"
 						"-x, --sixty-hertz-ntsc\n\t(default: not enabled)\n"
@@ -106,6 +164,29 @@ void process_command_line_arguments (int argc, char **argv)
 							"\t0 - No correction will be performed to\n"
 							"\t    the buggy DHAV stream timestamps\n"
 							"\t1 - Perform timestamp correction (default)\n\n"
+						"-A, --audio\n\t(default: not enabled)\n"
+							"\tAdd the audio track (G.711, PCM or AAC), if the stream has audio.\n"
+							"\tOutput starts once audio was found,\n"
+							"\tor at the second I-frame otherwise.\n\n"
+						"-j, --jobs\n\t<worker threads> (default: 1)\n"
+							"\tConvert a DHAV input file in parts, in parallel.\n"
+							"\tDoes not apply to stdin (sequential conversion).\n"
+							"\tWith -B, the number of files converted at once.\n\n"
+						"-F, --from\n\t<time> (default: empty -- from the start)\n"
+						"-T, --to\n\t<time> (default: empty -- up to the end)\n"
+							"\tConvert only the DHAV video recorded within this time range,\n"
+							"\tstarting at the I-frame at (or before) its start.\n"
+							"\t<time> is the DVR clock, as recorded (no time zone):\n"
+							"\t\"YYYY-MM-DD HH:MM[:SS]\", or @<DHAV EPOCH>.\n"
+							"\tA seekable input is searched, instead of read, for the start\n"
+							"\t(looked up in <input>.idx, if recorded with tanidvr -I).\n\n"
+						"-B, --batch\n\t(default: not enabled)\n"
+							"\tConvert every input given after the options: files,\n"
+							"\tdirectories (*.dav and *.dhav files within, recursively)\n"
+							"\tor glob patterns of those. Each one goes to a MKV file\n"
+							"\tof the same name, into the -o directory if defined,\n"
+							"\tor next to the input otherwise. A file which fails\n"
+							"\tis reported and skipped.\n\n"
 						"-h, --help\n\tDisplay help text (this one).\n\n"
 						"\n");
 				exit (0);
@@ -123,6 +204,27 @@ void process_command_line_arguments (int argc, char **argv)
 			case 'x':
 				command_options.ntsc_exact_60hz = true;
 				break;
+			case 'A':
+				command_options.audio = true;
+				break;
+			case 'B':
+				command_options.batch = true;
+				break;
+			case 'F':
+			case 'T':
+				if (parse_dhav_time (optarg, (option == 'F') ? &(command_options.range_from) : &(command_options.range_to)) != 0) {
+					log_printf (LOGT_ERROR, "Invalid time: %s\n", optarg);
+					exit (1);
+				}
+				break;
+			case 'j':
+				sscanf (optarg, "%d", &p);
+				if ((p < 1) || (p > 256)) {
+					log_printf (LOGT_ERROR, "Invalid number of worker threads.\n");
+					exit (1);
+				}
+				command_options.jobs = p;
+				break;
 			case 'r':
 				sscanf (optarg, "%d", &p);
 				switch (p) {
@@ -149,8 +251,76 @@ void process_command_line_arguments (int argc, char **argv)
 		}
 	}
 
+	if ((command_options.range_to != 0) && (command_options.range_to < command_options.range_from)) {
+		log_printf (LOGT_ERROR, "Time range ends before its start.\n");
+		exit (1);
+	}
+
+	if (command_options.batch == true) {
+		if (*(command_options.in_file) != '\0') {
+			log_printf (LOGT_ERROR, "Batch mode takes its inputs after the options, not from -i.\n");
+			exit (1);
+		}
+		if (optind >= argc) {
+			log_printf (LOGT_ERROR, "Batch mode requires at least one input.\n");
+			exit (1);
+		}
+		command_options.batch_inputs = argv + optind;
+		command_options.batch_inputs_n = argc - optind;
+	}
+
+}
+
+
+/* buffers for process_dhav_stream(), reused from one
+   conversion to the next (see batch conversion) */
+typedef struct {
+	uint8_t *sbuf;		/* input data (STREAM_IN_BUFFER_LEN bytes) */
+	dstf_t *dstf;
+	uint64_t in_len;	/* input taken by the last conversion (bytes) */
+} t_stream_buffers;
+
+/* return ==0 ok, !=0 error */
+static int stream_buffers_init (t_stream_buffers *sb)
+{
+	sb->in_len = 0;
+	if ((sb->sbuf = malloc (STREAM_IN_BUFFER_LEN)) == NULL)
+		return 1;
+	if ((sb->dstf = dstf_init ()) == NULL) {
+		free (sb->sbuf);
+		return 2;
+	}
+	return 0;
+}
+
+static void stream_buffers_close (t_stream_buffers *sb)
+{
+	dstf_close (sb->dstf);
+	free (sb->sbuf);
 }
 
+/* takes the I-frame at (or before) epoch from the keyframe index
+   of the input (see idx_create), if it has one: DHAV recordings
+   written by tanidvr -n 0 -I.
+   returns ==0 ok (*pos set), !=0 no usable index */
+static int process_dhav_find_indexed (const char *in_file, const uint8_t *map_p, size_t map_len, uint32_t epoch, size_t *pos)
+{
+	idx_entry_t entry;
+	idx_t *idx;
+	int ret = 1;
+
+	if ((idx = idx_open (in_file)) == NULL)
+		return 1;
+	/* the index must point at a DHAV frame (not eg. into an MKV recording) */
+	if ((idx_find_epoch (idx, epoch, &entry) == 0) && \
+		(entry.offset < map_len) && ((map_len - entry.offset) >= 4) && \
+		(memcmp (map_p + entry.offset, "DHAV", 4) == 0)) {
+		*pos = entry.offset;
+		ret = 0;
+	}
+	idx_close (idx);
+	return ret;
+}
 
 /* stream live media from dvr to file.
    a child process is opened which will talk to the DVR directly,
@@ -158,16 +328,21 @@ void process_command_line_arguments (int argc, char **argv)
 /* container: 0-raw 1-DHAV 2-Matroska */
 /* return ==0 ok, !=0 error (program should abort ASAP) */
 //int process_dhav_stream (dvrcontrol_t *dvrctl, int media_container, const char *filename)
-int process_dhav_stream (dvrcontrol_t *dvrctl, const char *in_file, const char *out_file)
+int process_dhav_stream (dvrcontrol_t *dvrctl, const char *in_file, const char *out_file, t_stream_buffers *sb)
 {
-	uint8_t sbuf_data[STREAM_IN_BUFFER_LEN];
-	uint8_t sbuf_data_2[STREAM_OUT_BUFFER_LEN]; /* secondary buffer (not always necessary) */
 	uint8_t *sbuf;
-	uint8_t *sbuf_2;
+	uint8_t sbuf_2[STREAM_OUT_OVERHEAD];	/* secondary buffer (MKV headers) */
 	ssize_t sbuf_len;
-	ssize_t sbuf_len_2;
-	uint8_t *outbuf;	/* post-processing buffer (an alias, actually), may point to sbuf or sbuf_2 */
-	size_t *outbuf_len_p;	/* similarly to outbuf, it is also an alias to sbuf_len or sbuf_len_2 */
+	uint8_t *frame_p;	/* single frame, in place within dstf (or the input mapping) */
+	size_t frame_len;
+	uint8_t *map_p;		/* whole input, NULL if not mapped */
+	size_t map_len;
+	size_t map_pos = 0;
+	size_t map_start = 0;
+	bool range_wait;	/* time range: waiting for its first I-frame */
+	bool range_end = false;	/* time range: past its end */
+	mc_frame_view_t view;	/* converted frame */
+	struct iovec iov[2];
 	t_infile *infile;
 	t_outfile *outfile;
 	t_mc_parms *mc_parms;	/* media container parms */
@@ -180,9 +355,15 @@ int process_dhav_stream (dvrcontrol_t *dvrctl, const char *in_file, const char *
 	int infread_ret;
 	t_mc_tsproc *tsc;
 	bool main_mkv_header_pending = true;
+	uint8_t *tail;		/* MKV finalization data */
+	size_t tail_len;
+	size_t tail_maxlen;
+	int ret = 0;
 
-	sbuf = sbuf_data;
-	sbuf_2 = sbuf_data_2;
+	sbuf = sb->sbuf;
+	dstf = sb->dstf;
+	dstf_reset (dstf);
+	sb->in_len = 0;
 
 	/* TODO: write this in a less kludgy way */
 	if ((infile = infile_open (in_file)) == NULL) {
@@ -194,21 +375,14 @@ int process_dhav_stream (dvrcontrol_t *dvrctl, const char *in_file, const char *
 		infile_close (infile);
 		return 4;
 	}
-	if ((dstf = dstf_init ()) == NULL) {
-		log_printf (LOGT_FATAL, "Unable to allocate dstf.\n");
-		infile_close (infile);
-		outfile_close (outfile);
-		return 7;
-	}
 
 	/* define mc_format (output file container, which is MKV) */
 	mc_format_out = MC_FORM_MKV;
-	outbuf = sbuf_2;
-	outbuf_len_p = &sbuf_len_2;
 
 	/* we initialize this later, to avoid allocation
 	   just before several other things may fail */
 	mc_parms = mc_init (mc_format_out, dvrctl->ntsc_exact_60hz);	/* FIXME: error should be checked */
+	mc_parms->audio = dvrctl->audio;
 
 	if (dvrctl->tsproc != TSPROC_NONE) {
 		tsc = dt_tsproc_init (mc_parms, dvrctl->tsproc); /* FIXME: error should be checked */
@@ -218,8 +392,20 @@ int process_dhav_stream (dvrcontrol_t *dvrctl, const char *in_file, const char *
 	   the type of container */
 	log_printf (LOGT_INFO, "Identifying type of media container in stream...\n");
 	mc_format_in = MC_FORM_DVR_UNKNOWN;
-	while ((dstf->sq_maxlen - dstf->sq_len) >= (2 * STREAM_IN_FREAD_GRANULARITY)) {
-		infread_ret = sbuf_len = infile_read (infile, sbuf, STREAM_IN_FREAD_GRANULARITY);
+
+	/* DHAV from a regular file: frames are taken from the
+	   mapped file (no reads, no copies) */
+	if ((map_p = infile_map (infile, &map_len)) != NULL) {
+		mc_format_in = identify_mc_format (map_p, (map_len < T_MC_PARMS_DHAV_STF) ? map_len : T_MC_PARMS_DHAV_STF);
+		if (mc_format_in == MC_FORM_RAW_H264) {
+			/* read as a stream (dstf) instead */
+			map_p = NULL;
+			mc_format_in = MC_FORM_DVR_UNKNOWN;
+		}
+	}
+
+	while ((map_p == NULL) && (dstf->sq_len < T_MC_PARMS_DHAV_STF)) {
+		infread_ret = sbuf_len = infile_read (infile, sbuf, STREAM_IN_READ_GRANULARITY);
 
 		if (infread_ret <= 0) {
 			log_printf (LOGT_INFO, "No more data to read.\n");
@@ -228,8 +414,11 @@ int process_dhav_stream (dvrcontrol_t *dvrctl, const char *in_file, const char *
 
 		if (sbuf_len > 0) {
 			/* append data into dstf */
-			memcpy ((dstf->sq_p + dstf->sq_offs + dstf->sq_len), sbuf, sbuf_len);
-			dstf->sq_len += sbuf_len;
+			if (dstf_append (dstf, sbuf, sbuf_len) != 0) {
+				log_printf (LOGT_FATAL, "Unable to queue stream data (no buffer space).\n");
+				ret = 5;
+				break;
+			}
 
 			/* search for pattern in data stored in dstf */
 			mc_format_in = identify_mc_format (dstf->sq_p + dstf->sq_offs, dstf->sq_len);
@@ -238,7 +427,7 @@ int process_dhav_stream (dvrcontrol_t *dvrctl, const char *in_file, const char *
 			}
 		}
 	}
-	if (mc_format_in == MC_FORM_DVR_UNKNOWN) {
+	if ((ret == 0) && (mc_format_in == MC_FORM_DVR_UNKNOWN)) {
 		log_printf (LOGT_ERROR, "Unable to identify media container format "
 			"from incoming stream. Software bug or unknown "
 			"media container. PLEASE CONTACT THE DEVELOPER AND REPORT.\n");
@@ -247,38 +436,76 @@ int process_dhav_stream (dvrcontrol_t *dvrctl, const char *in_file, const char *
 		mc_format_in = MC_FORM_DHAV;
 	}
 
+	/* time range: the mapped input starts right at the I-frame
+	   (at or before the range start), otherwise frames are dropped
+	   up to the first I-frame at (or after) the range start */
+	range_wait = (dvrctl->range_from != 0);
+	if ((range_wait == true) && (map_p != NULL)) {
+		if (process_dhav_find_indexed (in_file, map_p, map_len, dvrctl->range_from, &map_pos) == 0) {
+			log_printf (LOGT_INFO, "Time range starts at input offset %zu (keyframe index).\n", map_pos);
+		} else {
+			map_pos = dt_find_dhav_i_frame_at_epoch (map_p, map_len, dvrctl->range_from);
+			log_printf (LOGT_INFO, "Time range starts at input offset %zu.\n", map_pos);
+		}
+		map_start = map_pos;
+		range_wait = false;
+	}
 
-	while (1) {
+
+	while (ret == 0) {
 		/* read-and-convert loop */
 
-		/* WARNING: blocking IO here */
-		infread_ret = sbuf_len = infile_read (infile, sbuf, STREAM_IN_FREAD_GRANULARITY);
-		DEBUG_LOG_PRINTF ("read from input stream: %d bytes\n", sbuf_len);
+		if (map_p == NULL) {
+			/* WARNING: blocking IO here */
+			infread_ret = sbuf_len = infile_read (infile, sbuf, STREAM_IN_READ_GRANULARITY);
+			DEBUG_LOG_PRINTF ("read from input stream: %d bytes\n", sbuf_len);
+			sb->in_len += sbuf_len;
+		} else {
+			/* mapped: the whole input at once */
+			infread_ret = sbuf_len = 0;
+		}
 
 		/* grab frames from stream, convert,
 		   and send the resulting data */
 		dstf_ret = dtconv_ret = outfwrite_ret = 0;
 		do {
-			/* note: this reads and writes back into the same buffer (sbuf) */
-			if (mc_format_in == MC_FORM_DHAV) {
+			/* frames are taken in place (no copy) */
+			if (map_p != NULL) {
+				/* MC_FORM_DHAV, mapped */
+				dstf_ret = dt_next_dhav_frame (map_p, map_len, &map_pos, &frame_p, &frame_len);
+			} else if (mc_format_in == MC_FORM_DHAV) {
 				/* MC_FORM_DHAV */
-				dstf_ret = dstf_process_dhav_stream_to_frames (dstf, sbuf, (dstf_ret > 0) ? 0 : sbuf_len, sbuf, &sbuf_len, STREAM_IN_BUFFER_LEN);
+				dstf_ret = dstf_process_dhav_stream_to_frames (dstf, sbuf, (dstf_ret > 0) ? 0 : sbuf_len, &frame_p, &frame_len);
 			} else {
 				/* MC_FORM_RAW_H264 */
-				dstf_ret = dstf_process_raw_h264_stream_to_frames (dstf, sbuf, (dstf_ret > 0) ? 0 : sbuf_len, sbuf, &sbuf_len, STREAM_IN_BUFFER_LEN);
+				dstf_ret = dstf_process_raw_h264_stream_to_frames (dstf, sbuf, (dstf_ret > 0) ? 0 : sbuf_len, &frame_p, &frame_len);
 			}
 
-			if (sbuf_len > 0) {
+			if (frame_len > 0) {
 				/* there's a frame to process */
 
 				/* convert DHAV/RAW_H264 data to MKV */
 				if (mc_format_in == MC_FORM_DHAV) {
 					/* MC_FORM_DHAV */
-					dt_collect_dhav_frame_info (mc_parms, sbuf, sbuf_len);
+					dt_collect_dhav_frame_info (mc_parms, frame_p, frame_len);
 				} else {
 					/* MC_FORM_RAW_H264 */
-					dt_collect_raw_h264_frame_info (mc_parms, sbuf, sbuf_len);
+					dt_collect_raw_h264_frame_info (mc_parms, frame_p, frame_len);
+				}
+
+				/* time range, from DHAV video frames EPOCH */
+				if ((mc_format_in == MC_FORM_DHAV) && \
+					((mc_parms->frame_type == FT_VIDEO_I_FRAME) || (mc_parms->frame_type == FT_VIDEO_FRAME))) {
+					if ((dvrctl->range_to != 0) && (mc_parms->dhav_epoch > dvrctl->range_to)) {
+						range_end = true;
+						break;
+					}
+					if ((range_wait == true) && (mc_parms->frame_type == FT_VIDEO_I_FRAME) && \
+						(mc_parms->dhav_epoch >= dvrctl->range_from))
+						range_wait = false;
 				}
+				if (range_wait == true)
+					continue;
 
 				if ((dvrctl->tsproc != TSPROC_NONE) && (mc_format_in == MC_FORM_DHAV)) {
 					dt_tsproc_process (tsc);
@@ -286,49 +513,853 @@ int process_dhav_stream (dvrcontrol_t *dvrctl, const char *in_file, const char *
 				}
 				if (mc_format_in == MC_FORM_DHAV) {
 					/* MC_FORM_DHAV */
-					dtconv_ret = dt_convert_frame_to_mkv (mc_parms, sbuf, sbuf_len, sbuf_2, &sbuf_len_2, STREAM_OUT_BUFFER_LEN, main_mkv_header_pending, MCODEC_V_MPEG4_ISO_AVC);
+					dtconv_ret = dt_convert_frame_to_mkv (mc_parms, frame_p, frame_len, sbuf_2, sizeof (sbuf_2), main_mkv_header_pending, mc_parms->v_codec, &view);
 				} else {
 					/* MC_FORM_RAW_H264 */
-					dtconv_ret = dt_convert_frame_to_mkv (mc_parms, sbuf, sbuf_len, sbuf_2, &sbuf_len_2, STREAM_OUT_BUFFER_LEN, main_mkv_header_pending, MCODEC_V_MPEG4_ISO_ASP);
+					dtconv_ret = dt_convert_frame_to_mkv (mc_parms, frame_p, frame_len, sbuf_2, sizeof (sbuf_2), main_mkv_header_pending, MCODEC_V_MPEG4_ISO_ASP, &view);
 				}
 				if (dtconv_ret == 0)
 					main_mkv_header_pending = false;
 
 				/* WARNING: blocking IO here */
-				if ((outfwrite_ret = outfile_write (outfile, outbuf, *outbuf_len_p)) != 0)
+				iov[0].iov_base = view.head_p;
+				iov[0].iov_len = view.head_len;
+				iov[1].iov_base = view.body_p;
+				iov[1].iov_len = view.body_len;
+				if ((outfwrite_ret = outfile_writev (outfile, iov, 2)) != 0)
 					break;
 			}
 		} while (dstf_ret > 0);
 
 		if (dstf_ret < 0) {
 			log_printf (LOGT_FATAL, "dstf_process_(dhav|h_264)_stream_to_frames failure: %d.\n", dstf_ret);
+			ret = 5;
 			break;
 		}
 		if (dtconv_ret < 0) {
 			log_printf (LOGT_FATAL, "dt_convert_frame_to_mkv failure: %d.\n", dtconv_ret);
-			break;
-		}
-		if (infread_ret <= 0) {
-			log_printf (LOGT_INFO, "No more data to read.\n");
+			ret = 5;
 			break;
 		}
 		if (outfwrite_ret != 0) {
 			log_printf (LOGT_FATAL, "Unable to write to target: %d.\n", outfwrite_ret);
+			ret = 6;
 			break;
 		}
+		if (range_end == true) {
+			log_printf (LOGT_INFO, "End of time range.\n");
+			break;
+		}
+		if (infread_ret <= 0) {
+			log_printf (LOGT_INFO, "No more data to read.\n");
+			break;
+		}
+
+	}
+	if (map_p != NULL)
+		sb->in_len = map_pos - map_start;
+
+	if ((ret == 0) && (mc_parms->mkv_has_head == false)) {
+		log_printf (LOGT_ERROR, "No video found in stream.\n");
+		ret = 9;
+	}
 
+	/* complete MKV output (Cues, SeekHead, sizes), if output allows it */
+	if (outfile_is_seekable (outfile) == true) {
+		tail_maxlen = dt_finalize_mkv_len (mc_parms);
+		if ((tail = malloc (tail_maxlen)) == NULL) {
+			log_printf (LOGT_ERROR, "Unable to allocate MKV index.\n");
+		} else {
+			if (dt_finalize_mkv (mc_parms, tail, &tail_len, tail_maxlen, sbuf) == 0) {
+				if ((outfile_write (outfile, tail, tail_len) != 0) || \
+					(outfile_patch (outfile, 0, sbuf, mc_parms->mkv_head_len) != 0))
+					log_printf (LOGT_ERROR, "Unable to finalize MKV output.\n");
+			}
+			free (tail);
+		}
 	}
 
-	dstf_close (dstf);
 	infile_close (infile);
 	outfile_close (outfile);
 	if (dvrctl->tsproc != TSPROC_NONE) {
 		dt_tsproc_close (tsc);
 	}
 	mc_close (mc_parms);
+	return ret;
+}
+
+
+
+/* PARALLEL CONVERSION (see -j)
+   a DHAV input file is split into parts (at I-frames), which are
+   converted independently (into memory) by worker threads.
+   the converted parts are output in order, as a single MKV:
+   every part but the first goes without its main header, with its
+   timecodes shifted to follow the previous part. */
+
+/* nominal input length of a part (bytes),
+   the actual part extends up to the next I-frame */
+#define PARALLEL_PART_LEN (16 * 1048576)
+
+/* converted parts held in memory at most, per worker thread */
+#define PARALLEL_PARTS_PER_WORKER 2
+
+typedef struct {
+	bool done;		/* true: converted (or failed, see ret) */
+	int ret;		/* ==0 ok, !=0 error */
+	t_mc_parms *mc_parms;	/* conversion state, kept for stitching */
+	uint8_t *out_p;		/* converted part, main header included */
+	size_t out_len;
+	size_t out_maxlen;
+
+	/* first and last video frames output, for the timestamps between parts */
+	bool has_video;
+	uint64_t first_v_timestamp;	/* nsec */
+	uint64_t last_v_timestamp;	/* nsec */
+	uint32_t last_epoch;
+	uint16_t last_dhav_ts;
+	uint32_t first_epoch;
+	uint16_t first_dhav_ts;
+} t_part;
+
+typedef struct {
+	const dvrcontrol_t *dvrctl;
+	const uint8_t *map_p;	/* whole input */
+	size_t map_len;
+	const t_mc_parms *a_parms;	/* audio parameters for the parts after the first, NULL: video only */
+
+	t_part *parts;
+	size_t parts_n;
+	size_t window;		/* converted parts held in memory at most */
+	size_t next_part;	/* next part to be converted */
+	size_t output_part;	/* next part to be output */
+	bool abort;		/* workers running: access under mutex only */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} t_parallel;
+
+
+/* start of part i within the input: the first I-frame after its nominal start */
+static size_t parallel_part_start (const t_parallel *par, size_t i)
+{
+	if (i == 0)
+		return 0;
+	if (i >= par->parts_n)
+		return par->map_len;
+	return (dt_find_dhav_i_frame (par->map_p, par->map_len, i * PARALLEL_PART_LEN));
+}
+
+/* appends data to the converted part, returns ==0 ok, !=0 error */
+static int parallel_part_append (t_part *part, const uint8_t *data_p, size_t data_len)
+{
+	uint8_t *p;
+	size_t maxlen;
+
+	if (data_len > (part->out_maxlen - part->out_len)) {
+		maxlen = (part->out_maxlen == 0) ? data_len : part->out_maxlen;
+		while (data_len > (maxlen - part->out_len))
+			maxlen *= 2;
+		if ((p = realloc (part->out_p, maxlen)) == NULL)
+			return 1;
+		part->out_p = p;
+		part->out_maxlen = maxlen;
+	}
+	memcpy (part->out_p + part->out_len, data_p, data_len);
+	part->out_len += data_len;
 	return 0;
 }
 
+/* true: the conversion was aborted (par->abort, set under par->mutex) */
+static bool parallel_aborted (t_parallel *par)
+{
+	bool aborted;
+
+	pthread_mutex_lock (&(par->mutex));
+	aborted = par->abort;
+	pthread_mutex_unlock (&(par->mutex));
+	return aborted;
+}
+
+/* converts the input from start up to end (excluding frames starting there)
+   into part, as a standalone MKV.
+   return ==0 ok, !=0 error */
+static int parallel_convert_part (t_parallel *par, t_part *part, size_t start, size_t end)
+{
+	const dvrcontrol_t *dvrctl = par->dvrctl;
+	uint8_t sbuf_2[STREAM_OUT_OVERHEAD];	/* MKV headers */
+	uint8_t *frame_p;
+	size_t frame_len;
+	size_t pos = start;
+	mc_frame_view_t view;
+	t_mc_parms *mc_parms;
+	t_mc_tsproc *tsc = NULL;
+	bool main_mkv_header_pending = true;
+	bool aborted = false;
+	uint64_t cluster_checked = 0;
+	int dtconv_ret;
+	int ret = 0;
+
+	if ((mc_parms = mc_init (MC_FORM_MKV, dvrctl->ntsc_exact_60hz)) == NULL) {
+		log_printf (LOGT_FATAL, "Unable to allocate mc_parms.\n");
+		return 1;
+	}
+	part->mc_parms = mc_parms;
+	mc_parms->mkv_log_blocks = true;	/* timecodes are rewritten on output, see dt_mkv_append_part */
+	mc_parms->audio = (dvrctl->audio == true) && (par->a_parms != NULL);
+	if ((mc_parms->audio == true) && (part != par->parts)) {
+		/* every part declares the same audio track,
+		   the first one waits for it as process_dhav_stream does */
+		mc_parms->has_a_parms = true;
+		mc_parms->a_codec = par->a_parms->a_codec;
+		mc_parms->a_channels = par->a_parms->a_channels;
+		mc_parms->a_sample_rate = par->a_parms->a_sample_rate;
+		memcpy (mc_parms->a_aac_config, par->a_parms->a_aac_config, sizeof (mc_parms->a_aac_config));
+	}
+	if ((dvrctl->tsproc != TSPROC_NONE) && ((tsc = dt_tsproc_init (mc_parms, dvrctl->tsproc)) == NULL)) {
+		log_printf (LOGT_FATAL, "Unable to allocate tsproc.\n");
+		return 2;
+	}
+
+	/* MKV is not larger than DHAV, besides its main header */
+	if ((end > start) && ((part->out_p = malloc (end - start + STREAM_OUT_OVERHEAD)) != NULL))
+		part->out_maxlen = end - start + STREAM_OUT_OVERHEAD;
+
+	while ((pos < end) && (aborted == false) && \
+		(dt_next_dhav_frame (par->map_p, par->map_len, &pos, &frame_p, &frame_len) == 1)) {
+		/* past garbage, the frame may belong to the next part already */
+		if ((size_t) (frame_p - par->map_p) >= end)
+			break;
+
+		dt_collect_dhav_frame_info (mc_parms, frame_p, frame_len);
+		if (tsc != NULL) {
+			dt_tsproc_process (tsc);
+			mc_parms->v_timestamp = tsc->v_timestamp; /* override with fixed timestamp */
+		}
+		dtconv_ret = dt_convert_frame_to_mkv (mc_parms, frame_p, frame_len, sbuf_2, sizeof (sbuf_2), main_mkv_header_pending, mc_parms->v_codec, &view);
+		if (dtconv_ret < 0) {
+			log_printf (LOGT_FATAL, "dt_convert_frame_to_mkv failure: %d.\n", dtconv_ret);
+			ret = 3;
+			break;
+		}
+		if (dtconv_ret != 0)
+			continue;
+		main_mkv_header_pending = false;
+
+		if (mc_parms->frame_type != FT_AUDIO_FRAME) {
+			if (part->has_video == false) {
+				part->has_video = true;
+				part->first_v_timestamp = mc_parms->v_timestamp;
+				part->first_epoch = mc_parms->dhav_epoch;
+				part->first_dhav_ts = mc_parms->v_dhav_ts;
+			}
+			part->last_v_timestamp = mc_parms->v_timestamp;
+			part->last_epoch = mc_parms->dhav_epoch;
+			part->last_dhav_ts = mc_parms->v_dhav_ts;
+		}
+
+		if ((parallel_part_append (part, view.head_p, view.head_len) != 0) || \
+			(parallel_part_append (part, view.body_p, view.body_len) != 0)) {
+			log_printf (LOGT_FATAL, "Unable to allocate converted data.\n");
+			ret = 4;
+			break;
+		}
+
+		/* another part failed ? checked once per cluster */
+		if (mc_parms->mkv_cluster_pos != cluster_checked) {
+			cluster_checked = mc_parms->mkv_cluster_pos;
+			aborted = parallel_aborted (par);
+		}
+	}
+
+	if (tsc != NULL)
+		dt_tsproc_close (tsc);
+	return ret;
+}
+
+/* worker thread: converts parts in order, as long as they fit in the window */
+static void *parallel_worker (void *arg)
+{
+	t_parallel *par = (t_parallel *) arg;
+	size_t i;
+	int ret;
+
+	pthread_mutex_lock (&(par->mutex));
+	while (1) {
+		while ((par->abort == false) && (par->next_part < par->parts_n) && \
+			(par->next_part >= (par->output_part + par->window)))
+			pthread_cond_wait (&(par->cond), &(par->mutex));
+		if ((par->abort == true) || (par->next_part >= par->parts_n))
+			break;
+		i = par->next_part++;
+		pthread_mutex_unlock (&(par->mutex));
+
+		ret = parallel_convert_part (par, &(par->parts[i]), parallel_part_start (par, i), parallel_part_start (par, i + 1));
+
+		pthread_mutex_lock (&(par->mutex));
+		par->parts[i].ret = ret;
+		par->parts[i].done = true;
+		pthread_cond_broadcast (&(par->cond));
+	}
+	pthread_mutex_unlock (&(par->mutex));
+
+	return NULL;
+}
+
+/* audio parameters, from the start of the input up to the second I-frame
+   (as dt_convert_frame_to_mkv() waits for them).
+   returns an allocated t_mc_parms with has_a_parms==true, NULL if none found */
+static t_mc_parms *parallel_find_audio_parms (const t_parallel *par)
+{
+	t_mc_parms *mc_parms;
+	uint8_t *frame_p;
+	size_t frame_len;
+	size_t pos = 0;
+	int i_frames = 0;
+
+	if ((mc_parms = mc_init (MC_FORM_MKV, par->dvrctl->ntsc_exact_60hz)) == NULL)
+		return NULL;
+	while ((mc_parms->has_a_parms == false) && (i_frames < 2) && \
+		(dt_next_dhav_frame (par->map_p, par->map_len, &pos, &frame_p, &frame_len) == 1)) {
+		dt_collect_dhav_frame_info (mc_parms, frame_p, frame_len);
+		if ((mc_parms->frame_type == FT_VIDEO_I_FRAME) && (mc_parms->has_v_parms == true))
+			i_frames++;
+	}
+	if ((mc_parms->has_a_parms == false) || (mc_parms->a_codec == MCODEC_A_UNSUPPORTED)) {
+		mc_close (mc_parms);
+		return NULL;
+	}
+
+	return mc_parms;
+}
+
+static void parallel_free_part (t_part *part)
+{
+	free (part->out_p);
+	part->out_p = NULL;
+}
+
+/* converts a DHAV file using several worker threads (see process_dhav_stream).
+   return ==0 ok ; <0 not possible (input is not a DHAV file, etc),
+   nothing done ; >0 error (program should abort ASAP) */
+int process_dhav_file_parallel (dvrcontrol_t *dvrctl, const char *in_file, const char *out_file, int workers)
+{
+	t_parallel par;
+	t_infile *infile;
+	t_outfile *outfile;
+	pthread_t *threads;
+	int threads_n = 0;
+	t_part *part;
+	t_mc_parms *base = NULL;	/* first part output, main header included */
+	t_mc_parms *a_parms = NULL;
+	t_mc_format mc_format_in;
+	const t_part *prev = NULL;	/* last part output */
+	uint64_t offset = 0;		/* timestamp of the current part start (nsec), as of the first part */
+	uint8_t head[MKV_MAIN_HEADER_LEN];
+	uint8_t *tail;		/* MKV finalization data */
+	size_t tail_len;
+	size_t tail_maxlen;
+	size_t i;
+	int ret = 0;
+
+	if ((infile = infile_open (in_file)) == NULL) {
+		log_printf (LOGT_FATAL, "Unable to read DHAV stream data.\n");
+		return 4;
+	}
+	memset (&par, 0, sizeof (par));
+	par.dvrctl = dvrctl;
+	if ((par.map_p = infile_map (infile, &(par.map_len))) == NULL) {
+		log_printf (LOGT_INFO, "Input cannot be mapped, converting sequentially.\n");
+		infile_close (infile);
+		return -1;
+	}
+	/* as process_dhav_stream(), DHAV is assumed if unidentified */
+	mc_format_in = identify_mc_format ((uint8_t *) par.map_p, (par.map_len < T_MC_PARMS_DHAV_STF) ? par.map_len : T_MC_PARMS_DHAV_STF);
+	if ((mc_format_in != MC_FORM_DHAV) && (mc_format_in != MC_FORM_DVR_UNKNOWN)) {
+		log_printf (LOGT_INFO, "Input is not DHAV, converting sequentially.\n");
+		infile_close (infile);
+		return -2;
+	}
+	par.parts_n = (par.map_len + PARALLEL_PART_LEN - 1) / PARALLEL_PART_LEN;
+	if (par.parts_n < 2) {
+		infile_close (infile);
+		return -3;
+	}
+
+	if ((outfile = outfile_open (out_file)) == NULL) {
+		log_printf (LOGT_FATAL, "Unable to output MKV stream data.\n");
+		infile_close (infile);
+		return 4;
+	}
+	par.window = workers * PARALLEL_PARTS_PER_WORKER;
+	par.parts = calloc (par.parts_n, sizeof (t_part));
+	threads = calloc (workers, sizeof (pthread_t));
+	if ((par.parts == NULL) || (threads == NULL)) {
+		log_printf (LOGT_FATAL, "Unable to allocate parallel conversion.\n");
+		free (par.parts);
+		free (threads);
+		infile_close (infile);
+		outfile_close (outfile);
+		return 7;
+	}
+
+	if (dvrctl->audio == true) {
+		if ((par.a_parms = a_parms = parallel_find_audio_parms (&par)) == NULL)
+			log_printf (LOGT_WARNING, "No audio found in stream, output has video only.\n");
+	}
+
+	log_printf (LOGT_INFO, "Converting %zu parts, %d worker threads.\n", par.parts_n, workers);
+	pthread_mutex_init (&(par.mutex), NULL);
+	pthread_cond_init (&(par.cond), NULL);
+	for (threads_n = 0; threads_n < workers; threads_n++) {
+		if (pthread_create (&(threads[threads_n]), NULL, parallel_worker, &par) != 0)
+			break;
+	}
+	if (threads_n == 0) {
+		log_printf (LOGT_FATAL, "Unable to start worker threads.\n");
+		par.abort = true;
+		ret = 8;
+	}
+
+	/* output parts in order, as they are done */
+	for (i = 0; (i < par.parts_n) && (ret == 0); i++) {
+		part = &(par.parts[i]);
+		pthread_mutex_lock (&(par.mutex));
+		while (part->done == false)
+			pthread_cond_wait (&(par.cond), &(par.mutex));
+		pthread_mutex_unlock (&(par.mutex));
+
+		if (part->ret != 0) {
+			ret = 5;
+			if (part->mc_parms != NULL)
+				mc_close (part->mc_parms);
+		} else if ((part->mc_parms != NULL) && (part->mc_parms->mkv_has_head == true)) {
+			if (base == NULL) {
+				/* first output: as is */
+				base = part->mc_parms;
+				offset = part->first_v_timestamp;
+				if (outfile_write (outfile, part->out_p, part->out_len) != 0)
+					ret = 6;
+			} else {
+				/* next output: follows the previous one */
+				offset += (prev->last_v_timestamp - prev->first_v_timestamp) + \
+					dt_tsproc_period (prev->mc_parms, dvrctl->tsproc, prev->last_epoch, prev->last_dhav_ts, part->first_epoch, part->first_dhav_ts);
+				dt_mkv_append_part (base, part->mc_parms, part->out_p, (int64_t) offset - (int64_t) part->first_v_timestamp);
+				if (outfile_write (outfile, part->out_p + part->mc_parms->mkv_head_len, part->out_len - part->mc_parms->mkv_head_len) != 0)
+					ret = 6;
+			}
+			if ((prev != NULL) && (prev->mc_parms != base))
+				mc_close (prev->mc_parms);
+			prev = part;
+		} else if (part->mc_parms != NULL) {
+			/* nothing output */
+			mc_close (part->mc_parms);
+		}
+		parallel_free_part (part);
+
+		pthread_mutex_lock (&(par.mutex));
+		par.output_part = i + 1;
+		if (ret != 0)
+			par.abort = true;
+		pthread_cond_broadcast (&(par.cond));
+		pthread_mutex_unlock (&(par.mutex));
+	}
+	if (ret == 5)
+		log_printf (LOGT_FATAL, "Unable to convert part %zu.\n", i - 1);
+	if (ret == 6)
+		log_printf (LOGT_FATAL, "Unable to write to target.\n");
+
+	while (threads_n > 0)
+		pthread_join (threads[--threads_n], NULL);
+
+	/* complete MKV output (Cues, SeekHead, sizes), if output allows it */
+	if ((ret == 0) && (base != NULL) && (outfile_is_seekable (outfile) == true)) {
+		tail_maxlen = dt_finalize_mkv_len (base);
+		if ((tail = malloc (tail_maxlen)) == NULL) {
+			log_printf (LOGT_ERROR, "Unable to allocate MKV index.\n");
+		} else {
+			if (dt_finalize_mkv (base, tail, &tail_len, tail_maxlen, head) == 0) {
+				if ((outfile_write (outfile, tail, tail_len) != 0) || \
+					(outfile_patch (outfile, 0, head, base->mkv_head_len) != 0))
+					log_printf (LOGT_ERROR, "Unable to finalize MKV output.\n");
+			}
+			free (tail);
+		}
+	}
+
+	/* parts not output (on error) */
+	for (i = par.output_part; i < par.parts_n; i++) {
+		parallel_free_part (&(par.parts[i]));
+		if (par.parts[i].mc_parms != NULL)
+			mc_close (par.parts[i].mc_parms);
+	}
+	if ((prev != NULL) && (prev->mc_parms != base))
+		mc_close (prev->mc_parms);
+	if (base != NULL)
+		mc_close (base);
+	if (a_parms != NULL)
+		mc_close (a_parms);
+
+	pthread_mutex_destroy (&(par.mutex));
+	pthread_cond_destroy (&(par.cond));
+	free (threads);
+	free (par.parts);
+	infile_close (infile);
+	outfile_close (outfile);
+	return ret;
+}
+
+
+/* BATCH CONVERSION (see -B)
+   every input file is converted into its own MKV (see process_dhav_stream),
+   several files at once: one per worker thread, each with its own buffers
+   for all of its files. a file which fails is reported and skipped. */
+
+typedef struct {
+	dvrcontrol_t *dvrctl;
+	const char *out_dir;	/* "\0": output next to each input file */
+	char **files;		/* input files, NULL: listed more than once (see batch_check_out_names) */
+	char **out_files;	/* output file of each input, NULL: none usable (already reported) */
+	size_t files_n;
+	size_t files_max;
+	size_t next_file;	/* next file to be converted */
+	size_t converted_n;
+	size_t failed_n;
+	size_t repeated_n;	/* inputs listed more than once */
+	uint64_t in_len;	/* input converted so far (bytes) */
+	pthread_mutex_t mutex;
+} t_batch;
+
+
+/* output file name: the input one, with ".mkv" as extension,
+   in out_dir (if defined).
+   returns ==0 ok, !=0 error */
+static int batch_out_name (char *dst, size_t dst_len, const char *in_file, const char *out_dir)
+{
+	const char *name;
+	const char *ext;
+	int name_len;
+
+	name = ((*out_dir != '\0') && (strrchr (in_file, '/') != NULL)) ? (strrchr (in_file, '/') + 1) : in_file;
+	ext = strrchr (name, '.');
+	if ((ext == NULL) || (strchr (ext, '/') != NULL) || (ext == name) || (*(ext - 1) == '/'))
+		ext = name + strlen (name);
+	name_len = ext - name;
+
+	if (*out_dir != '\0') {
+		if (snprintf (dst, dst_len, "%s/%.*s.mkv", out_dir, name_len, name) >= dst_len)
+			return 1;
+	} else if (snprintf (dst, dst_len, "%.*s.mkv", name_len, name) >= dst_len) {
+		return 1;
+	}
+
+	/* never overwrite the input itself */
+	if (strcmp (dst, in_file) == 0)
+		return 2;
+	return 0;
+}
+
+/* adds an input file, along with its output file name.
+   returns ==0 ok, !=0 error */
+static int batch_add_file (t_batch *batch, const char *path)
+{
+	char out_file[PATH_MAX];
+	char **files;
+	size_t files_max;
+
+	if (batch->files_n == batch->files_max) {
+		files_max = (batch->files_max == 0) ? 256 : (batch->files_max * 2);
+		if ((files = realloc (batch->files, files_max * sizeof (char *))) == NULL)
+			return 1;
+		batch->files = files;
+		if ((files = realloc (batch->out_files, files_max * sizeof (char *))) == NULL)
+			return 1;
+		batch->out_files = files;
+		batch->files_max = files_max;
+	}
+	batch->out_files[batch->files_n] = NULL;
+	if (batch_out_name (out_file, sizeof (out_file), path, batch->out_dir) != 0) {
+		log_printf (LOGT_ERROR, "No output name for %s.\n", path);
+	} else if ((batch->out_files[batch->files_n] = strdup (out_file)) == NULL) {
+		return 2;
+	}
+	if ((batch->files[batch->files_n] = strdup (path)) == NULL) {
+		free (batch->out_files[batch->files_n]);
+		return 2;
+	}
+	batch->files_n++;
+	return 0;
+}
+
+/* true for DHAV file names (.dav, .dhav) */
+static bool batch_is_dhav_name (const char *path)
+{
+	const char *ext;
+
+	if ((ext = strrchr (path, '.')) == NULL)
+		return false;
+	return ((strcasecmp (ext, ".dav") == 0) || (strcasecmp (ext, ".dhav") == 0));
+}
+
+/* adds the DHAV files within a directory and its subdirectories
+   (symbolic links to directories are not followed).
+   returns ==0 ok, !=0 error */
+static int batch_add_dir (t_batch *batch, const char *dir_path)
+{
+	DIR *dir;
+	struct dirent *entry;
+	struct stat st;
+	char path[PATH_MAX];
+	int ret = 0;
+
+	if ((dir = opendir (dir_path)) == NULL) {
+		log_printf (LOGT_WARNING, "Unable to read directory %s, skipped.\n", dir_path);
+		return 0;
+	}
+	while ((ret == 0) && ((entry = readdir (dir)) != NULL)) {
+		if ((strcmp (entry->d_name, ".") == 0) || (strcmp (entry->d_name, "..") == 0))
+			continue;
+		if (snprintf (path, sizeof (path), "%s/%s", dir_path, entry->d_name) >= sizeof (path))
+			continue;
+		if (lstat (path, &st) != 0)
+			continue;
+		if (S_ISDIR (st.st_mode)) {
+			ret = batch_add_dir (batch, path);
+		} else if (batch_is_dhav_name (path) == true) {
+			/* regular files only: a FIFO (etc) would stall its worker */
+			if ((stat (path, &st) == 0) && S_ISREG (st.st_mode))
+				ret = batch_add_file (batch, path);
+		}
+	}
+	closedir (dir);
+	return ret;
+}
+
+/* adds an input: file, directory or glob pattern (of those).
+   returns ==0 ok, !=0 error */
+static int batch_add_input (t_batch *batch, const char *input)
+{
+	glob_t g;
+	struct stat st;
+	size_t i;
+	int ret = 0;
+
+	if (glob (input, 0, NULL, &g) != 0) {
+		log_printf (LOGT_WARNING, "No input matches %s, skipped.\n", input);
+		return 0;
+	}
+	for (i = 0; (i < g.gl_pathc) && (ret == 0); i++) {
+		if (stat (g.gl_pathv[i], &st) != 0)
+			continue;
+		if (S_ISDIR (st.st_mode)) {
+			ret = batch_add_dir (batch, g.gl_pathv[i]);
+		} else if (S_ISREG (st.st_mode)) {
+			ret = batch_add_file (batch, g.gl_pathv[i]);
+		} else {
+			log_printf (LOGT_WARNING, "%s is not a regular file, skipped.\n", g.gl_pathv[i]);
+		}
+	}
+	globfree (&g);
+	return ret;
+}
+
+typedef struct {
+	const char *out_file;
+	size_t i;		/* index within t_batch files */
+} t_batch_out_name;
+
+/* by output name, then by input order */
+static int batch_out_name_cmp (const void *a, const void *b)
+{
+	const t_batch_out_name *na = (const t_batch_out_name *) a;
+	const t_batch_out_name *nb = (const t_batch_out_name *) b;
+	int ret;
+
+	if ((ret = strcmp (na->out_file, nb->out_file)) != 0)
+		return ret;
+	return ((na->i < nb->i) ? -1 : ((na->i > nb->i) ? 1 : 0));
+}
+
+/* finds inputs sharing the same output file (eg. ch1/00.dav and ch2/00.dav
+   into a single output directory, or foo.dav and foo.dhav), which would
+   overwrite each other: the first input (in listing order) is converted,
+   the others are reported and skipped (failed).
+   an input listed more than once (eg. matched by two patterns) is converted once.
+   returns ==0 ok, !=0 error (out of memory) */
+static int batch_check_out_names (t_batch *batch)
+{
+	t_batch_out_name *names;
+	size_t names_n = 0;
+	size_t first = 0;
+	size_t i, j;
+
+	if ((names = malloc (batch->files_n * sizeof (t_batch_out_name))) == NULL)
+		return 1;
+	for (i = 0; i < batch->files_n; i++) {
+		if (batch->out_files[i] != NULL) {
+			names[names_n].out_file = batch->out_files[i];
+			names[names_n++].i = i;
+		}
+	}
+	qsort (names, names_n, sizeof (t_batch_out_name), batch_out_name_cmp);
+
+	for (j = 0; j < names_n; j++) {
+		if ((j == 0) || (strcmp (names[j].out_file, names[first].out_file) != 0)) {
+			first = j;
+			continue;
+		}
+		i = names[j].i;
+		if (strcmp (batch->files[i], batch->files[names[first].i]) == 0) {
+			free (batch->files[i]);
+			batch->files[i] = NULL;
+			batch->repeated_n++;
+		} else {
+			log_printf (LOGT_ERROR, "Output %s is already taken by %s, %s skipped.\n", \
+				batch->out_files[i], batch->files[names[first].i], batch->files[i]);
+		}
+		free (batch->out_files[i]);
+		batch->out_files[i] = NULL;
+	}
+
+	free (names);
+	return 0;
+}
+
+/* worker thread: converts the next file not taken yet, until none remains */
+static void *batch_worker (void *arg)
+{
+	t_batch *batch = (t_batch *) arg;
+	t_stream_buffers sb;
+	const char *out_file;
+	struct stat st;
+	size_t i;
+	int ret;
+
+	if (stream_buffers_init (&sb) != 0) {
+		log_printf (LOGT_ERROR, "Unable to allocate worker buffers.\n");
+		return NULL;
+	}
+
+	pthread_mutex_lock (&(batch->mutex));
+	while (batch->next_file < batch->files_n) {
+		i = batch->next_file++;
+		if (batch->files[i] == NULL)
+			continue;	/* listed more than once */
+		pthread_mutex_unlock (&(batch->mutex));
+
+		out_file = batch->out_files[i];
+		if (out_file == NULL) {
+			ret = 1;	/* already reported, see batch_add_file and batch_check_out_names */
+		} else {
+			log_printf (LOGT_INFO, "Converting %s to %s\n", batch->files[i], out_file);
+			if ((ret = process_dhav_stream (batch->dvrctl, batch->files[i], out_file, &sb)) != 0) {
+				log_printf (LOGT_ERROR, "Unable to convert %s.\n", batch->files[i]);
+				/* no empty leftovers */
+				if ((stat (out_file, &st) == 0) && (st.st_size == 0))
+					unlink (out_file);
+			}
+		}
+
+		pthread_mutex_lock (&(batch->mutex));
+		if (ret == 0) {
+			batch->converted_n++;
+			batch->in_len += sb.in_len;
+		} else {
+			batch->failed_n++;
+		}
+	}
+	pthread_mutex_unlock (&(batch->mutex));
+
+	stream_buffers_close (&sb);
+	return NULL;
+}
+
+/* converts every input (files, directories, glob patterns) to MKV,
+   using several worker threads.
+   returns ==0 ok, !=0 error (or some file was not converted) */
+int process_batch (dvrcontrol_t *dvrctl, char **inputs, int inputs_n, const char *out_dir, int workers)
+{
+	t_batch batch;
+	pthread_t *threads;
+	int threads_n;
+	struct stat st;
+	struct timespec t_start, t_end;
+	double elapsed;
+	size_t i;
+	int ret = 0;
+
+	memset (&batch, 0, sizeof (batch));
+	batch.dvrctl = dvrctl;
+	batch.out_dir = out_dir;
+
+	if ((*out_dir != '\0') && (stat (out_dir, &st) != 0) && (mkdir (out_dir, 0777) != 0)) {
+		log_printf (LOGT_FATAL, "Unable to create output directory %s.\n", out_dir);
+		return 4;
+	}
+	if ((*out_dir != '\0') && ((stat (out_dir, &st) != 0) || (! S_ISDIR (st.st_mode)))) {
+		log_printf (LOGT_FATAL, "Output %s is not a directory.\n", out_dir);
+		return 4;
+	}
+
+	for (i = 0; (i < inputs_n) && (ret == 0); i++)
+		ret = batch_add_input (&batch, inputs[i]);
+	if (ret != 0) {
+		log_printf (LOGT_FATAL, "Unable to allocate input file list.\n");
+		ret = 7;
+		goto batch_end;
+	}
+	if (batch.files_n == 0) {
+		log_printf (LOGT_ERROR, "No input files.\n");
+		ret = 1;
+		goto batch_end;
+	}
+	if (batch_check_out_names (&batch) != 0) {
+		log_printf (LOGT_FATAL, "Unable to allocate input file list.\n");
+		ret = 7;
+		goto batch_end;
+	}
+	if (workers > (batch.files_n - batch.repeated_n))
+		workers = batch.files_n - batch.repeated_n;
+	if ((threads = calloc (workers, sizeof (pthread_t))) == NULL) {
+		log_printf (LOGT_FATAL, "Unable to allocate worker threads.\n");
+		ret = 7;
+		goto batch_end;
+	}
+
+	log_printf (LOGT_INFO, "Converting %zu files, %d worker threads.\n", batch.files_n - batch.repeated_n, workers);
+	clock_gettime (CLOCK_MONOTONIC, &t_start);
+	pthread_mutex_init (&(batch.mutex), NULL);
+	for (threads_n = 0; threads_n < workers; threads_n++) {
+		if (pthread_create (&(threads[threads_n]), NULL, batch_worker, &batch) != 0)
+			break;
+	}
+	if (threads_n == 0)
+		batch_worker (&batch);	/* no threads: do it here */
+	while (threads_n > 0)
+		pthread_join (threads[--threads_n], NULL);
+	pthread_mutex_destroy (&(batch.mutex));
+	free (threads);
+	clock_gettime (CLOCK_MONOTONIC, &t_end);
+
+	/* files no worker could take (no worker buffers) */
+	batch.failed_n += batch.files_n - (batch.converted_n + batch.failed_n + batch.repeated_n);
+
+	elapsed = (double) (t_end.tv_sec - t_start.tv_sec) + ((double) (t_end.tv_nsec - t_start.tv_nsec) / 1e9);
+	log_printf (LOGT_INFO, "Batch done: %zu files converted, %zu failed. %.1f MB in %.1f s (%.1f MB/s, %.1f files/s).\n", \
+		batch.converted_n, batch.failed_n, (double) batch.in_len / 1e6, elapsed, \
+		(elapsed > 0) ? ((double) batch.in_len / 1e6 / elapsed) : 0.0, \
+		(elapsed > 0) ? ((double) batch.converted_n / elapsed) : 0.0);
+	if (batch.failed_n != 0)
+		ret = 1;
+
+batch_end:
+	for (i = 0; i < batch.files_n; i++) {
+		free (batch.files[i]);
+		free (batch.out_files[i]);
+	}
+	free (batch.files);
+	free (batch.out_files);
+	return ret;
+}
 
 
 
@@ -336,6 +1367,8 @@ int process_dhav_stream (dvrcontrol_t *dvrctl, const char *in_file, const char *
 int main (int argc, char **argv, char *env[])
 {
 	dvrcontrol_t dvrctl;
+	t_stream_buffers sb;
+	int ret = -1;	/* <0: not converted yet */
 
 	log_define_context ("dhav2mkv");
 
@@ -348,9 +1381,28 @@ int main (int argc, char **argv, char *env[])
 
 	dvrctl.ntsc_exact_60hz = command_options.ntsc_exact_60hz;
 	dvrctl.tsproc = command_options.tsproc;
+	dvrctl.audio = command_options.audio;
+	dvrctl.range_from = command_options.range_from;
+	dvrctl.range_to = command_options.range_to;
+
+	if (command_options.batch == true) {
+		if (process_batch (&dvrctl, command_options.batch_inputs, command_options.batch_inputs_n, command_options.out_file, command_options.jobs) != 0)
+			exit (1);
+		exit (0);
+	}
 
-	process_dhav_stream (&dvrctl, command_options.in_file, command_options.out_file);
+	/* a time range is converted sequentially (it is found by a search, anyway) */
+	if ((command_options.jobs >= 2) && (command_options.range_from == 0) && (command_options.range_to == 0))
+		ret = process_dhav_file_parallel (&dvrctl, command_options.in_file, command_options.out_file, command_options.jobs);
+	if (ret < 0) {
+		if (stream_buffers_init (&sb) != 0) {
+			log_printf (LOGT_FATAL, "Unable to allocate stream buffers.\n");
+			exit (1);
+		}
+		ret = process_dhav_stream (&dvrctl, command_options.in_file, command_options.out_file, &sb);
+		stream_buffers_close (&sb);
+	}
 
-	exit (0);
+	exit ((ret != 0) ? 1 : 0);
 }
 
@@ -0,0 +1,183 @@
+/* dhavbench.c */
+/* microbenchmark: per-frame cost of DHAV frame parsing (dt_collect_dhav_frame_info) */
+
+/* TaniDVR
+ * Copyright (c) 2011-2015 Daniel Mealha Cabrita
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* not installed, build with "make dhavbench" (src/), run as:
+	dhavbench <file.dhav> [rounds]
+   every DHAV frame of the file is parsed <rounds> times (default 200), by:
+	current:  dt_collect_dhav_frame_info() as is
+	previous: the same, plus the subfield parsing it used to do
+		  (2 KB subfield array zeroed and filled, for every frame)
+	removed:  that subfield parsing alone
+   results are nanoseconds per frame. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "log.h"
+#include "filetools.h"
+#include "mctools.h"
+
+#define DHAVBENCH_DEFAULT_ROUNDS 200
+
+/* the subfield array of the previous implementation:
+   256 subfield ids, 8 bytes each */
+#define DHAVBENCH_SF_STRIPLEN_MAX 8
+#define DHAVBENCH_SF_DATA(fn,dn) dhavbench_sf_array[((fn) << 3) + (dn)]
+static uint8_t dhavbench_sf_array[DHAVBENCH_SF_STRIPLEN_MAX * 256];
+
+typedef struct {
+	uint8_t *frame_p;
+	size_t frame_len;
+} t_dhavbench_frame;
+
+/* the subfield parsing dt_collect_dhav_frame_info() used to do for every frame
+   (dhav_sf_parse_ext_head), then reads what it needed on I-frames */
+static unsigned int dhavbench_previous_subfields (const uint8_t *frame_p)
+{
+	const uint8_t *ext_head = frame_p + 24;
+	int hl = *(frame_p + 22);
+	int pos = 0;
+	uint8_t id = 0;
+	uint8_t id_len = 0;
+	uint8_t id_pos = 0;
+	int i;
+
+	for (i = 0; i < (DHAVBENCH_SF_STRIPLEN_MAX * 256); i++)
+		dhavbench_sf_array[i] = 0;
+	while (hl != 0) {
+		if (id_len == 0) {
+			id_pos = 0;
+			id = ext_head[pos];
+			id_len = (id == 0x88) ? 8 : 4;
+		}
+		DHAVBENCH_SF_DATA(id,id_pos) = ext_head[pos];
+		id_pos++;
+		pos++;
+		id_len--;
+		hl--;
+	}
+
+	if (*(frame_p + 4) != 0xfd)
+		return 0;
+	return (DHAVBENCH_SF_DATA(0x80,2) + DHAVBENCH_SF_DATA(0x80,3) + DHAVBENCH_SF_DATA(0x81,3));
+}
+
+static double dhavbench_now (void)
+{
+	struct timespec t;
+
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return ((double) t.tv_sec + ((double) t.tv_nsec / 1e9));
+}
+
+int main (int argc, char **argv)
+{
+	t_infile *infile;
+	t_mc_parms *mc_parms;
+	t_dhavbench_frame *frames = NULL;
+	size_t frames_n = 0;
+	size_t frames_max = 0;
+	size_t i_frames_n = 0;
+	t_dhavbench_frame *new_frames;
+	uint8_t *map_p;
+	size_t map_len;
+	size_t map_pos = 0;
+	uint8_t *frame_p;
+	size_t frame_len;
+	int rounds = DHAVBENCH_DEFAULT_ROUNDS;
+	volatile unsigned int sink = 0;
+	double t0, t1, t2, t3;
+	size_t i;
+	int r;
+
+	log_define_context ("dhavbench");
+
+	if ((argc < 2) || (argc > 3) || ((argc == 3) && ((rounds = atoi (argv[2])) <= 0))) {
+		fprintf (stderr, "usage: dhavbench <file.dhav> [rounds]\n");
+		return 1;
+	}
+	if (((infile = infile_open (argv[1])) == NULL) || ((map_p = infile_map (infile, &map_len)) == NULL)) {
+		log_printf (LOGT_FATAL, "Unable to map %s.\n", argv[1]);
+		return 2;
+	}
+	if ((mc_parms = mc_init (MC_FORM_MKV, false)) == NULL) {
+		log_printf (LOGT_FATAL, "Unable to allocate mc_parms.\n");
+		return 3;
+	}
+
+	while (dt_next_dhav_frame (map_p, map_len, &map_pos, &frame_p, &frame_len) == 1) {
+		if (frames_n == frames_max) {
+			frames_max = (frames_max == 0) ? 4096 : (frames_max * 2);
+			if ((new_frames = realloc (frames, frames_max * sizeof (t_dhavbench_frame))) == NULL) {
+				log_printf (LOGT_FATAL, "Unable to allocate memory.\n");
+				return 3;
+			}
+			frames = new_frames;
+		}
+		frames[frames_n].frame_p = frame_p;
+		frames[frames_n].frame_len = frame_len;
+		frames_n++;
+		if (*(frame_p + 4) == 0xfd)
+			i_frames_n++;
+	}
+	if (frames_n == 0) {
+		log_printf (LOGT_FATAL, "No DHAV frames in %s.\n", argv[1]);
+		return 4;
+	}
+
+	/* warm up (caches, has_v_parms) */
+	for (i = 0; i < frames_n; i++)
+		dt_collect_dhav_frame_info (mc_parms, frames[i].frame_p, frames[i].frame_len);
+
+	t0 = dhavbench_now ();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < frames_n; i++) {
+			dt_collect_dhav_frame_info (mc_parms, frames[i].frame_p, frames[i].frame_len);
+			sink += mc_parms->frame_type;
+		}
+	}
+	t1 = dhavbench_now ();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < frames_n; i++) {
+			sink += dhavbench_previous_subfields (frames[i].frame_p);
+			dt_collect_dhav_frame_info (mc_parms, frames[i].frame_p, frames[i].frame_len);
+			sink += mc_parms->frame_type;
+		}
+	}
+	t2 = dhavbench_now ();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < frames_n; i++)
+			sink += dhavbench_previous_subfields (frames[i].frame_p);
+	}
+	t3 = dhavbench_now ();
+
+	printf ("%zu frames (%zu I-frames), %d rounds\n", frames_n, i_frames_n, rounds);
+	printf ("current:  %6.1f ns/frame\n", (t1 - t0) * 1e9 / ((double) frames_n * rounds));
+	printf ("previous: %6.1f ns/frame\n", (t2 - t1) * 1e9 / ((double) frames_n * rounds));
+	printf ("removed:  %6.1f ns/frame\n", (t3 - t2) * 1e9 / ((double) frames_n * rounds));
+
+	free (frames);
+	mc_close (mc_parms);
+	infile_close (infile);
+	return 0;
+}
@@ -17,6 +17,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -26,6 +27,8 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/uio.h>
+#include <pthread.h>
 
 #include "hlprotocol.h"
 #include "devinfo.h"
@@ -37,6 +40,8 @@
 #include "dvrcontrol.h"
 #include "bufftools.h"
 #include "shtools.h"
+#include "bintools.h"
+#include "chanproc.h"
 
 #define STREAM_BUFFER_LEN 1000000
 #if (STREAM_BUFFER_LEN * 4) > SSIZE_MAX
@@ -45,6 +50,46 @@
 #define STREAM_BUFFER_MAXPIPEREAD (STREAM_BUFFER_LEN / 4)
 #endif
 
+/* multi-channel streaming: every chunk of data sent through pipe
+   (DVR streamer -> base process) is prefixed by this header:
+   'T','D','C',<stream index>,<data length (LSB, 32 bits)> */
+#define PIPETAG_LEN 8
+#define PIPETAG_MAGIC_0 'T'
+#define PIPETAG_MAGIC_1 'D'
+#define PIPETAG_MAGIC_2 'C'
+
+/* PIPETAG deframing state (base process) */
+typedef struct {
+	uint8_t hdr[PIPETAG_LEN];
+	size_t hdr_len;		/* header bytes collected so far */
+	int stream_index;	/* stream the current chunk belongs to */
+	size_t remaining;	/* chunk data still to be received */
+	bool in_sync;		/* false while searching for a valid header */
+} pipetag_deframer_t;
+
+/* multiplexed channels (single stream connection) demultiplexing state (base process) */
+typedef struct {
+	dstf_t *dstf;		/* whole multiplexed stream */
+	int chp_index[256];	/* DHAV channel field -> chanproc index, -1 if not requested */
+	bool warned_unrequested;
+} chmux_demuxer_t;
+
+/* base process (or thread) side: stream data -> per-channel outputs */
+typedef struct {
+	dvrcontrol_t *dvrctl;
+	chanproc_t *chp[DVRCTL_MAX_CHANNELS];
+	int n_chp;
+	pipetag_deframer_t pdf;
+	chmux_demuxer_t dmx;
+} stream_outputs_t;
+
+/* threaded mode: DVR streamer thread parameters */
+typedef struct {
+	dvrcontrol_t *dvrctl;
+	btring_t *btring;
+	int retcode;	/* last stream_media_dvr_to_sink() return code */
+} stream_thread_t;
+
 
 #ifdef DEBUG
 
@@ -208,32 +253,95 @@ int close_session (t_hlp_connection *conn_control)
 	return 0;
 }
 
-/*  ********************** USED BY GRANDCHILD PROCESS */
-/* stream live media from DVR to pipe (child process -> parent)
+/* writes a chunk of stream data to sink (pipe or ring).
+   if tagged, a PIPETAG header is written in front of data.
+   returns ==0 ok, !=0 error */
+static int write_stream_to_sink (stream_sink_t *sink, bool tagged, int stream_index, uint8_t *src_p, size_t src_len)
+{
+	uint8_t tag[PIPETAG_LEN];
+	struct iovec iov[2];
+	int iov_n = 0;
+	ssize_t written;
+	int i;
+
+	if (tagged == true) {
+		tag[0] = PIPETAG_MAGIC_0;
+		tag[1] = PIPETAG_MAGIC_1;
+		tag[2] = PIPETAG_MAGIC_2;
+		tag[3] = stream_index;
+		BT_NV2LM_U32((tag + 4), ((uint32_t) src_len));
+		iov[iov_n].iov_base = tag;
+		iov[iov_n++].iov_len = PIPETAG_LEN;
+	}
+	iov[iov_n].iov_base = src_p;
+	iov[iov_n++].iov_len = src_len;
+
+	if (sink->btring != NULL) {
+		/* threaded mode: the ring is the only sink */
+		for (i = 0; i < iov_n; i++) {
+			if (btring_write (sink->btring, iov[i].iov_base, iov[i].iov_len) != 0)
+				return 1;
+		}
+		return 0;
+	}
+
+	/* blocking fd, short writes are not expected
+	   (unless interrupted, then handle the leftovers) */
+	while (iov_n > 0) {
+		if ((written = writev (sink->fd, iov, iov_n)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return 1;
+		}
+		while ((iov_n > 0) && ((size_t) written >= iov[0].iov_len)) {
+			written -= iov[0].iov_len;
+			iov[0] = iov[1];
+			iov_n--;
+		}
+		if (iov_n > 0) {
+			iov[0].iov_base = (uint8_t *) iov[0].iov_base + written;
+			iov[0].iov_len -= written;
+		}
+	}
+	return 0;
+}
+
+/*  ********************** USED BY GRANDCHILD PROCESS (or DVR streamer thread) */
+/* stream live media from DVR to sink: pipe (child process -> parent) or
+   ring (DVR streamer thread -> main thread).
    connection to DVR is started from scratch.
-   ppkf is assumed to be properly initialized.
+   sink is assumed to be properly initialized.
+   a single control connection is shared by all the requested channels,
+   with one stream connection per channel (or a single one for all channels,
+   if dvrctl->channel_mux is set).
+   if there is more than one stream connection, each chunk of data sent
+   to pipe is prefixed by a PIPETAG header.
    -- this is an auxiliary function intended to be called from a child process,
       invoked by other functions such as stream_media_dvr_to_file() */
 /* return ==0 ok, !=0 error (< 100, recoverable somehow ; >= 100 internal error, program should abort ASAP) */
-int stream_media_dvr_to_pipe (mptools_pipedfork_t *ppfk, dvrcontrol_t *dvrctl)
+int stream_media_dvr_to_sink (stream_sink_t *sink, dvrcontrol_t *dvrctl)
 {
 	t_hlp_connection conn_control_r;
 	t_hlp_connection *conn_control;
-	t_hlp_connection conn_stream_r;
+	t_hlp_connection conn_stream_r[DVRCTL_MAX_CHANNELS];
 	t_hlp_connection *conn_stream;
 	uint8_t sbuf_data[STREAM_BUFFER_LEN];
 	uint8_t *sbuf;
-	ssize_t sbuf_len;
-	t_hlp_connection *hlp_connection[2];
+	uint8_t *sview;		/* points to data inside the connection receive buffer */
+	size_t sbuf_len;
+	t_hlp_connection *hlp_connection[1 + DVRCTL_MAX_CHANNELS];
 	t_devinfo devinfo;
 	int loopret = 0;	/* in-loop error code */
 	spenttime_t ka_timer;	/* keep-alive (differential) timer, avoid messing with SIGALRM */
-	spenttime_t to_timer;	/* timeout (differential) time, avoid messing with SIGALRM */
+	spenttime_t to_timer[DVRCTL_MAX_CHANNELS];	/* timeout (differential) time, per stream, avoid messing with SIGALRM */
 	unsigned int timeout_hlp_wait = (dvrctl->keep_alive_us != 0) ? (dvrctl->keep_alive_us / 1000) : 100;	/* if keepalive, timeout=keepalive; otherwise timeout = 100ms */
+	int n_streams = (dvrctl->channel_mux == true) ? 1 : dvrctl->n_channels;	/* stream connections */
+	bool tagged = (n_streams > 1) ? true : false;
+	int n_streams_open = 0;
+	int i;
 
 	/* just for the sake of consistency */
 	conn_control = &conn_control_r;
-	conn_stream = &conn_stream_r;
 
 	sbuf = sbuf_data;
 
@@ -245,62 +353,93 @@ int stream_media_dvr_to_pipe (mptools_pipedfork_t *ppfk, dvrcontrol_t *dvrctl)
 		return 4;
 	}
 
-	/* start STREAM connection */
-	DEBUG_LOG_PRINTF ("start STREAM connection...\n");
-	if (hlp_open (conn_stream, dvrctl->hostname, dvrctl->port, dvrctl->timeout_us) != 0) {
-		log_printf (LOGT_ERROR, "Unable to open stream connection.\n");
-		return 1;
-	}
+	for (i = 0; i < n_streams; i++) {
+		conn_stream = &conn_stream_r[i];
 
-	/* tie conn_stream to conn_control */
-	DEBUG_LOG_PRINTF ("tie conn_stream to conn_control...\n");
-	if (hlp_connection_relationship (conn_control, conn_stream, 1, dvrctl->channel) != 0) {
-		log_printf (LOGT_ERROR, "Unable to establish a connection relationship between control and stream channels.\n");
-		return 2;
-	}
+		/* start STREAM connection */
+		DEBUG_LOG_PRINTF ("start STREAM connection (channel %d)...\n", dvrctl->channels[i]);
+		if (hlp_open (conn_stream, dvrctl->hostname, dvrctl->port, dvrctl->timeout_us) != 0) {
+			log_printf (LOGT_ERROR, "Unable to open stream connection (channel %d).\n", dvrctl->channels[i]);
+			loopret = 1;
+			goto end_streams;
+		}
+		n_streams_open++;
+
+		/* tie conn_stream to conn_control */
+		DEBUG_LOG_PRINTF ("tie conn_stream to conn_control...\n");
+		if (hlp_connection_relationship (conn_control, conn_stream, 1, dvrctl->channels[i]) != 0) {
+			log_printf (LOGT_ERROR, "Unable to establish a connection relationship between control and stream channels.\n");
+			loopret = 2;
+			goto end_streams;
+		}
 
-	/* first frame... */
-	DEBUG_LOG_PRINTF ("first frame...\n");
-	if (hlp_media_data_request (conn_control, conn_stream, dvrctl->channel, dvrctl->sub_channel, sbuf, STREAM_BUFFER_LEN, &sbuf_len) != 0) {
-		log_printf (LOGT_ERROR, "Error while requesting media data.\n");
-		return 3;
-	}
-	if (write (ppfk->fd_write, sbuf, sbuf_len) == -1) {
-		log_printf (LOGT_FATAL, "Cannot write to pipe.\n");
-		return 105;
+		/* first frame... */
+		DEBUG_LOG_PRINTF ("first frame...\n");
+		if (dvrctl->channel_mux == true) {
+			/* all channels through this single stream connection */
+			if (hlp_media_data_request_multiplexed (conn_control, conn_stream, dvrctl->channels, dvrctl->n_channels, dvrctl->sub_channel, sbuf, STREAM_BUFFER_LEN, &sbuf_len) != 0) {
+				log_printf (LOGT_ERROR, "Error while requesting multiplexed media data.\n");
+				loopret = 3;
+				goto end_streams;
+			}
+		} else if (hlp_media_data_request (conn_control, conn_stream, dvrctl->channels[i], dvrctl->sub_channel, sbuf, STREAM_BUFFER_LEN, &sbuf_len) != 0) {
+			log_printf (LOGT_ERROR, "Error while requesting media data (channel %d).\n", dvrctl->channels[i]);
+			loopret = 3;
+			goto end_streams;
+		}
+		if (write_stream_to_sink (sink, tagged, i, sbuf, sbuf_len) != 0) {
+			log_printf (LOGT_FATAL, "Cannot write to pipe.\n");
+			loopret = 105;
+			goto end_streams;
+		}
 	}
 
 
 	/* second frame and the rest... */
 
 	hlp_connection[0] = conn_control;
-	hlp_connection[1] = conn_stream;
+	for (i = 0; i < n_streams; i++) {
+		hlp_connection[1 + i] = &conn_stream_r[i];
+		spenttime_set (&to_timer[i]);	/* set a starting time for timeout timer */
+	}
 
 	spenttime_set (&ka_timer);	/* set a starting time for keep-alive timer */
-	spenttime_set (&to_timer);	/* set a starting time for timeout timer */
 
 	while (1) {
+		if ((sink->btring != NULL) && (btring_is_closed (sink->btring) == true)) {
+			/* threaded mode: consumer side is gone */
+			loopret = 105;
+			break;
+		}
+
 		/* wait up to timeout_hlp_wait for data, return regardless */
-		if (hlp_wait_for_incoming_data (&hlp_connection[0], 2, timeout_hlp_wait) != 0) {
-			while (hlp_check_incoming_data (conn_stream) > 0) {
-				spenttime_set (&to_timer);	/* reset DVR timeout */
+		if (hlp_wait_for_incoming_data (&hlp_connection[0], 1 + n_streams, timeout_hlp_wait) != 0) {
+			for (i = 0; i < n_streams; i++) {
+				conn_stream = &conn_stream_r[i];
 
-				if (hlp_collect_media_data (conn_stream, 0, sbuf, STREAM_BUFFER_LEN, &sbuf_len) != 0) {
-					log_printf (LOGT_ERROR, "DVR/network error (hlp_collect_media_data).\n");
-					loopret = 6;
-					break;
-				}
+				while (hlp_check_incoming_data (conn_stream) > 0) {
+					spenttime_set (&to_timer[i]);	/* reset DVR timeout */
 
-				/* FIXME: is that a good idea to keep this blocking? */
-				if (write (ppfk->fd_write, sbuf, sbuf_len) == -1) {
-					log_printf (LOGT_DETAIL, "Cannot write to pipe.\n");
-					loopret = 105;
-					break;
-				}
-				if (dvrctl->keep_alive_us != 0) {
-					if (spenttime_get (&ka_timer) > dvrctl->keep_alive_us) {
-						break;	/* keep-alive timeout, leave the rest for later... */
+					if (hlp_collect_media_data_view (conn_stream, &sview, &sbuf_len) != 0) {
+						log_printf (LOGT_ERROR, "DVR/network error (hlp_collect_media_data_view).\n");
+						loopret = 6;
+						break;
+					}
+
+					/* FIXME: is that a good idea to keep this blocking? */
+					if (write_stream_to_sink (sink, tagged, i, sview, sbuf_len) != 0) {
+						log_printf (LOGT_DETAIL, "Cannot write to pipe.\n");
+						loopret = 105;
+						break;
 					}
+					if (dvrctl->keep_alive_us != 0) {
+						if (spenttime_get (&ka_timer) > dvrctl->keep_alive_us) {
+							break;	/* keep-alive timeout, leave the rest for later... */
+						}
+					}
+				}
+				if (loopret != 0) {
+					break;
 				}
 			}
 			if (loopret != 0) {
@@ -330,20 +469,38 @@ int stream_media_dvr_to_pipe (mptools_pipedfork_t *ppfk, dvrcontrol_t *dvrctl)
 		}
 
 		if (dvrctl->timeout_us != 0) {
-			if (spenttime_get (&to_timer) > dvrctl->timeout_us) {
-				/* DVR timeout, give up */
-				log_printf (LOGT_WARNING, "DVR session timeout.\n");
-				loopret = 9;
-				break;
+			/* streams share the same session,
+			   a single dead stream restarts them all */
+			for (i = 0; i < n_streams; i++) {
+				if (spenttime_get (&to_timer[i]) > dvrctl->timeout_us) {
+					/* DVR timeout, give up */
+					log_printf (LOGT_WARNING, "DVR session timeout (channel %d).\n", dvrctl->channels[i]);
+					loopret = 9;
+					break;
+				}
 			}
+			if (loopret != 0)
+				break;
 		}
 	}
 
-	hlp_close (conn_stream);
+end_streams:
+	for (i = 0; i < n_streams_open; i++)
+		hlp_close (&conn_stream_r[i]);
 	hlp_close (conn_control);
 	return loopret;
 }
 
+/* stream live media from DVR to pipe, see stream_media_dvr_to_sink() */
+int stream_media_dvr_to_pipe (mptools_pipedfork_t *ppfk, dvrcontrol_t *dvrctl)
+{
+	stream_sink_t sink;
+
+	sink.fd = ppfk->fd_write;
+	sink.btring = NULL;
+	return (stream_media_dvr_to_sink (&sink, dvrctl));
+}
+
 /* set/unset O_NONBLOCK fd flag:
    true=blocking; false=O_NONBLOCK set.
    returns: ==0 ok, !=0 error */
@@ -469,7 +626,7 @@ int stream_dvr_subprocess_to_pipe (mptools_pipedfork_t *ppfk_parent, dvrcontrol_
 	ppfk_child = &ppfk_child_r;
 	btfifo = &btfifo_r;
 
-	btfifo->bsize = 1048576;	/* FIXME - this should not be hardcoded */
+	btfifo->bsize = 1048576 * dvrctl->n_channels;	/* FIXME - this should not be hardcoded */
 	btfifo->flags = BTFIFO_F_ASSUME_FD_READY;
 	//btfifo->wmin = 0;
 	if (btfifo_create (btfifo) != 0)
@@ -570,39 +727,320 @@ int stream_dvr_subprocess_to_pipe (mptools_pipedfork_t *ppfk_parent, dvrcontrol_
 
 /* ---------------------------- */
 
-/* stream live media from dvr to file.
+/* feeds data received from pipe (multi-channel, PIPETAG-prefixed chunks)
+   into the related per-channel processors.
+   returns ==0 ok, !=0 error (already logged, processing should stop) */
+static int pipetag_demux (pipetag_deframer_t *pdf, chanproc_t **chp, int n_chp, uint8_t *src_p, size_t src_len)
+{
+	size_t chunk_len;
+	uint32_t tag_len;
+	int ret;
+
+	while (src_len > 0) {
+		if (pdf->remaining > 0) {
+			/* chunk data */
+			chunk_len = (src_len < pdf->remaining) ? src_len : pdf->remaining;
+			if ((ret = chanproc_feed (chp[pdf->stream_index], src_p, chunk_len)) != 0)
+				return ret;
+			src_p += chunk_len;
+			src_len -= chunk_len;
+			pdf->remaining -= chunk_len;
+			continue;
+		}
+
+		/* chunk header */
+		pdf->hdr[pdf->hdr_len++] = *(src_p++);
+		src_len--;
+		if (pdf->hdr_len < PIPETAG_LEN)
+			continue;
+
+		tag_len = BT_LM2NV_U32((pdf->hdr + 4));
+		if ((pdf->hdr[0] == PIPETAG_MAGIC_0) && \
+			(pdf->hdr[1] == PIPETAG_MAGIC_1) && \
+			(pdf->hdr[2] == PIPETAG_MAGIC_2) && \
+			(pdf->hdr[3] < n_chp) && \
+			(tag_len <= STREAM_BUFFER_LEN)) {
+			/* valid header */
+			if (pdf->in_sync == false)
+				log_printf (LOGT_DETAIL, "Resynchronized with multi-channel stream.\n");
+			pdf->in_sync = true;
+			pdf->stream_index = pdf->hdr[3];
+			pdf->remaining = tag_len;
+			pdf->hdr_len = 0;
+		} else {
+			/* invalid header (eg. DVR streamer restarted while
+			   in the middle of a chunk), slide one byte and retry */
+			if (pdf->in_sync == true)
+				log_printf (LOGT_WARNING, "Multi-channel stream out of sync, resynchronizing...\n");
+			pdf->in_sync = false;
+			memmove (pdf->hdr, pdf->hdr + 1, PIPETAG_LEN - 1);
+			pdf->hdr_len = PIPETAG_LEN - 1;
+		}
+	}
+
+	return 0;
+}
+
+/* feeds data received from pipe (single DHAV stream carrying several channels)
+   into the related per-channel processors, according to DHAV channel field.
+   returns ==0 ok, !=0 error (already logged, processing should stop) */
+static int chmux_demux (chmux_demuxer_t *dmx, chanproc_t **chp, uint8_t *src_p, size_t src_len)
+{
+	uint8_t *frame_p;
+	size_t frame_len;
+	int dstf_ret = 0;
+	int index;
+	int ret;
+
+	do {
+		dstf_ret = dstf_process_dhav_stream_to_frames (dmx->dstf, src_p, (dstf_ret > 0) ? 0 : src_len, &frame_p, &frame_len);
+
+		if (frame_len > 0) {
+			/* there's a frame to route */
+			if ((index = dmx->chp_index[frame_p[6]]) < 0) {
+				if (dmx->warned_unrequested == false) {
+					log_printf (LOGT_WARNING, "Got frame from unrequested channel (%d), discarding.\n", (int) frame_p[6]);
+					dmx->warned_unrequested = true;
+				}
+			} else if ((ret = chanproc_feed_frame (chp[index], frame_p, frame_len)) != 0) {
+				return ret;
+			}
+		}
+	} while (dstf_ret > 0);
+
+	if (dstf_ret < 0) {
+		log_printf (LOGT_FATAL, "dstf_process_dhav_stream_to_frames failure: %d.\n", dstf_ret);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* opens the per-channel outputs (and related processing).
+   returns ==0 ok, !=0 error (already logged) -- see stream_media_dvr_to_file() return codes */
+static int stream_outputs_open (stream_outputs_t *so, dvrcontrol_t *dvrctl, int media_container_out, const char *filename_pattern)
+{
+	t_mc_format mc_format_out = MC_FORM_DVR_NATIVE;	/* media container type - output */
+	int i;
+
+	so->dvrctl = dvrctl;
+	so->n_chp = 0;
+
+	so->pdf.hdr_len = 0;
+	so->pdf.stream_index = 0;
+	so->pdf.remaining = 0;
+	so->pdf.in_sync = true;
+
+	so->dmx.dstf = NULL;
+	so->dmx.warned_unrequested = false;
+	for (i = 0; i < 256; i++)
+		so->dmx.chp_index[i] = -1;
+
+	/* define mc_format_out */
+	switch (media_container_out) {
+	case 0: mc_format_out = MC_FORM_DVR_NATIVE;	break;
+	case 1: mc_format_out = MC_FORM_MKV;		break;
+	case 2: mc_format_out = MC_FORM_FMP4;		break;
+	case 3: mc_format_out = MC_FORM_MPEGTS;		break;
+	}
+
+	/* one output (and related processing) per channel */
+	for (so->n_chp = 0; so->n_chp < dvrctl->n_channels; so->n_chp++) {
+		/* HLS: filename_pattern names the playlist, segmenting is done by HLS */
+		if ((so->chp[so->n_chp] = chanproc_init (dvrctl->channels[so->n_chp], mc_format_out, dvrctl->ntsc_exact_60hz, dvrctl->tsproc, \
+			(dvrctl->hls_window != 0) ? NULL : filename_pattern, \
+			(dvrctl->hls_window != 0) ? 0 : dvrctl->segment_duration, dvrctl->segment_size)) == NULL)
+			return 7;
+		if ((dvrctl->hls_window != 0) && \
+			(chanproc_set_hls (so->chp[so->n_chp], filename_pattern, dvrctl->hls_window, dvrctl->segment_duration) != 0)) {
+			so->n_chp++;	/* so that stream_outputs_close() takes this one too */
+			return 7;
+		}
+		if ((dvrctl->index == true) && \
+			(chanproc_set_index (so->chp[so->n_chp]) != 0)) {
+			so->n_chp++;	/* so that stream_outputs_close() takes this one too */
+			return 7;
+		}
+		chanproc_set_audio (so->chp[so->n_chp], dvrctl->audio);
+		if (dvrctl->output_queue_len != 0)
+			chanproc_set_output_queue (so->chp[so->n_chp], dvrctl->output_queue_len, dvrctl->output_drop);	/* failure is not fatal */
+		if ((dvrctl->listen_address != NULL) && \
+			(chanproc_set_broker (so->chp[so->n_chp], dvrctl->listen_address, so->n_chp) != 0)) {
+			so->n_chp++;	/* so that stream_outputs_close() takes this one too */
+			return 7;
+		}
+	}
+
+	if (dvrctl->channel_mux == true) {
+		/* single DHAV stream carrying all the channels */
+		if ((so->dmx.dstf = dstf_init ()) == NULL) {
+			log_printf (LOGT_FATAL, "Unable to allocate demultiplexer.\n");
+			return 7;
+		}
+		for (i = 0; i < so->n_chp; i++)
+			so->dmx.chp_index[dvrctl->channels[i]] = i;
+	} else {
+		log_printf (LOGT_INFO, "Identifying type of media container in stream...\n");
+	}
+
+	return 0;
+}
+
+/* feeds stream data, as sent by the DVR streamer, to the outputs.
+   returns ==0 ok, !=0 error (already logged, processing should stop) */
+static int stream_outputs_feed (stream_outputs_t *so, uint8_t *src_p, size_t src_len)
+{
+	if (so->dvrctl->channel_mux == true)
+		return (chmux_demux (&(so->dmx), so->chp, src_p, src_len));
+	if (so->dvrctl->n_channels > 1)
+		return (pipetag_demux (&(so->pdf), so->chp, so->n_chp, src_p, src_len));
+	return (chanproc_feed (so->chp[0], src_p, src_len));
+}
+
+/* accepts partially opened stream_outputs_t (see stream_outputs_open) */
+static void stream_outputs_close (stream_outputs_t *so)
+{
+	int i;
+
+	for (i = 0; i < so->n_chp; i++)
+		chanproc_close (so->chp[i]);
+	if (so->dmx.dstf != NULL)
+		dstf_close (so->dmx.dstf);
+}
+
+/* threaded mode: DVR streamer thread.
+   plays the same role as stream_dvr_subprocess_to_pipe(), restarting
+   the DVR session whenever it fails, but feeds the ring directly.
+   closes the ring when giving up (unrecoverable error, or the consumer
+   side has closed the ring itself). */
+static void *stream_dvr_thread_to_ring (void *arg)
+{
+	stream_thread_t *st = (stream_thread_t *) arg;
+	stream_sink_t sink;
+	bool delay_start = false;
+
+	/* signals are dealt by the main thread only */
+	sht_signalblock_mgr (SHT_OP_BLOCK, (SHT_F_SIGBLOCK_SIGSTD));
+
+	sink.fd = -1;
+	sink.btring = st->btring;
+
+	while (btring_is_closed (st->btring) == false) {
+		/* if the DVR session starts failing too fast,
+		   this avoids a messy busy-loop-like situation for
+		   localhost, DVR (which may crash) and network. */
+		if (delay_start == true)
+			sleep (1);
+
+		log_printf (LOGT_INFO, "Starting DVR session controller...\n");
+		st->retcode = stream_media_dvr_to_sink (&sink, st->dvrctl);
+		if (st->retcode >= 100) {
+			log_printf (LOGT_DETAIL, "stream_media_dvr_to_sink() returned unrecoverable error (%d).\n", st->retcode);
+			break;
+		}
+		log_printf (LOGT_ERROR, "DVR dropped connection or general network error.\n");
+		log_printf (LOGT_INFO, "Attempting to recreate DVR session...\n");
+		delay_start = true;
+	}
+
+	btring_close (st->btring);
+	return NULL;
+}
+
+/* same as stream_media_dvr_to_file(), but threaded: the DVR streamer runs
+   as a thread of this process instead of a process chain,
+   handing over data through a ring buffer. */
+static int stream_media_dvr_to_file_threaded (dvrcontrol_t *dvrctl, int media_container_out, const char *filename_pattern)
+{
+	stream_outputs_t so;
+	stream_thread_t st;
+	btring_t btring;
+	pthread_t thread;
+	uint8_t *data_p;
+	size_t data_len;
+	int waitret;
+	int retcode;
+
+	btring.bsize = 1048576 * dvrctl->n_channels;	/* FIXME - this should not be hardcoded */
+	if (btring_create (&btring) != 0) {
+		log_printf (LOGT_FATAL, "Unable to allocate ring buffer.\n");
+		return 7;
+	}
+
+	if ((retcode = stream_outputs_open (&so, dvrctl, media_container_out, filename_pattern)) != 0) {
+		stream_outputs_close (&so);
+		btring_destroy (&btring);
+		return retcode;
+	}
+
+	st.dvrctl = dvrctl;
+	st.btring = &btring;
+	st.retcode = 0;
+
+	if (pthread_create (&thread, NULL, stream_dvr_thread_to_ring, &st) != 0) {
+		log_printf (LOGT_FATAL, "Unable to create DVR streamer thread.\n");
+		stream_outputs_close (&so);
+		btring_destroy (&btring);
+		return 6;
+	}
+
+	while (1) {
+		/* wait for data up to 100ms */
+		if ((waitret = btring_wait_data (&btring, 100)) < 0) {
+			log_printf (LOGT_FATAL, "DVR streamer thread has quit.\n");
+			break;
+		}
+		if (waitret > 0) {
+			data_len = btring_peek (&btring, &data_p);
+			if (stream_outputs_feed (&so, data_p, data_len) != 0)
+				break;
+			btring_consume (&btring, data_len);
+		}
+
+		if ((sht_fl_terminate_nicely != 0)) {
+			log_printf (LOGT_INFO, "Got termination request.\n");
+			break;
+		}
+	}
+
+	/* stop streamer thread */
+	btring_close (&btring);
+	pthread_join (thread, NULL);
+
+	stream_outputs_close (&so);
+	btring_destroy (&btring);
+	return 0;
+}
+
+/* stream live media from dvr to file(s).
    a child process is opened which will talk to the DVR directly,
-   while the parent will collect data from a pipe. */
+   while the parent will collect data from a pipe
+   (or, if dvrctl->threaded, a thread and a ring buffer are used instead).
+   one output is written per channel (see dvrctl->channels),
+   filename_pattern's "%N" is replaced by the channel number
+   (NULL: no output file, the stream is served to local clients only,
+   see dvrctl->listen_address).
+   if segmenting (see dvrctl->segment_*), strftime() conversions
+   in filename_pattern are applied at each new file. */
 /* container: 0-raw 1-DHAV 2-Matroska */
 /* return ==0 ok, !=0 error (program should abort ASAP) */
-int stream_media_dvr_to_file (dvrcontrol_t *dvrctl, int media_container_out, const char *filename)
+int stream_media_dvr_to_file (dvrcontrol_t *dvrctl, int media_container_out, const char *filename_pattern)
 {
-	uint8_t sbuf_data[STREAM_BUFFER_LEN];
-	uint8_t sbuf_data_2[STREAM_BUFFER_LEN]; /* secondary buffer (not always necessary) */
+	uint8_t sbuf_data[STREAM_BUFFER_MAXPIPEREAD];
 	uint8_t *sbuf;
-	uint8_t *sbuf_2;
 	ssize_t sbuf_len;
-	ssize_t sbuf_len_2;
-	uint8_t *outbuf;	/* post-processing buffer (an alias, actually), may point to sbuf or sbuf_2 */
-	size_t *outbuf_len_p;	/* similarly to outbuf, it is also an alias to sbuf_len or sbuf_len_2 */
-	t_outfile *outfile;
-	t_mc_parms *mc_parms;		/* media container parms */
-	t_mc_format mc_format_out;	/* media container type - output */
-	t_mc_format mc_format_in;	/* media container type - input from DVR */
 	mptools_pipedfork_t ppfk_r;
 	mptools_pipedfork_t *ppfk;
 	pid_t ppfk_ret;
 	int child_ret;
-	dstf_t *dstf;
-	int dstf_ret;
-	int dtconv_ret;
-	int outfwrite_ret;
-	t_mc_tsproc *tsc;
-	bool main_mkv_header_pending = true;
+	stream_outputs_t so;
+	int retcode;
+
+	if (dvrctl->threaded == true)
+		return (stream_media_dvr_to_file_threaded (dvrctl, media_container_out, filename_pattern));
 
 	ppfk = &ppfk_r;
 	sbuf = sbuf_data;
-	sbuf_2 = sbuf_data_2;
 
 	/* block signals and fork */
 	sht_signalblock_mgr (SHT_OP_BLOCK, (SHT_F_SIGBLOCK_SIGSTD));
@@ -632,83 +1070,8 @@ int stream_media_dvr_to_file (dvrcontrol_t *dvrctl, int media_container_out, con
 		return 6;
 	}
 
-	/* TODO: write this in a less kludgy way */
-	if ((outfile = outfile_open (filename)) == NULL) {
-		log_printf (LOGT_FATAL, "Unable to output stream data.\n");
-		mptools_destroy_pipedfork (ppfk);	/* destroy child */
-		return 4;
-	}
-	if ((dstf = dstf_init ()) == NULL) {
-		log_printf (LOGT_FATAL, "Unable to allocate dstf.\n");
-		outfile_close (outfile);
-		mptools_destroy_pipedfork (ppfk);	/* destroy child */
-		return 7;
-	}
-
-	/* define mc_format_out */
-	switch (media_container_out) {
-	case 0: mc_format_out = MC_FORM_DVR_NATIVE;	break;
-	case 1: mc_format_out = MC_FORM_MKV;		break;
-	}
-	if (mc_format_out == MC_FORM_MKV) {
-		/* MKV */
-		outbuf = sbuf_2;
-		outbuf_len_p = &sbuf_len_2;
-	} else {
-		/* DVR native: DHAV or raw H264 */
-		outbuf = sbuf;
-		outbuf_len_p = &sbuf_len;
-	}
-
-	/* we initialize this later, to avoid allocation
-	   just before several other things may fail */
-	mc_parms = mc_init (mc_format_out, dvrctl->ntsc_exact_60hz);	/* FIXME: error should be checked */
-
-	if (dvrctl->tsproc != TSPROC_NONE) {
-		tsc = dt_tsproc_init (mc_parms, dvrctl->tsproc); /* FIXME: error should be checked */
-	}
-
-	/* collect data until there's enough to identify
-	   the type of container */
-	log_printf (LOGT_INFO, "Identifying type of media container in stream...\n");
-	mc_format_in = MC_FORM_DVR_UNKNOWN;
-	while ((dstf->sq_maxlen - dstf->sq_len) >= (2 * STREAM_BUFFER_MAXPIPEREAD)) {
-		if (poll_pipe_read (ppfk->fd_read, 100) >= 0) {
-			if ((sbuf_len = read (ppfk->fd_read, sbuf, STREAM_BUFFER_MAXPIPEREAD)) == -1) {
-				log_printf (LOGT_WARNING, "Unable to get more data from pipe.\n");
-				goto end_stream_process;
-			}
-			if (sbuf_len > 0) {
-				/* append data into dstf */
-				memcpy ((dstf->sq_p + dstf->sq_offs + dstf->sq_len), sbuf, sbuf_len);
-				dstf->sq_len += sbuf_len;
-
-				/* search for pattern in data stored in dstf */
-				mc_format_in = identify_mc_format (dstf->sq_p + dstf->sq_offs, dstf->sq_len);
-				if (mc_format_in != MC_FORM_DVR_UNKNOWN) {
-					break;
-				}
-			}
-
-		} else {
-			if (sht_fl_sigchld != 0) {
-				log_printf (LOGT_FATAL, "Intermediate process has died.\n");
-			} else {
-				log_printf (LOGT_FATAL, "Unable to communicate with intermediate process.\n");
-			}
-			goto end_stream_process;
-		}
-
-	}
-	if (mc_format_in == MC_FORM_DVR_UNKNOWN) {
-		log_printf (LOGT_ERROR, "Unable to identify media container format "
-			"from incoming stream. Software bug or unknown "
-			"media container. PLEASE CONTACT THE DEVELOPER AND REPORT.\n");
-		/* assume media container is DHAV, the most commonly found,
-		   and hope for the best */
-		mc_format_in = MC_FORM_DHAV;
-	}
-
+	if ((retcode = stream_outputs_open (&so, dvrctl, media_container_out, filename_pattern)) != 0)
+		goto end_stream_process;
 
 	while (1) {
 		/* wait for data up to 100ms */
@@ -721,52 +1084,10 @@ int stream_media_dvr_to_file (dvrcontrol_t *dvrctl, int media_container_out, con
 
 			DEBUG_LOG_PRINTF ("read from pipe: %d bytes\n", sbuf_len);
 
-			/* grab frames from stream, convert (if requested),
-			   and send the resulting data */
-			dstf_ret = dtconv_ret = outfwrite_ret = 0;
-			do {
-				if (mc_format_in == MC_FORM_DHAV) {
-					/* MC_FORM_DHAV */
-					dstf_ret = dstf_process_dhav_stream_to_frames (dstf, sbuf, (dstf_ret > 0) ? 0 : sbuf_len, sbuf, &sbuf_len, STREAM_BUFFER_LEN);
-				} else {
-					/* MC_FORM_RAW_H264 */
-					dstf_ret = dstf_process_raw_h264_stream_to_frames (dstf, sbuf, (dstf_ret > 0) ? 0 : sbuf_len, sbuf, &sbuf_len, STREAM_BUFFER_LEN);
-				}
-
-				if (sbuf_len > 0) {
-					/* there's a frame to process */
-
-					if (mc_format_out == MC_FORM_MKV) {
-						if (mc_format_in == MC_FORM_DHAV) {
-							/* MC_FORM_DHAV */
-							dt_collect_dhav_frame_info (mc_parms, sbuf, sbuf_len);
-						} else {
-							/* MC_FORM_RAW_H264 */
-							dt_collect_raw_h264_frame_info (mc_parms, sbuf, sbuf_len);
-						}
-						if ((dvrctl->tsproc != TSPROC_NONE) && (mc_format_in == MC_FORM_DHAV)) {
-							dt_tsproc_process (tsc);
-							mc_parms->v_timestamp = tsc->v_timestamp; /* override with fixed timestamp */
-						}
-						if (mc_format_in == MC_FORM_DHAV) {
-							/* MC_FORM_DHAV */
-							dtconv_ret = dt_convert_frame_to_mkv (mc_parms, sbuf, sbuf_len, sbuf_2, &sbuf_len_2, STREAM_BUFFER_LEN, main_mkv_header_pending, MCODEC_V_MPEG4_ISO_AVC);
-						} else {
-							/* MC_FORM_RAW_H264 */
-							dtconv_ret = dt_convert_frame_to_mkv (mc_parms, sbuf, sbuf_len, sbuf_2, &sbuf_len_2, STREAM_BUFFER_LEN, main_mkv_header_pending, MCODEC_V_MPEG4_ISO_ASP);
-						}
-						if (dtconv_ret == 0)
-							main_mkv_header_pending = false;
-					}
-
-					/* WARNING: blocking IO here */
-					if ((outfwrite_ret = outfile_write (outfile, outbuf, *outbuf_len_p)) != 0)
-						break;
-
-					if ((sht_fl_terminate_nicely != 0) || (sht_fl_sigpipe != 0) || (sht_fl_sigchld != 0))
-						break;
-				}
-			} while (dstf_ret > 0);
+			if (sbuf_len > 0) {
+				if (stream_outputs_feed (&so, sbuf, sbuf_len) != 0)
+					break;
+			}
 
 			if ((sht_fl_terminate_nicely != 0)) {
 				log_printf (LOGT_INFO, "Got termination request.\n");
@@ -776,19 +1097,6 @@ int stream_media_dvr_to_file (dvrcontrol_t *dvrctl, int media_container_out, con
 				log_printf (LOGT_FATAL, "Intermediate process has died.\n");
 				break;
 			}
-
-			if (dstf_ret < 0) {
-				log_printf (LOGT_FATAL, "dstf_process_(dhav|raw_h264)_stream_to_frames failure: %d.\n", dstf_ret);
-				break;
-			}
-			if (dtconv_ret < 0) {
-				log_printf (LOGT_FATAL, "dt_convert_frame_to_mkv failure: %d.\n", dtconv_ret);
-				break;
-			}
-			if (outfwrite_ret != 0) {
-				log_printf (LOGT_FATAL, "Unable to write to target: %d.\n", outfwrite_ret);
-				break;
-			}
 		} else {
 			if (sht_fl_sigchld != 0) {
 				log_printf (LOGT_FATAL, "Intermediate process has died.\n");
@@ -801,14 +1109,9 @@ int stream_media_dvr_to_file (dvrcontrol_t *dvrctl, int media_container_out, con
 
 end_stream_process:
 
-	dstf_close (dstf);
-	outfile_close (outfile);
-	if (dvrctl->tsproc != TSPROC_NONE) {
-		dt_tsproc_close (tsc);
-	}
-	mc_close (mc_parms);
+	stream_outputs_close (&so);
 	mptools_destroy_pipedfork (ppfk);
-	return 0;
+	return retcode;
 }
 
 
@@ -25,6 +25,11 @@
 #include "mptools.h"
 #include "dvrcontrol.h"
 #include "mctools.h"
+#include "bufftools.h"
+#include "filetools.h"
+
+/* maximum number of channels streamed simultaneously (single DVR session) */
+#define DVRCTL_MAX_CHANNELS 256
 
 /* to be provided when requesting a DVR connection */
 typedef struct {
@@ -34,8 +39,22 @@ typedef struct {
 	const char *passwd;
 
 	/* while streaming video, only */
-	int channel;
+	int channel;		/* first (or only) channel, same as channels[0] */
+	int n_channels;		/* total channels to be streamed (1 to DVRCTL_MAX_CHANNELS) */
+	int channels[DVRCTL_MAX_CHANNELS];	/* channels to be streamed, one stream connection each */
+	bool channel_mux;	/* true: all channels through a single stream connection (channels 0-15 only) */
 	int sub_channel;
+	bool threaded;		/* true: DVR streamer runs as a thread, instead of a process chain */
+	unsigned int segment_duration;	/* segmented recording: max file duration (seconds), 0 = no limit */
+	uint64_t segment_size;		/* segmented recording: max file length (bytes), 0 = no limit */
+	size_t output_queue_len;	/* asynchronous output queue (bytes, per channel), 0 = synchronous output */
+	outfile_drop_t output_drop;	/* what to do when the output queue is full */
+	const char *listen_address;	/* serve the stream to local clients (see broker_open), NULL = disabled */
+	unsigned int hls_window;	/* HLS output: segments listed in the playlist (see hls_open), 0 = disabled */
+	bool index;		/* write a keyframe index alongside each output file, see idx_create() */
+	bool audio;		/* MKV output: add the audio track, see dt_convert_frame_to_mkv() */
+	uint32_t range_from;	/* DHAV file conversion: DVR time range to output (DHAV EPOCH), 0 = from the start */
+	uint32_t range_to;	/* 0 = up to the end */
 	bool ntsc_exact_60hz;
 	tsproc_t tsproc;
 
@@ -44,10 +63,17 @@ typedef struct {
 	unsigned int net_protocol_dialect;	/* DVR protocol dialect to use */
 } dvrcontrol_t;
 
+/* where the DVR streamer delivers the stream data */
+typedef struct {
+	int fd;			/* pipe (process mode), used if btring == NULL */
+	btring_t *btring;	/* ring shared with the main thread (threaded mode) */
+} stream_sink_t;
+
 extern int open_session (t_hlp_connection *conn_control, t_devinfo *devinfo, dvrcontrol_t *dvrctl);
 extern int close_session (t_hlp_connection *conn_control);
+extern int stream_media_dvr_to_sink (stream_sink_t *sink, dvrcontrol_t *dvrctl);
 extern int stream_media_dvr_to_pipe (mptools_pipedfork_t *ppfk, dvrcontrol_t *dvrctl);
-extern int stream_media_dvr_to_file (dvrcontrol_t *dvrctl, int media_container, const char *filename);
+extern int stream_media_dvr_to_file (dvrcontrol_t *dvrctl, int media_container, const char *filename_pattern);
 
 #endif
 
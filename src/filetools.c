@@ -21,6 +21,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include "filetools.h"
 
 /* OUTPUT file */
@@ -34,6 +44,8 @@ t_outfile *outfile_open (const char *given_filename)
 		return NULL;
 
 	outfile->fd_close = true;
+	outfile->aw_ring = NULL;
+	outfile->aw_errno = 0;
 
 	if (*given_filename == '\0') {
 		outfile->fd = stdout;
@@ -46,18 +58,248 @@ t_outfile *outfile_open (const char *given_filename)
 	return outfile;
 }
 
+/* asynchronous output: writer thread.
+   writes everything queued at once, until the queue is closed and empty. */
+static void *outfile_async_writer (void *arg)
+{
+	t_outfile *outfile = (t_outfile *) arg;
+	int fd = fileno (outfile->fd);
+	struct iovec iov[2];
+	sigset_t bmask;
+	ssize_t written;
+	int iov_n;
+
+	/* signals are dealt by the other threads */
+	sigfillset (&bmask);
+	pthread_sigmask (SIG_BLOCK, &bmask, NULL);
+
+	while (btring_wait_data (outfile->aw_ring, 1000) >= 0) {
+		if ((iov_n = btring_peekv (outfile->aw_ring, iov)) == 0)
+			continue;
+		if ((written = writev (fd, iov, iov_n)) == -1) {
+			if (errno == EINTR)
+				continue;
+			outfile->aw_errno = errno;
+			btring_close (outfile->aw_ring);	/* producer will notice */
+			break;
+		}
+		btring_consume (outfile->aw_ring, written);
+	}
+
+	return NULL;
+}
+
+/* makes further writes asynchronous: data is queued (up to queue_len bytes)
+   and written in large batches by a dedicated thread.
+   a full queue makes outfile_write() wait (see outfile_would_block).
+   returns ==0 ok, !=0 error (output remains synchronous) */
+int outfile_set_async (t_outfile *outfile, size_t queue_len)
+{
+	btring_t *ring;
+
+	if (outfile->aw_ring != NULL)
+		return 0;
+	if (fflush (outfile->fd) != 0)
+		return 1;
+	if ((ring = malloc (sizeof (btring_t))) == NULL)
+		return 2;
+	ring->bsize = queue_len;
+	if (btring_create (ring) != 0) {
+		free (ring);
+		return 3;
+	}
+
+	outfile->aw_ring = ring;
+	outfile->aw_errno = 0;
+	if (pthread_create (&(outfile->aw_thread), NULL, outfile_async_writer, outfile) != 0) {
+		outfile->aw_ring = NULL;
+		btring_destroy (ring);
+		free (ring);
+		return 4;
+	}
+
+	return 0;
+}
+
+/* returns true if outfile_write() would have to wait
+   for the output queue in order to store data_len bytes */
+bool outfile_would_block (t_outfile *outfile, size_t data_len)
+{
+	if (outfile->aw_ring == NULL)
+		return false;
+	return ((btring_get_free_len (outfile->aw_ring) < data_len) ? true : false);
+}
+
 /* returns ==0 ok, !=0 error */
 int outfile_write (t_outfile *outfile, uint8_t *data_p, size_t data_len)
 {
+	if (outfile->aw_ring != NULL) {
+		/* asynchronous */
+		if (btring_write (outfile->aw_ring, data_p, data_len) != 0)
+			return -2;	/* writer has failed */
+		return 0;
+	}
+
 	if (fwrite (data_p, 1, data_len, outfile->fd) < data_len)
 		return -1;
 	return (fflush (outfile->fd));
 }
 
+/* writes several pieces of data, one after the other, without gathering
+   them first (eg. container headers followed by a frame body, in place).
+   returns ==0 ok, !=0 error */
+int outfile_writev (t_outfile *outfile, const struct iovec *iov, int iov_n)
+{
+	struct iovec iov_left[OUTFILE_IOV_MAX];
+	ssize_t written;
+	int i;
+
+	if ((iov_n < 0) || (iov_n > OUTFILE_IOV_MAX))
+		return -3;
+
+	if (outfile->aw_ring != NULL) {
+		/* asynchronous: the queue gathers them anyway */
+		for (i = 0; i < iov_n; i++) {
+			if (btring_write (outfile->aw_ring, iov[i].iov_base, iov[i].iov_len) != 0)
+				return -2;	/* writer has failed */
+		}
+		return 0;
+	}
+
+	/* nothing is left buffered by outfile_write(), bypass stdio */
+	memcpy (iov_left, iov, iov_n * sizeof (struct iovec));
+	i = 0;
+	while (i < iov_n) {
+		if ((written = writev (fileno (outfile->fd), iov_left + i, iov_n - i)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		/* partial write: resume where it stopped */
+		while ((i < iov_n) && ((size_t) written >= iov_left[i].iov_len))
+			written -= iov_left[i++].iov_len;
+		if (i < iov_n) {
+			iov_left[i].iov_base = (uint8_t *) iov_left[i].iov_base + written;
+			iov_left[i].iov_len -= written;
+		}
+	}
+	return 0;
+}
+
+/* returns true if previously written data may be overwritten
+   (see outfile_patch). stdout is never considered seekable,
+   since it may be appending to an existing file. */
+bool outfile_is_seekable (t_outfile *outfile)
+{
+	struct stat st;
+
+	if (outfile->fd_close == false)
+		return false;
+	if (fstat (fileno (outfile->fd), &st) != 0)
+		return false;
+	return ((S_ISREG (st.st_mode)) ? true : false);
+}
+
+/* overwrites previously written data at offset,
+   further writes are appended to the end of file as usual.
+   (asynchronous output: waits for the queue to be written first)
+   returns ==0 ok, !=0 error */
+int outfile_patch (t_outfile *outfile, off_t offset, uint8_t *data_p, size_t data_len)
+{
+	if (outfile->aw_ring != NULL) {
+		/* asynchronous: wait for the queued data to be written first */
+		if (btring_wait_empty (outfile->aw_ring) != 0)
+			return -2;
+	} else {
+		if (fflush (outfile->fd) != 0)
+			return -1;
+	}
+
+	/* pwrite() does not move the file offset, further writes still go to the end */
+	if (pwrite (fileno (outfile->fd), data_p, data_len, offset) != (ssize_t) data_len)
+		return -1;
+	return 0;
+}
+
 void outfile_close (t_outfile *outfile)
 {
+	if (outfile->aw_ring != NULL) {
+		/* let the writer flush the queue, then quit */
+		btring_close (outfile->aw_ring);
+		pthread_join (outfile->aw_thread, NULL);
+		btring_destroy (outfile->aw_ring);
+		free (outfile->aw_ring);
+	}
 	if (outfile->fd_close == true)
 		fclose (outfile->fd);
+	free (outfile);
+}
+
+
+
+/* expands a filename pattern into dst,
+   replacing every "%N" by the given channel number.
+   other characters (including other '%' sequences) are copied verbatim.
+   returns ==0 ok, !=0 error (dst too small) */
+int outfile_expand_name (char *dst, size_t dst_len, const char *pattern, int channel)
+{
+	size_t dst_pos = 0;
+	int ret;
+
+	while (*pattern != '\0') {
+		if ((*pattern == '%') && (*(pattern + 1) == 'N')) {
+			ret = snprintf (dst + dst_pos, dst_len - dst_pos, "%d", channel);
+			if ((ret < 0) || ((size_t) ret >= (dst_len - dst_pos)))
+				return 1;
+			dst_pos += ret;
+			pattern += 2;
+		} else {
+			if ((dst_pos + 1) >= dst_len)
+				return 1;
+			dst[dst_pos++] = *(pattern++);
+		}
+	}
+	dst[dst_pos] = '\0';
+
+	return 0;
+}
+
+/* same as outfile_expand_name(), then strftime() conversions
+   (eg. "%Y%m%d-%H%M%S") are applied, for local time t.
+   returns ==0 ok, !=0 error (dst too small) */
+int outfile_expand_name_time (char *dst, size_t dst_len, const char *pattern, int channel, time_t t)
+{
+	char tmp[FILENAME_MAX];
+	struct tm tm_local;
+
+	if (outfile_expand_name (tmp, sizeof (tmp), pattern, channel) != 0)
+		return 1;
+	if (localtime_r (&t, &tm_local) == NULL)
+		return 1;
+	if (strftime (dst, dst_len, tmp, &tm_local) == 0)
+		return 1;
+
+	return 0;
+}
+
+/* returns true if pattern contains strftime() conversions
+   (any '%' sequence other than "%N" and "%%") */
+bool outfile_name_has_time (const char *pattern)
+{
+	while ((pattern = strchr (pattern, '%')) != NULL) {
+		if (*(pattern + 1) == '\0')
+			return false;
+		if ((*(pattern + 1) != 'N') && (*(pattern + 1) != '%'))
+			return true;
+		pattern += 2;
+	}
+	return false;
+}
+
+/* returns true if pattern contains "%N" */
+bool outfile_name_has_channel (const char *pattern)
+{
+	return ((strstr (pattern, "%N") != NULL) ? true : false);
 }
 
 
@@ -73,6 +315,8 @@ t_infile *infile_open (const char *given_filename)
 		return NULL;
 
 	infile->fd_close = true;
+	infile->map_p = NULL;
+	infile->map_len = 0;
 
 	if (*given_filename == '\0') {
 		infile->fd = stdin;
@@ -85,15 +329,48 @@ t_infile *infile_open (const char *given_filename)
 	return infile;
 }
 
-/* returns as fread does */
+/* reads up to buf_len bytes, as soon as any data is available
+   (pipes may return less than requested, even before the end of input).
+   returns the bytes read, 0 at the end of input (or error) */
 int infile_read (t_infile *infile, uint8_t *data_p, size_t buf_len)
 {
-	return (fread (data_p, 1, buf_len, infile->fd));
+	ssize_t ret;
+
+	while (((ret = read (fileno (infile->fd), data_p, buf_len)) == -1) && (errno == EINTR));
+	return ((ret > 0) ? ret : 0);
+}
+
+/* maps the whole input file into memory (read only), so that its data
+   is taken in place, instead of copied by infile_read().
+   returns the mapping (valid until infile_close), with its length at *map_len.
+   NULL if the input cannot be mapped (pipes, terminals, empty file, etc) */
+uint8_t *infile_map (t_infile *infile, size_t *map_len)
+{
+	struct stat st;
+	void *p;
+
+	if (infile->map_p == NULL) {
+		if ((fstat (fileno (infile->fd), &st) != 0) || (! S_ISREG (st.st_mode)) || \
+			(st.st_size <= 0) || ((uint64_t) st.st_size > SIZE_MAX))
+			return NULL;
+		if ((p = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno (infile->fd), 0)) == MAP_FAILED)
+			return NULL;
+		/* read ahead aggressively, frames are taken in order */
+		madvise (p, st.st_size, MADV_SEQUENTIAL);
+		infile->map_p = p;
+		infile->map_len = st.st_size;
+	}
+
+	*map_len = infile->map_len;
+	return infile->map_p;
 }
 
 void infile_close (t_infile *infile)
 {
+	if (infile->map_p != NULL)
+		munmap (infile->map_p, infile->map_len);
 	if (infile->fd_close == true)
 		fclose (infile->fd);
+	free (infile);
 }
 
@@ -24,21 +24,54 @@
 #include <stdbool.h>
 #include <inttypes.h>
 #include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <pthread.h>
+#include "bufftools.h"
+
+/* max pieces of data per outfile_writev() call */
+#define OUTFILE_IOV_MAX 8
+
+/* what to do when the output queue is full (see outfile_set_async) */
+typedef enum {
+	OUTFILE_DROP_NONE,	/* wait for the queue (a slow output slows down the input) */
+	OUTFILE_DROP_FRAMES	/* caller drops frames, up to the next I-frame (see outfile_would_block) */
+} outfile_drop_t;
 
 typedef struct {
         FILE *fd;
 	bool fd_close; /* close on exit. false if stdout */
+
+	/* asynchronous output (output only), see outfile_set_async() */
+	btring_t *aw_ring;	/* queued data, NULL if synchronous */
+	pthread_t aw_thread;	/* writer */
+	int aw_errno;		/* !=0, writer has failed (errno) */
+
+	/* whole file in memory (input only), see infile_map() */
+	uint8_t *map_p;		/* NULL if not mapped */
+	size_t map_len;
 } t_inoutfile;
 
 #define t_outfile t_inoutfile
 #define t_infile t_inoutfile
 
 extern t_outfile *outfile_open (const char *given_filename);
+extern int outfile_set_async (t_outfile *outfile, size_t queue_len);
+extern bool outfile_would_block (t_outfile *outfile, size_t data_len);
 extern int outfile_write (t_outfile *outfile, uint8_t *data_p, size_t data_len);
+extern int outfile_writev (t_outfile *outfile, const struct iovec *iov, int iov_n);
+extern bool outfile_is_seekable (t_outfile *outfile);
+extern int outfile_patch (t_outfile *outfile, off_t offset, uint8_t *data_p, size_t data_len);
 extern void outfile_close (t_outfile *outfile);
+extern int outfile_expand_name (char *dst, size_t dst_len, const char *pattern, int channel);
+extern bool outfile_name_has_channel (const char *pattern);
+extern int outfile_expand_name_time (char *dst, size_t dst_len, const char *pattern, int channel, time_t t);
+extern bool outfile_name_has_time (const char *pattern);
 
 extern t_infile *infile_open (const char *given_filename);
 extern int infile_read (t_infile *infile, uint8_t *data_p, size_t buf_len);
+extern uint8_t *infile_map (t_infile *infile, size_t *map_len);
 extern void infile_close (t_infile *infile);
 
 
@@ -302,13 +302,50 @@ int hlp_logout (t_hlp_connection *hlp_connection)
 	return 0;
 }
 
+/* collects the first reply (frame) after a media data request,
+   used by hlp_media_data_request*() */
+static int hlp_media_data_first_reply (t_llp_connection *llp_connection_data, uint8_t *dest_data_p, size_t max_len, size_t *dest_data_len)
+{
+	t_ll_header ll_header_in;
+
+	DEBUG_LOG_PRINTF ("getting media reply...\n");
+
+	/* get reply */
+	if (hlp_get_header (llp_connection_data, &ll_header_in, 0xbc) != 0)
+		return 2;
+
+	/* get extdata */
+	if (dest_data_p == NULL) {
+		if (llp_get_discard_extdata (llp_connection_data, &ll_header_in) != 0)
+			return 3;
+	} else {
+		/* collect a single frame
+		   (other frames will come automatically but we don't get them now) */
+		if (ll_header_in.extlen > max_len) {
+			if (llp_get_discard_extdata (llp_connection_data, &ll_header_in) != 0)
+				return 5;
+			return 10;
+		} else {
+			DEBUG_LOG_PRINTF ("hlp_media_data_request: collecting 1st frame extdata, %d bytes\n", ll_header_in.extlen);
+			*dest_data_len = ll_header_in.extlen;
+			if (llp_get_extdata_sbuff (llp_connection_data, &ll_header_in, dest_data_p, *dest_data_len) < 0)
+				return 4;
+		}
+	}
+
+	if (ll_header_in.raw[16] != 0)
+		return ((int) ll_header_in.raw[16] + REMOTE_RETCODE_OFFSET);
+
+	return 0;
+}
+
 /* channel: between 0-15, 0-7 or 0-3 (depends on DVR model) */
 /* sub_channel: 0-main, 1-extra_stream_1, 2-extra_stream_2 (may not work), 4-snapshot (may not work ???) */
 int hlp_media_data_request (t_hlp_connection *hlp_connection_ctrl, t_hlp_connection *hlp_connection_data, int channel, int sub_channel, uint8_t *dest_data_p, size_t max_len, size_t *dest_data_len)
 {
 	t_llp_connection *llp_connection_ctrl = &(hlp_connection_ctrl->llp_connection);
 	t_llp_connection *llp_connection_data = &(hlp_connection_data->llp_connection);
-	t_ll_header ll_header_out, ll_header_in;
+	t_ll_header ll_header_out;
 	uint8_t extdata_out[64];
 	int i;
 
@@ -360,35 +397,50 @@ int hlp_media_data_request (t_hlp_connection *hlp_connection_ctrl, t_hlp_connect
 			return 3;
 	}
 
-	DEBUG_LOG_PRINTF ("getting media reply...\n");
+	return (hlp_media_data_first_reply (llp_connection_data, dest_data_p, max_len, dest_data_len));
+}
 
-	/* get reply */
-	if (hlp_get_header (llp_connection_data, &ll_header_in, 0xbc) != 0)
-		return 2;
+/* same as hlp_media_data_request(), but requests several channels
+   at once to be sent through a single data connection (hlp_connection_data).
+   frames from all those channels come interleaved, the DHAV channel field
+   tells which channel each frame belongs to.
+   supported by OLD protocol only, thus channels: between 0-15 */
+int hlp_media_data_request_multiplexed (t_hlp_connection *hlp_connection_ctrl, t_hlp_connection *hlp_connection_data, const int *channels, int n_channels, int sub_channel, uint8_t *dest_data_p, size_t max_len, size_t *dest_data_len)
+{
+	t_llp_connection *llp_connection_ctrl = &(hlp_connection_ctrl->llp_connection);
+	t_llp_connection *llp_connection_data = &(hlp_connection_data->llp_connection);
+	t_ll_header ll_header_out;
+	uint8_t extdata_out[16];
+	int i;
 
-	/* get extdata */
-	if (dest_data_p == NULL) {
-		if (llp_get_discard_extdata (llp_connection_data, &ll_header_in) != 0)
-			return 3;
-	} else {
-		/* collect a single frame
-		   (other frames will come automatically but we don't get them now) */
-		if (ll_header_in.extlen > max_len) {
-			if (llp_get_discard_extdata (llp_connection_data, &ll_header_in) != 0)
-				return 5;
-			return 10;
-		} else {
-			DEBUG_LOG_PRINTF ("hlp_media_data_request: collecting 1st frame extdata, %d bytes\n", ll_header_in.extlen);
-			*dest_data_len = ll_header_in.extlen;
-			if (llp_get_extdata_sbuff (llp_connection_data, &ll_header_in, dest_data_p, *dest_data_len) < 0)
-				return 4;
-		}
+	DEBUG_LOG_PRINTF ("sending multiplexed media request...\n");
+
+	/* send request */
+	llp_init_header (&ll_header_out);
+	ll_header_out.llp_hd_cmd = 0x11;
+
+	/* clean up extdata */
+	for (i = 0; i < 16; i++)
+		extdata_out[i] = 0;
+
+	ll_header_out.extlen = 16;
+	ll_header_out.raw[24] = 0;	/* was 0xff does not modify previous value */
+	for (i = 0; i < n_channels; i++) {
+		if ((channels[i] < 0) || (channels[i] >= 16))
+			return 1;	/* not supported by OLD protocol */
+		ll_header_out.raw[8 + channels[i]] = 1; /* monitor this channel - DVR requires either 0(no) or 1(yes) */
+
+		/* define sub channel */
+		extdata_out[channels[i]] = sub_channel;
 	}
 
-	if (ll_header_in.raw[16] != 0)
-		return ((int) ll_header_in.raw[16] + REMOTE_RETCODE_OFFSET);
+	if (llp_send_header (llp_connection_ctrl, &ll_header_out) != 0)
+		return 4;
 
-	return 0;
+	if (llp_send_extdata (llp_connection_ctrl, (uint8_t *) extdata_out, ll_header_out.extlen) != 0)
+		return 3;
+
+	return (hlp_media_data_first_reply (llp_connection_data, dest_data_p, max_len, dest_data_len));
 }
 
 
@@ -431,6 +483,32 @@ int hlp_collect_media_data (t_hlp_connection *hlp_connection_data, int channel,
 
 
 
+/* same as hlp_collect_media_data(), but does not copy data:
+   *dest_data_p points to data inside the connection's receive buffer,
+   valid only until the next call involving hlp_connection_data. */
+int hlp_collect_media_data_view (t_hlp_connection *hlp_connection_data, uint8_t **dest_data_p, size_t *dest_data_len)
+{
+	t_llp_connection *llp_connection_data = &(hlp_connection_data->llp_connection);
+	t_ll_header ll_header_in;
+	int extdata_len;
+
+	/* get reply */
+	if (hlp_get_header (llp_connection_data, &ll_header_in, 0xbc) != 0)
+		return 2;
+
+	/* get extdata */
+	if ((extdata_len = llp_get_extdata_view (llp_connection_data, &ll_header_in, dest_data_p)) < 0)
+		return 11;
+	*dest_data_len = extdata_len;
+
+	if (ll_header_in.raw[16] != 0)
+		return ((int) ll_header_in.raw[16] + REMOTE_RETCODE_OFFSET);
+
+	return 0;
+}
+
+
+
 /* requires:
    - hlp_open to both hlp_connection_orig and hlp_connection_new
    - previous call of hlp_login(hlp_connection_orig,...) */
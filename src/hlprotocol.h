@@ -39,7 +39,9 @@ extern int hlp_get_header_and_extdata (t_llp_connection *llp_connection, t_ll_he
 extern int hlp_login (t_hlp_connection *hlp_connection, t_devinfo *devinfo, const char *user, const char *passwd);
 extern int hlp_logout (t_hlp_connection *hlp_connection);
 int hlp_media_data_request (t_hlp_connection *hlp_connection_ctrl, t_hlp_connection *hlp_connection_data, int channel, int sub_channel, uint8_t *dest_data_p, size_t max_len, size_t *dest_data_len);
+extern int hlp_media_data_request_multiplexed (t_hlp_connection *hlp_connection_ctrl, t_hlp_connection *hlp_connection_data, const int *channels, int n_channels, int sub_channel, uint8_t *dest_data_p, size_t max_len, size_t *dest_data_len);
 extern int hlp_collect_media_data (t_hlp_connection *hlp_connection_data, int channel, uint8_t *dest_data_p, size_t max_len, size_t *dest_data_len);
+extern int hlp_collect_media_data_view (t_hlp_connection *hlp_connection_data, uint8_t **dest_data_p, size_t *dest_data_len);
 extern int hlp_connection_relationship (t_hlp_connection *hlp_connection_orig, t_hlp_connection *hlp_connection_new, uint8_t reqtype, uint8_t reqchnumber);
 extern int hlp_send_extension_string (t_hlp_connection *hlp_connection, const char *extstr);
 extern int hlp_get_work_alarm_status (t_hlp_connection *hlp_connection);
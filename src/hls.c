@@ -0,0 +1,214 @@
+/* hls.c */
+/* HTTP Live Streaming output: rolling segments and playlist */
+
+/* TaniDVR
+ * Copyright (c) 2011-2015 Daniel Mealha Cabrita
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "log.h"
+#include "hls.h"
+
+/* playlist URIs are relative to the playlist itself */
+static const char *hls_uri (const char *filename)
+{
+	const char *p;
+
+	return (((p = strrchr (filename, '/')) != NULL) ? (p + 1) : filename);
+}
+
+static int hls_init_name (const hls_t *hls, char *dst, size_t dst_len)
+{
+	int ret;
+
+	ret = snprintf (dst, dst_len, "%s-init.mp4", hls->base);
+	return (((ret < 0) || ((size_t) ret >= dst_len)) ? 1 : 0);
+}
+
+static int hls_segment_name_seq (const hls_t *hls, uint64_t seq, char *dst, size_t dst_len)
+{
+	int ret;
+
+	ret = snprintf (dst, dst_len, "%s-%" PRIu64 ".m4s", hls->base, seq);
+	return (((ret < 0) || ((size_t) ret >= dst_len)) ? 1 : 0);
+}
+
+/* (re)writes the playlist, atomically (readers never see a partial one).
+   endlist: true if no more segments will follow.
+   returns ==0 ok, !=0 error */
+static int hls_write_playlist (const hls_t *hls, bool endlist)
+{
+	char tmp_name[FILENAME_MAX + 4];
+	char name[FILENAME_MAX];
+	const hls_segment_t *seg;
+	unsigned int first;
+	unsigned int i;
+	FILE *fd;
+
+	snprintf (tmp_name, sizeof (tmp_name), "%s.tmp", hls->playlist);
+	if ((fd = fopen (tmp_name, "w")) == NULL)
+		return 1;
+
+	/* only the last <window> segments are listed */
+	first = (hls->seg_n > hls->window) ? (hls->seg_n - hls->window) : 0;
+
+	hls_init_name (hls, name, sizeof (name));
+	fprintf (fd, "#EXTM3U\n#EXT-X-VERSION:7\n#EXT-X-TARGETDURATION:%u\n", hls->target_duration);
+	fprintf (fd, "#EXT-X-MEDIA-SEQUENCE:%" PRIu64 "\n", (hls->seg_n > 0) ? hls->seg[(hls->seg_pos + first) % (HLS_MAX_WINDOW + HLS_GRACE_SEGMENTS)].seq : hls->next_seq);
+	fprintf (fd, "#EXT-X-INDEPENDENT-SEGMENTS\n#EXT-X-MAP:URI=\"%s\"\n", hls_uri (name));
+	for (i = first; i < hls->seg_n; i++) {
+		seg = &(hls->seg[(hls->seg_pos + i) % (HLS_MAX_WINDOW + HLS_GRACE_SEGMENTS)]);
+		hls_segment_name_seq (hls, seg->seq, name, sizeof (name));
+		fprintf (fd, "#EXTINF:%.3f,\n%s\n", seg->duration, hls_uri (name));
+	}
+	if (endlist == true)
+		fprintf (fd, "#EXT-X-ENDLIST\n");
+
+	if (fclose (fd) != 0) {
+		unlink (tmp_name);
+		return 2;
+	}
+	if (rename (tmp_name, hls->playlist) != 0) {
+		unlink (tmp_name);
+		return 3;
+	}
+	return 0;
+}
+
+/* starts HLS output: playlist is the .m3u8 file to be written,
+   the init segment and the media segments are written along it
+   (<playlist without .m3u8>-init.mp4, <...>-<sequence>.m4s).
+   window: segments listed in the playlist (1 to HLS_MAX_WINDOW).
+   returns NULL if error (already logged) */
+hls_t *hls_open (const char *playlist, unsigned int window, unsigned int segment_duration)
+{
+	hls_t *hls;
+	size_t len;
+
+	if ((window < 1) || (window > HLS_MAX_WINDOW)) {
+		log_printf (LOGT_FATAL, "Invalid HLS playlist length.\n");
+		return NULL;
+	}
+	if ((len = strlen (playlist)) >= sizeof (hls->base)) {
+		log_printf (LOGT_FATAL, "Output filename too long.\n");
+		return NULL;
+	}
+	if ((hls = malloc (sizeof (hls_t))) == NULL)
+		return NULL;
+
+	hls->window = window;
+	hls->segment_duration = segment_duration;
+	strcpy (hls->playlist, playlist);
+	strcpy (hls->base, playlist);
+	if ((len > 5) && (strcmp (playlist + len - 5, ".m3u8") == 0))
+		hls->base[len - 5] = '\0';
+	hls->seg_pos = 0;
+	hls->seg_n = 0;
+	/* RFC 8216: EXT-X-TARGETDURATION MUST NOT change, thus it is set
+	   up front, with room for the I-frame which ends each segment */
+	hls->target_duration = segment_duration + HLS_TARGET_DURATION_MARGIN;
+	hls->target_exceeded_warned = false;
+
+	/* sequence numbers keep growing across restarts,
+	   so that neither players nor older segment files get confused */
+	hls->next_seq = (uint64_t) time (NULL);
+
+	return hls;
+}
+
+/* name of the segment file being written */
+/* returns ==0 ok, !=0 error (dst too small) */
+int hls_segment_name (const hls_t *hls, char *dst, size_t dst_len)
+{
+	return (hls_segment_name_seq (hls, hls->next_seq, dst, dst_len));
+}
+
+/* writes the init segment (referenced by every media segment).
+   returns ==0 ok, !=0 error (already logged) */
+int hls_write_init (hls_t *hls, const uint8_t *data_p, size_t data_len)
+{
+	char name[FILENAME_MAX];
+	FILE *fd;
+
+	hls_init_name (hls, name, sizeof (name));
+	if ((fd = fopen (name, "wb")) == NULL) {
+		log_printf (LOGT_ERROR, "Unable to write HLS init segment: %s\n", name);
+		return 1;
+	}
+	if (fwrite (data_p, 1, data_len, fd) < data_len) {
+		log_printf (LOGT_ERROR, "Unable to write HLS init segment: %s\n", name);
+		fclose (fd);
+		return 2;
+	}
+	if (fclose (fd) != 0) {
+		log_printf (LOGT_ERROR, "Unable to write HLS init segment: %s\n", name);
+		return 3;
+	}
+	return 0;
+}
+
+/* the segment being written is complete (duration in seconds):
+   it is added to the playlist, and the oldest segment file is removed
+   once out of the window (see HLS_GRACE_SEGMENTS).
+   returns ==0 ok, !=0 error (already logged) */
+int hls_add_segment (hls_t *hls, double duration)
+{
+	char name[FILENAME_MAX];
+	hls_segment_t *seg;
+
+	while (hls->seg_n >= (hls->window + HLS_GRACE_SEGMENTS)) {
+		hls_segment_name_seq (hls, hls->seg[hls->seg_pos].seq, name, sizeof (name));
+		unlink (name);
+		hls->seg_n--;
+		hls->seg_pos = (hls->seg_pos + 1) % (HLS_MAX_WINDOW + HLS_GRACE_SEGMENTS);
+	}
+
+	seg = &(hls->seg[(hls->seg_pos + hls->seg_n) % (HLS_MAX_WINDOW + HLS_GRACE_SEGMENTS)]);
+	seg->seq = hls->next_seq++;
+	seg->duration = duration;
+	hls->seg_n++;
+
+	/* EXTINF durations, rounded, must not exceed the target duration,
+	   which only a GOP longer than it may cause (see chanproc) */
+	if (((unsigned int) (duration + 0.5) > hls->target_duration) && (hls->target_exceeded_warned == false)) {
+		log_printf (LOGT_WARNING, "HLS segment of %.3f seconds exceeds the target duration (%u), "
+			"the DVR I-frame interval is too long: %s\n", duration, hls->target_duration, hls->playlist);
+		hls->target_exceeded_warned = true;
+	}
+
+	if (hls_write_playlist (hls, false) != 0) {
+		log_printf (LOGT_ERROR, "Unable to write HLS playlist: %s\n", hls->playlist);
+		return 1;
+	}
+	return 0;
+}
+
+/* ends the playlist (segment files are kept) */
+void hls_close (hls_t *hls)
+{
+	if (hls_write_playlist (hls, true) != 0)
+		log_printf (LOGT_ERROR, "Unable to write HLS playlist: %s\n", hls->playlist);
+	free (hls);
+}
+
@@ -0,0 +1,71 @@
+/* hls.h */
+/* HTTP Live Streaming output: rolling segments and playlist */
+
+/* TaniDVR
+ * Copyright (c) 2011-2015 Daniel Mealha Cabrita
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HLS_H
+#define HLS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/* max segments listed in the playlist */
+#define HLS_MAX_WINDOW 64
+
+/* segment files are removed only this many segments after
+   leaving the playlist (clients may still be fetching them) */
+#define HLS_GRACE_SEGMENTS 2
+
+/* segment duration, if not defined otherwise (seconds) */
+#define HLS_DEFAULT_SEGMENT_DURATION 4
+
+/* segments are cut at I-frames only, thus may run longer than
+   the segment duration: EXT-X-TARGETDURATION is the segment duration
+   plus this margin (seconds), for a GOP at most this long */
+#define HLS_TARGET_DURATION_MARGIN 2
+
+typedef struct {
+	uint64_t seq;		/* media sequence number */
+	double duration;	/* seconds */
+} hls_segment_t;
+
+typedef struct {
+	unsigned int window;		/* segments listed in the playlist */
+	unsigned int segment_duration;	/* seconds, segments are cut at the first I-frame past this */
+	unsigned int target_duration;	/* EXT-X-TARGETDURATION (seconds), fixed: segments are cut before exceeding it */
+
+	/* PRIVATE */
+	char playlist[FILENAME_MAX];
+	char base[FILENAME_MAX - 32];	/* playlist name without ".m3u8", segment names derive from it */
+	hls_segment_t seg[HLS_MAX_WINDOW + HLS_GRACE_SEGMENTS];	/* complete segments (circular, oldest first) */
+	unsigned int seg_pos;
+	unsigned int seg_n;
+	uint64_t next_seq;		/* media sequence of the segment being written */
+	bool target_exceeded_warned;
+} hls_t;
+
+extern hls_t *hls_open (const char *playlist, unsigned int window, unsigned int segment_duration);
+extern int hls_segment_name (const hls_t *hls, char *dst, size_t dst_len);
+extern int hls_write_init (hls_t *hls, const uint8_t *data_p, size_t data_len);
+extern int hls_add_segment (hls_t *hls, double duration);
+extern void hls_close (hls_t *hls);
+
+#endif
+
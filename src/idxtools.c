@@ -0,0 +1,195 @@
+/* idxtools.c */
+/* keyframe index: sidecar file listing the I-frames of a recording */
+
+/* TaniDVR
+ * Copyright (c) 2011-2015 Daniel Mealha Cabrita
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "bintools.h"
+#include "idxtools.h"
+
+/* builds the index filename of a recording.
+   returns ==0 ok, !=0 error (name too long) */
+int idx_name (char *dst, size_t dst_len, const char *media_filename)
+{
+	int ret;
+
+	ret = snprintf (dst, dst_len, "%s" IDX_SUFFIX, media_filename);
+	return (((ret < 0) || ((size_t) ret >= dst_len)) ? 1 : 0);
+}
+
+
+
+/* WRITER */
+
+/* starts a new (empty) index for the given recording,
+   replacing any previous one.
+   returns NULL if error */
+idx_writer_t *idx_create (const char *media_filename)
+{
+	char name[FILENAME_MAX];
+	uint8_t header[IDX_HEADER_LEN];
+	idx_writer_t *idxw;
+
+	if (idx_name (name, sizeof (name), media_filename) != 0)
+		return NULL;
+	if ((idxw = malloc (sizeof (idx_writer_t))) == NULL)
+		return NULL;
+	if ((idxw->fd = fopen (name, "wb")) == NULL) {
+		free (idxw);
+		return NULL;
+	}
+	idxw->entries_n = 0;
+
+	memcpy (header, IDX_MAGIC, IDX_MAGIC_LEN);
+	BT_NV2LM_U32(header + 8, IDX_VERSION);
+	BT_NV2LM_U32(header + 12, IDX_RECORD_LEN);
+	if ((fwrite (header, 1, IDX_HEADER_LEN, idxw->fd) < IDX_HEADER_LEN) || (fflush (idxw->fd) != 0)) {
+		idx_writer_close (idxw);
+		return NULL;
+	}
+
+	return idxw;
+}
+
+/* appends an I-frame to the index.
+   records are flushed at once (one per GOP), so that the index
+   is usable while recording, and survives an interrupted one.
+   returns ==0 ok, !=0 error */
+int idx_append (idx_writer_t *idxw, const idx_entry_t *entry)
+{
+	uint8_t rec[IDX_RECORD_LEN];
+
+	BT_NV2LM_U64(rec, entry->offset);
+	BT_NV2LM_U64(rec + 8, entry->v_timestamp);
+	BT_NV2LM_U32(rec + 16, entry->epoch);
+	BT_NV2LM_U32(rec + 20, entry->size);
+	if ((fwrite (rec, 1, IDX_RECORD_LEN, idxw->fd) < IDX_RECORD_LEN) || (fflush (idxw->fd) != 0))
+		return 1;
+	idxw->entries_n++;
+	return 0;
+}
+
+void idx_writer_close (idx_writer_t *idxw)
+{
+	fclose (idxw->fd);
+	free (idxw);
+}
+
+
+
+/* READER */
+
+/* maps the index of the given recording (read only),
+   records are taken in place, nothing is loaded in advance.
+   returns NULL if there is no (valid) index */
+idx_t *idx_open (const char *media_filename)
+{
+	char name[FILENAME_MAX];
+	struct stat st;
+	idx_t *idx;
+	void *p;
+	int fd;
+
+	if (idx_name (name, sizeof (name), media_filename) != 0)
+		return NULL;
+	if ((fd = open (name, O_RDONLY)) < 0)
+		return NULL;
+	if ((fstat (fd, &st) != 0) || (! S_ISREG (st.st_mode)) || \
+		(st.st_size < IDX_HEADER_LEN) || ((uint64_t) st.st_size > SIZE_MAX)) {
+		close (fd);
+		return NULL;
+	}
+	p = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	if ((memcmp (p, IDX_MAGIC, IDX_MAGIC_LEN) != 0) || \
+		(BT_LM2NV_U32((uint8_t *) p + 8) != IDX_VERSION) || \
+		(BT_LM2NV_U32((uint8_t *) p + 12) != IDX_RECORD_LEN) || \
+		((idx = malloc (sizeof (idx_t))) == NULL)) {
+		munmap (p, st.st_size);
+		return NULL;
+	}
+	idx->map_p = p;
+	idx->map_len = st.st_size;
+	idx->entries_n = (idx->map_len - IDX_HEADER_LEN) / IDX_RECORD_LEN;
+
+	return idx;
+}
+
+/* takes the n-th record (0: first).
+   returns ==0 ok, !=0 error (no such record) */
+int idx_get (const idx_t *idx, size_t n, idx_entry_t *entry)
+{
+	const uint8_t *rec;
+
+	if (n >= idx->entries_n)
+		return 1;
+	rec = idx->map_p + IDX_HEADER_LEN + (n * IDX_RECORD_LEN);
+	entry->offset = ((uint64_t) BT_LM2NV_U32(rec + 4) << 32) | (uint32_t) BT_LM2NV_U32(rec);
+	entry->v_timestamp = ((uint64_t) BT_LM2NV_U32(rec + 12) << 32) | (uint32_t) BT_LM2NV_U32(rec + 8);
+	entry->epoch = BT_LM2NV_U32(rec + 16);
+	entry->size = BT_LM2NV_U32(rec + 20);
+	return 0;
+}
+
+/* takes the last I-frame with an EPOCH at (or before) the given one,
+   the first I-frame if none is (as dt_find_dhav_i_frame_at_epoch).
+   binary search, which assumes EPOCH to increase along the
+   recording (no DVR clock adjustments).
+   returns ==0 ok, !=0 error (empty index) */
+int idx_find_epoch (const idx_t *idx, uint32_t epoch, idx_entry_t *entry)
+{
+	size_t lo = 0;
+	size_t hi;
+	size_t mid;
+
+	if (idx->entries_n == 0)
+		return 1;
+
+	/* invariant: records before lo are at (or before) epoch,
+	   records from hi on are past it */
+	hi = idx->entries_n;
+	while (lo < hi) {
+		mid = lo + ((hi - lo) / 2);
+		idx_get (idx, mid, entry);
+		if (entry->epoch <= epoch) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return (idx_get (idx, (lo > 0) ? (lo - 1) : 0, entry));
+}
+
+void idx_close (idx_t *idx)
+{
+	munmap ((void *) idx->map_p, idx->map_len);
+	free (idx);
+}
@@ -0,0 +1,78 @@
+/* idxtools.h */
+/* keyframe index: sidecar file listing the I-frames of a recording */
+
+/* TaniDVR
+ * Copyright (c) 2011-2015 Daniel Mealha Cabrita
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IDXTOOLS_H
+#define IDXTOOLS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/* the index of "rec.mkv" is "rec.mkv.idx" */
+#define IDX_SUFFIX ".idx"
+
+/* file layout (all integers little-endian):
+   header:	8 bytes magic (IDX_MAGIC)
+		4 bytes format version (IDX_VERSION)
+		4 bytes record length (IDX_RECORD_LEN)
+   records, one per I-frame, in recording order:
+		8 bytes offset of the I-frame within the recording
+		8 bytes v_timestamp (nanoseconds)
+		4 bytes DHAV EPOCH (DVR wall time, seconds)
+		4 bytes I-frame length (as received from the DVR)
+   a truncated last record (eg. recording interrupted) is ignored. */
+#define IDX_MAGIC "TANIIDX\0"
+#define IDX_MAGIC_LEN 8
+#define IDX_VERSION 1
+#define IDX_HEADER_LEN 16
+#define IDX_RECORD_LEN 24
+
+typedef struct {
+	uint64_t offset;	/* where decoding may start: the I-frame itself (MKV: its cluster, fMP4: its fragment) */
+	uint64_t v_timestamp;	/* nanoseconds */
+	uint32_t epoch;		/* DHAV EPOCH */
+	uint32_t size;		/* bytes */
+} idx_entry_t;
+
+/* index being written, see idx_create() */
+typedef struct {
+	FILE *fd;
+	uint64_t entries_n;
+} idx_writer_t;
+
+/* index being read (mapped), see idx_open() */
+typedef struct {
+	const uint8_t *map_p;
+	size_t map_len;
+	size_t entries_n;
+} idx_t;
+
+extern int idx_name (char *dst, size_t dst_len, const char *media_filename);
+extern idx_writer_t *idx_create (const char *media_filename);
+extern int idx_append (idx_writer_t *idxw, const idx_entry_t *entry);
+extern void idx_writer_close (idx_writer_t *idxw);
+
+extern idx_t *idx_open (const char *media_filename);
+extern int idx_get (const idx_t *idx, size_t n, idx_entry_t *entry);
+extern int idx_find_epoch (const idx_t *idx, uint32_t epoch, idx_entry_t *entry);
+extern void idx_close (idx_t *idx);
+
+#endif
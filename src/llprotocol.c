@@ -18,6 +18,7 @@
  */
 
 #include <strings.h>
+#include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -28,16 +29,89 @@
 
 int llp_open (t_llp_connection *llp_connection, const char *hostname, unsigned short int port, unsigned int timeout_us)
 {
-	return (net_open (&(llp_connection->net_connection), hostname, port, timeout_us));
+	int ret;
+
+	if ((llp_connection->rb = malloc (LLP_RB_INITIAL_SIZE)) == NULL)
+		return 1;
+	llp_connection->rb_size = LLP_RB_INITIAL_SIZE;
+	llp_connection->rb_pos = 0;
+	llp_connection->rb_len = 0;
+
+	if ((ret = net_open (&(llp_connection->net_connection), hostname, port, timeout_us)) != 0) {
+		free (llp_connection->rb);
+		llp_connection->rb = NULL;
+	}
+	return ret;
+}
+
+/* makes sure there are at least 'need' contiguous bytes
+   of not yet consumed data in the receive buffer, starting at rb_pos.
+   reads as much as the socket has available (up to the buffer end),
+   so the following calls usually do not need to touch the socket.
+   only the (partial) not yet consumed data is ever moved around.
+   returns ==0 ok, !=0 error (network error, timeout or message too large) */
+static int llp_fill (t_llp_connection *llp_connection, size_t need)
+{
+	uint8_t *new_rb;
+	size_t new_size;
+	ssize_t got;
+
+	if (llp_connection->rb_len >= need)
+		return 0;
+
+	if ((llp_connection->rb_pos + need) > llp_connection->rb_size) {
+		if (need > llp_connection->rb_size) {
+			/* grow buffer */
+			if (need > LLP_RB_MAX_SIZE)
+				return 3;
+			new_size = llp_connection->rb_size;
+			while (new_size < need)
+				new_size *= 2;
+			if (new_size > LLP_RB_MAX_SIZE)
+				new_size = LLP_RB_MAX_SIZE;
+			if ((new_rb = malloc (new_size)) == NULL)
+				return 4;
+			memcpy (new_rb, llp_connection->rb + llp_connection->rb_pos, llp_connection->rb_len);
+			free (llp_connection->rb);
+			llp_connection->rb = new_rb;
+			llp_connection->rb_size = new_size;
+		} else {
+			/* move partial data to buffer start */
+			memmove (llp_connection->rb, llp_connection->rb + llp_connection->rb_pos, llp_connection->rb_len);
+		}
+		llp_connection->rb_pos = 0;
+	}
+
+	while (llp_connection->rb_len < need) {
+		got = net_recv (&(llp_connection->net_connection), \
+			llp_connection->rb + llp_connection->rb_pos + llp_connection->rb_len, \
+			llp_connection->rb_size - (llp_connection->rb_pos + llp_connection->rb_len));
+		if (got <= 0)
+			return ((got == 0) ? 1 : 2);
+		llp_connection->rb_len += got;
+	}
+
+	return 0;
+}
+
+/* marks len bytes of the receive buffer as consumed */
+static void llp_consume (t_llp_connection *llp_connection, size_t len)
+{
+	llp_connection->rb_pos += len;
+	llp_connection->rb_len -= len;
+	if (llp_connection->rb_len == 0)
+		llp_connection->rb_pos = 0;	/* cheap rewind, nothing to move */
 }
 
 int llp_get_header (t_llp_connection *llp_connection, t_ll_header *ll_header)
 {
-	llp_init_header (ll_header);	/* zero frame, just in case if partial fread() */
+	llp_init_header (ll_header);	/* zero frame, just in case */
 
-	if (fread (ll_header->raw, 1, LLP_HEADER_SIZE, llp_connection->net_connection.net_sockrfp) != LLP_HEADER_SIZE) {
+	if (llp_fill (llp_connection, LLP_HEADER_SIZE) != 0) {
 		return 1;
 	}
+	memcpy (ll_header->raw, llp_connection->rb + llp_connection->rb_pos, LLP_HEADER_SIZE);
+	llp_consume (llp_connection, LLP_HEADER_SIZE);
 
 	ll_header->extlen = BT_LM2NV_U32((ll_header->raw) + 4);
 
@@ -55,19 +129,42 @@ int llp_get_extdata (t_llp_connection *llp_connection, t_ll_header *ll_header)
 	return 0;
 }
 
+/* gets extdata without copying it: *data_p points to extdata inside the
+   connection's receive buffer, and remains valid only until the next
+   llp_* call on this same connection.
+   returns the length of data, or 0 if there's none, or a negative value (error). */
+int llp_get_extdata_view (t_llp_connection *llp_connection, t_ll_header *ll_header, uint8_t **data_p)
+{
+	*data_p = NULL;
+
+	if (ll_header->extlen == 0)
+		return 0;
+
+	if (llp_fill (llp_connection, ll_header->extlen) != 0)
+		return -1; /* read failed */
+
+	*data_p = llp_connection->rb + llp_connection->rb_pos;
+	llp_consume (llp_connection, ll_header->extlen);
+
+	return ll_header->extlen;
+}
+
 /* returns the length of data, or 0 if there's none, or a negative value (error). */
 int llp_get_extdata_sbuff (t_llp_connection *llp_connection, t_ll_header *ll_header, uint8_t *buf, uint32_t buflen)
 {
+	uint8_t *data_p;
+	int ret;
+
 	if (ll_header->extlen == 0)
 		return 0;
 
 	if (buflen < ll_header->extlen)
 		return -2; /* not enough buffer */
 
-	if (fread (buf, 1, ll_header->extlen, llp_connection->net_connection.net_sockrfp) != ll_header->extlen)
-		return -1; /* read failed */
+	if ((ret = llp_get_extdata_view (llp_connection, ll_header, &data_p)) > 0)
+		memcpy (buf, data_p, ret);
 
-	return ll_header->extlen;
+	return ret;
 }
 
 
@@ -78,21 +175,16 @@ int llp_get_extdata_sbuff (t_llp_connection *llp_connection, t_ll_header *ll_hea
 int llp_get_discard_extdata (t_llp_connection *llp_connection, t_ll_header *ll_header)
 {
 	uint32_t rem_extlen = ll_header->extlen;
-	uint8_t discard[DISCARD_CHUNK_SIZE];
 	uint32_t to_read;
 
-	if (rem_extlen == 0)
-		return 0;
-
 	while (rem_extlen != 0) {
-		if (rem_extlen > DISCARD_CHUNK_SIZE) {
-			to_read = DISCARD_CHUNK_SIZE;
-		} else {
-			to_read = rem_extlen;
+		if (llp_connection->rb_len == 0) {
+			to_read = (rem_extlen > DISCARD_CHUNK_SIZE) ? DISCARD_CHUNK_SIZE : rem_extlen;
+			if (llp_fill (llp_connection, to_read) != 0)
+				return 2;
 		}
-
-		if (fread (discard, 1, to_read, llp_connection->net_connection.net_sockrfp) != to_read)
-			return 2;
+		to_read = (rem_extlen > llp_connection->rb_len) ? llp_connection->rb_len : rem_extlen;
+		llp_consume (llp_connection, to_read);
 		rem_extlen -= to_read;
 	}
 
@@ -107,9 +199,8 @@ void llp_init_header (t_ll_header *ll_header)
 int llp_send_header (t_llp_connection *llp_connection, t_ll_header *ll_header)
 {
 	BT_NV2LM_U32((ll_header->raw) + 4,(ll_header->extlen))
-	if (fwrite (ll_header->raw, 1, LLP_HEADER_SIZE, llp_connection->net_connection.net_sockwfp) != LLP_HEADER_SIZE)
+	if (net_send (&(llp_connection->net_connection), ll_header->raw, LLP_HEADER_SIZE) != 0)
 		return 1;
-	fflush (llp_connection->net_connection.net_sockwfp);
 
 	return 0;
 }
@@ -129,15 +220,16 @@ int llp_send_nop (t_llp_connection *llp_connection)
 
 int llp_send_extdata (t_llp_connection *llp_connection, uint8_t *payload, uint32_t len)
 {
-	if (fwrite (payload, 1, len, llp_connection->net_connection.net_sockwfp) != len)
+	if (net_send (&(llp_connection->net_connection), payload, len) != 0)
 		return 1;
-	fflush (llp_connection->net_connection.net_sockwfp);
 	return 0;
 }
 
 void llp_close (t_llp_connection *llp_connection)
 {
 	net_close (&(llp_connection->net_connection));
+	free (llp_connection->rb);
+	llp_connection->rb = NULL;
 }
 
 /* returns >0 if there's pending data to be readen, ==0 otherwise, <0 if error */
@@ -145,6 +237,10 @@ int llp_check_incoming_data (t_llp_connection *llp_connection)
 {
 	struct pollfd sock_pollfd;
 
+	/* already received, not yet consumed */
+	if (llp_connection->rb_len > 0)
+		return 1;
+
 	sock_pollfd.fd = llp_connection->net_connection.net_sockfd;
 	sock_pollfd.events = POLLIN;
 	return (poll(&sock_pollfd, 1, 0));
@@ -158,6 +254,10 @@ int llp_wait_for_incoming_data (t_llp_connection **llp_connection, int n_llp_con
 	int i;
 
 	for (i = 0; i < n_llp_connections; i++) {
+		/* already received, not yet consumed: no need to wait */
+		if (llp_connection[i]->rb_len > 0)
+			return 1;
+
 		sock_pollfd[i].fd = llp_connection[i]->net_connection.net_sockfd;
 		sock_pollfd[i].events = POLLIN;
 	}
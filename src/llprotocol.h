@@ -36,13 +36,26 @@ typedef struct {
 	uint32_t extlen;	/* mirrors/overrides raw[4]-raw[7] */
 } t_ll_header;
 
+/* receive buffer: initial size, and the largest single message
+   (header + extdata) it is allowed to grow to */
+#define LLP_RB_INITIAL_SIZE 262144
+#define LLP_RB_MAX_SIZE 16777216
+
 typedef struct {
 	t_net_connection net_connection;	/* PRIVATE */
+
+	/* receive buffer, data is recv()'d straight into this.
+	   views returned by llp_get_extdata_view() point inside it. */
+	uint8_t *rb;		/* PRIVATE */
+	size_t rb_size;		/* PRIVATE - allocated size */
+	size_t rb_pos;		/* PRIVATE - start of data not yet consumed */
+	size_t rb_len;		/* PRIVATE - length of data not yet consumed */
 } t_llp_connection;
 
 extern int llp_open (t_llp_connection *llp_connection, const char *hostname, unsigned short int port, unsigned int timeout_us);
 extern int llp_get_header (t_llp_connection *llp_connection, t_ll_header *ll_header);
 extern int llp_get_extdata (t_llp_connection *llp_connection, t_ll_header *ll_header);
+extern int llp_get_extdata_view (t_llp_connection *llp_connection, t_ll_header *ll_header, uint8_t **data_p);
 extern int llp_get_extdata_sbuff (t_llp_connection *llp_connection, t_ll_header *ll_header, uint8_t *buf, uint32_t buflen);
 extern int llp_get_discard_extdata (t_llp_connection *llp_connection, t_ll_header *ll_header);
 extern void llp_init_header (t_ll_header *ll_header);
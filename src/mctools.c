@@ -24,11 +24,19 @@
 #include "mctools.h"
 #include "log.h"
 #include "bintools.h"
+#include "scantools.h"
+#include "bufftools.h"
 #include "config.h"	/* autotools-generated */
 
-#define WHOLE_MAIN_HEADER_LOAD 416 + 4
+#define WHOLE_MAIN_HEADER_LOAD (416 + 4)	/* mkv_head[], without audio track */
 
 /* offsets of interest in mkv_head[] */
+#define MKV_HOFF_SegmentSize	(0x02f + 4)
+#define MKV_HOFF_SegmentData	(0x03b)
+#define MKV_HOFF_Void		(0x03b)
+#define MKV_HOFF_Info		(0x0d7)
+#define MKV_HOFF_Tracks		(0x128)
+#define MKV_HOFF_TrackEntry	(0x134)
 #define MKV_HOFF_CodecStr	(0x153)
 #define MKV_HOFF_PixelWidth	(0x16e + 2)
 #define MKV_HOFF_PixelHeight	(0x172 + 2)
@@ -43,9 +51,12 @@
 #define MKV_HOFF_SegmentUID	(0x10a + 3)
 #define MKV_HOFF_FlagLacing	(0x144 + 2)
 #define MKV_HOFF_TimecodeScale	(0x0e3 + 4)
+#define MKV_HOFF_Duration	(0x11d)
+#define MKV_HOFF_CodecPrivate	(0x188)	/* the last element, up to the end of mkv_head[] */
 /* chunk lengths of interest in mkv_head[] */
 #define MKV_CLEN_MuxingApp	(0x0d)
 #define MKV_CLEN_WritingApp	(0x0d)
+#define MKV_CLEN_Void		(0x9c)
 
 const static uint8_t mkv_head[] = {
 	/* EBML */
@@ -163,6 +174,7 @@ const static uint8_t mkv_head[] = {
 
 static int dt_dhav_to_h264raw (t_mc_parms *mc_parms, uint8_t *src_p, size_t src_len, uint8_t *dst_p, size_t *dst_len, size_t max_dst_len);
 static int dt_h264raw_to_mkv (t_mc_parms *mc_parms, uint8_t *src_p, size_t src_len, uint8_t *dst_p, size_t *dst_len, size_t max_dst_len);
+static bool dhav_is_random_access (const uint8_t *frame_p, size_t frame_len);
 
 /* specific to cases where dst < src.
    it is expected to be faster than memmove() */
@@ -245,14 +257,111 @@ t_mc_parms *mc_init (t_mc_format mc_format, bool ntsc_exact_60hz)
 	mc_parms->v_dhav_ts_prev = 0;
 	mc_parms->v_first_frame = true;
 
+	mc_parms->v_codec = MCODEC_V_MPEG4_ISO_AVC;
+
+	mc_parms->audio = false;
+	mc_parms->has_a_parms = false;
+	mc_parms->a_codec = MCODEC_A_UNSUPPORTED;
+	mc_parms->a_channels = 0;
+	mc_parms->a_sample_rate = 0;
+	mc_parms->a_timestamp_offset = 0;
+
+	mc_parms->mkv_cluster_open = false;
+	mc_parms->mkv_cluster_timecode = 0;
+	mc_parms->mkv_last_timecode = 0;
+	mc_parms->mkv_timecode_base = 0;
+	mc_parms->mkv_out_len = 0;
+	mc_parms->mkv_cluster_pos = 0;
+	mc_parms->mkv_has_audio = false;
+	mc_parms->mkv_audio_wait = 0;
+	mc_parms->mkv_has_head = false;
+	mc_parms->mkv_head_len = 0;
+	mc_parms->mkv_cues = NULL;
+	mc_parms->mkv_cues_n = 0;
+	mc_parms->mkv_cues_max = 0;
+	mc_parms->mkv_log_blocks = false;
+	mc_parms->mkv_blocks = NULL;
+	mc_parms->mkv_blocks_n = 0;
+	mc_parms->mkv_blocks_max = 0;
+	mc_parms->hevc_nal_buf = NULL;
+	mc_parms->hevc_nal_buf_max = 0;
+	mc_parms->hevc_nal_len = 0;
+	mc_parms->hevc_nal_ready = false;
+
+	mc_parms->fmp4_sps_len = 0;
+	mc_parms->fmp4_pps_len = 0;
+	mc_parms->fmp4_timestamp_base = 0;
+	mc_parms->fmp4_sequence = 0;
+	mc_parms->fmp4_samples_n = 0;
+	for (i = 0; i < 2; i++) {
+		mc_parms->fmp4_mdat[i] = NULL;
+		mc_parms->fmp4_mdat_max[i] = 0;
+	}
+	mc_parms->fmp4_mdat_len = 0;
+	mc_parms->fmp4_mdat_cur = 0;
+
+	for (i = 0; i < 3; i++)
+		mc_parms->ts_cc[i] = 0;
+	mc_parms->ts_timestamp_base = 0;
+
 	return mc_parms;
 }
 
 void mc_close (t_mc_parms *mc_parms)
 {
+	free (mc_parms->mkv_cues);
+	free (mc_parms->mkv_blocks);
+	free (mc_parms->hevc_nal_buf);
+	free (mc_parms->fmp4_mdat[0]);
+	free (mc_parms->fmp4_mdat[1]);
 	free (mc_parms);
 }
 
+/* releases the queue memory */
+static void dstf_free_queue (dstf_t *dstf)
+{
+	if (dstf->sq_mirrored == true)
+		btmirror_free (dstf->sq_p, dstf->sq_maxlen);
+	else
+		free (dstf->sq_p);
+	dstf->sq_p = NULL;
+}
+
+/* (re)allocates the queue, at least len bytes long, keeping queued data.
+   mirrored memory is used whenever available (see btmirror_alloc),
+   otherwise a plain buffer, packed when necessary.
+   returns ==0 ok, !=0 error */
+static int dstf_alloc_queue (dstf_t *dstf, size_t len)
+{
+	uint8_t *sq_p;
+	bool mirrored = true;
+
+	len = btmirror_round_len (len);
+	if ((sq_p = btmirror_alloc (len)) == NULL) {
+		mirrored = false;
+		if ((sq_p = malloc (len)) == NULL)
+			return 1;
+	}
+	if (dstf->sq_p != NULL) {
+		memcpy (sq_p, dstf->sq_p + dstf->sq_offs, dstf->sq_len);
+		dstf_free_queue (dstf);
+	}
+	dstf->sq_p = sq_p;
+	dstf->sq_offs = 0;
+	dstf->sq_maxlen = len;
+	dstf->sq_mirrored = mirrored;
+	return 0;
+}
+
+/* removes len bytes from the head of the queue */
+static void dstf_consume (dstf_t *dstf, size_t len)
+{
+	dstf->sq_offs += len;
+	dstf->sq_len -= len;
+	if ((dstf->sq_mirrored == true) && (dstf->sq_offs >= dstf->sq_maxlen))
+		dstf->sq_offs -= dstf->sq_maxlen;
+}
+
 dstf_t *dstf_init (void)
 {
 	dstf_t *dstf;
@@ -260,67 +369,99 @@ dstf_t *dstf_init (void)
 	if ((dstf = malloc (sizeof (dstf_t))) == NULL)
 		return NULL;
 
-	dstf->sq_p = dstf->sq;
+	dstf->sq_p = NULL;
 	dstf->sq_offs = 0;
 	dstf->sq_len = 0;
-	dstf->sq_maxlen = T_MC_PARMS_DHAV_STF;
+	dstf->skipped_len = 0;
+	dstf->nal_scan_len = 0;
+	if (dstf_alloc_queue (dstf, T_MC_PARMS_DHAV_STF) != 0) {
+		free (dstf);
+		return NULL;
+	}
 	return dstf;
 }
 
+/* empties dstf for another stream (the queue remains allocated) */
+void dstf_reset (dstf_t *dstf)
+{
+	dstf->sq_offs = 0;
+	dstf->sq_len = 0;
+	dstf->skipped_len = 0;
+	dstf->nal_scan_len = 0;
+}
+
 void dstf_close (dstf_t *dstf)
 {
+	dstf_free_queue (dstf);
 	free (dstf);
 }
 
+/* appends stream data to the queue, growing it if necessary
+   (up to DSTF_MAX_LEN).
+   queued data is always contiguous, starting at (sq_p + sq_offs).
+   returns ==0 ok, !=0 error (no buffer space to fit this data) */
+int dstf_append (dstf_t *dstf, const uint8_t *src_p, size_t src_len)
+{
+	size_t len;
+
+	if (src_len > (dstf->sq_maxlen - dstf->sq_len)) {
+		if ((dstf->sq_len + src_len) > DSTF_MAX_LEN)
+			return 1;
+		for (len = dstf->sq_maxlen * 2; len < (dstf->sq_len + src_len); len *= 2);
+		if (len > DSTF_MAX_LEN)
+			len = DSTF_MAX_LEN;
+		if (dstf_alloc_queue (dstf, len) != 0)
+			return 2;
+	}
+
+	/* mirrored: writing past sq_maxlen wraps around by itself */
+	if ((dstf->sq_mirrored == false) && (src_len > (dstf->sq_maxlen - (dstf->sq_offs + dstf->sq_len)))) {
+		/* pack queue */
+		memcpy_overlap (dstf->sq_p, (dstf->sq_p + dstf->sq_offs), dstf->sq_len);
+		dstf->sq_offs = 0;
+	}
+
+	memcpy ((dstf->sq_p + dstf->sq_offs + dstf->sq_len), src_p, src_len);
+	dstf->sq_len += src_len;
+	return 0;
+}
+
 /* convert dhav stream to individual complete frames
    src may be partial data and/or contain more than one frame.
    src data goes to an internal queue after each call.
-   dst will be a single whole frame per call (if src provided enough data).
+   a single whole frame is returned per call (if src provided enough data),
+   as a view into the internal queue: *frame_p is valid until the next call
+   (no copy is made).
 
    if the internal queue contains multiple frames,
    this function must be called multiple times with src_len==0
    until it returns 0 (or <0 if error).
-   even when it returns >0 dst_len may be 0 (usually a frame filtered out).
-
-   *** dst may be the same buffer as src.
+   even when it returns >0 frame_len may be 0 (usually a frame filtered out).
 
    returns:
-	0, no output frame to dst
-	1, written output (single, complete) frame to dst
-	2, skipped, filtered out frame (nothing written, but may be other frames still)
+	0, no output frame
+	1, output (single, complete) frame at *frame_p
+	2, skipped, filtered out frame (nothing output, but may be other frames still)
 	<0, error */
-int dstf_process_dhav_stream_to_frames (dstf_t *dstf, uint8_t *src_p, size_t src_len, uint8_t *dst_p, size_t *dst_len, size_t max_dst_len)
+int dstf_process_dhav_stream_to_frames (dstf_t *dstf, uint8_t *src_p, size_t src_len, uint8_t **frame_p, size_t *frame_len)
 {
-	size_t q_free;		/* post-offset free data */
-	size_t q_tot_free;	/* all free data after queue packing */
 	uint8_t *framep;
 	size_t dhav_rep_len;    /* frame length reported by DHAV header */
 	size_t dhav_rep2_len;	/* frame length reported by dhav header */
 	uint8_t frame_type;
 	size_t dhav_offset;	/* offset to beginning of (traling "header") 'd','h','a','v' */
 	bool skip_garbage;
+	const char *skip_reason = "";
+	size_t skip_len;
 
-	q_free = dstf->sq_maxlen - (dstf->sq_len + dstf->sq_offs);
-	q_tot_free = dstf->sq_maxlen - dstf->sq_len;
-
-	*dst_len = 0;
+	*frame_len = 0;
 
 	if (src_len > 0) {
 		/* incoming stream data */
-		if (src_len > q_tot_free) {
+		if (dstf_append (dstf, src_p, src_len) != 0) {
 			/* internal error: no buffer space to fit this data. */
-
 			return -1;
 		}
-		if (src_len > q_free) {
-			/* pack queue */
-			memcpy_overlap (dstf->sq_p, (dstf->sq_p + dstf->sq_offs), dstf->sq_len);
-			dstf->sq_offs = 0;
-		}
-
-		/* load new data into queue */
-		memcpy ((dstf->sq_p + dstf->sq_offs + dstf->sq_len), src_p, src_len);
-		dstf->sq_len += src_len;
 	}
 
 	/* process queue data */
@@ -343,20 +484,24 @@ int dstf_process_dhav_stream_to_frames (dstf_t *dstf, uint8_t *src_p, size_t src
 			dhav_rep_len = BT_LM2NV_U32(framep + 12);
 			dhav_offset = dhav_rep_len - 8;
 
-			/* check if buffer has the whole advertised frame size */
-			if (dhav_rep_len > dstf->sq_maxlen) {
+			/* check if buffer has the whole advertised frame size.
+			   the queue grows for larger frames, but not while resynchronizing:
+			   a false "DHAV" within garbage would stall the stream until its
+			   (bogus) length arrives */
+			if ((dhav_rep_len > DSTF_MAX_LEN) || (dhav_rep_len < 16) || \
+				((dstf->skipped_len != 0) && (dhav_rep_len > dstf->sq_maxlen))) {
 				/* error: buffer size is either too small (cannot hold at least a single whole frame)
 				   or data is corrupted. -- assume the latter and skip this data */
-				log_printf (LOGT_WARNING, "DHAV frame is either too large, or corrupted data - assuming the latter. Skipping garbage...\n");
+				skip_reason = "DHAV frame is either too large, or corrupted data - assuming the latter";
 				skip_garbage = true;
 			} else if (dhav_rep_len > dstf->sq_len) {
 				/* incomplete frame, more data is necessary */
 				return 0;
 			} else if (! BT_IDeqLM_32('d','h','a','v', (framep + dhav_offset))) {
-				log_printf (LOGT_WARNING, "No dhav trailer. Skipping garbage...\n");
+				skip_reason = "No dhav trailer";
 				skip_garbage = true;
 			} else if ((dhav_rep2_len = BT_LM2NV_U32(framep + dhav_offset + 4)) != dhav_rep_len) {
-				log_printf (LOGT_WARNING, "Corrupt dhav size. Skipping garbage...\n");
+				skip_reason = "Corrupt dhav size";
 				skip_garbage = true;
 			} else {
 				/* frame is whole and seems correct, continue */
@@ -364,24 +509,23 @@ int dstf_process_dhav_stream_to_frames (dstf_t *dstf, uint8_t *src_p, size_t src
 			}
 		} else {
 			/* no DHAV header */
-			log_printf (LOGT_WARNING, "No DHAV header. Skipping garbage...\n");
+			skip_reason = "No DHAV header";
 			skip_garbage = true;
 		}
 
 		/* SKIP GARBAGE */
 		if (skip_garbage == true) {
-			/* jump to the next position */
-			framep++;
-			(dstf->sq_offs)++;
-			(dstf->sq_len)--;
-
-			/* to save processing, this is done all here:
-			   skip up to next DHAV, or until there is no workable data */
-			while ((dstf->sq_len >= 16) && (! BT_IDeqLM_32('D','H','A','V',framep))) {
-				framep++;
-				(dstf->sq_offs)++;
-				(dstf->sq_len)--;
-			}
+			/* warn once per resync, not per candidate
+			   (heavily damaged data has plenty of false "DHAV") */
+			if (dstf->skipped_len == 0)
+				log_printf (LOGT_WARNING, "%s. Skipping garbage...\n", skip_reason);
+
+			/* skip up to the next DHAV candidate (excluding the current position),
+			   or until there is no workable data */
+			skip_len = 1 + scan_dhav_magic (framep + 1, dstf->sq_len - 16);
+			dstf_consume (dstf, skip_len);
+			framep = dstf->sq_p + dstf->sq_offs;
+			dstf->skipped_len += skip_len;
 			if (dstf->sq_len < 16) {
 				/* insufficient data remains for evaluation, more data needed */
 				return 3;
@@ -389,75 +533,165 @@ int dstf_process_dhav_stream_to_frames (dstf_t *dstf, uint8_t *src_p, size_t src
 		}
 	}
 
-	if (max_dst_len < dhav_rep_len) {
-		/* insufficient dst buffer for this single frame */
-		return -3;
+	if (dstf->skipped_len != 0) {
+		log_printf (LOGT_WARNING, "Resynchronized, %" PRIu64 " bytes skipped.\n", dstf->skipped_len);
+		dstf->skipped_len = 0;
 	}
 
 	/* set queue to next frame
-	   (does not change queue array itself,
-	   and those vars will not be used from now on) */
-	dstf->sq_len = dstf->sq_len - dhav_rep_len;
-	dstf->sq_offs = dstf->sq_offs + dhav_rep_len;
-
-	/* transfer frame data from queue to dst */
-	if (max_dst_len < dhav_rep_len) {
-		/* buffer overflow: max_dst_len < dhav_rep_len */
-		return -4;
-	}
-	memcpy (dst_p, framep, dhav_rep_len);
-	*dst_len = dhav_rep_len;
+	   (does not change queue memory itself, the frame remains
+	   in place until more data is appended) */
+	dstf_consume (dstf, dhav_rep_len);
+
+	*frame_p = framep;
+	*frame_len = dhav_rep_len;
 	return 1;
 }
 
+/* checks for a whole and valid DHAV frame at src
+   (same checks as dstf_process_dhav_stream_to_frames).
+   returns its length, 0 if none (*reason tells why) */
+static size_t dhav_frame_len (const uint8_t *src_p, size_t src_len, const char **reason)
+{
+	size_t dhav_rep_len;
+
+	if ((src_len < 16) || (! BT_IDeqLM_32('D','H','A','V',src_p))) {
+		*reason = "No DHAV header";
+		return 0;
+	}
+	dhav_rep_len = BT_LM2NV_U32(src_p + 12);
+	if ((dhav_rep_len > DSTF_MAX_LEN) || (dhav_rep_len < 16) || (dhav_rep_len > src_len)) {
+		*reason = "DHAV frame is either too large, or corrupted data - assuming the latter";
+		return 0;
+	}
+	if (! BT_IDeqLM_32('d','h','a','v', (src_p + dhav_rep_len - 8))) {
+		*reason = "No dhav trailer";
+		return 0;
+	}
+	if (BT_LM2NV_U32(src_p + dhav_rep_len - 4) != dhav_rep_len) {
+		*reason = "Corrupt dhav size";
+		return 0;
+	}
+
+	return dhav_rep_len;
+}
+
+/* takes whole frames from DHAV data held entirely in memory
+   (eg. a mapped file), in place: no queue, no copy.
+   *pos is the current position within src, set past the returned frame.
+   garbage is skipped as by dstf_process_dhav_stream_to_frames(),
+   an incomplete frame at the end of src is garbage too.
+   returns:
+	0, no more frames
+	1, frame at *frame_p */
+int dt_next_dhav_frame (const uint8_t *src_p, size_t src_len, size_t *pos, uint8_t **frame_p, size_t *frame_len)
+{
+	const char *skip_reason;
+	size_t skipped_len = 0;
+	size_t len;
+
+	while ((*pos < src_len) && ((src_len - *pos) >= 16)) {
+		if ((len = dhav_frame_len (src_p + *pos, src_len - *pos, &skip_reason)) != 0) {
+			if (skipped_len != 0)
+				log_printf (LOGT_WARNING, "Resynchronized, %zu bytes skipped.\n", skipped_len);
+			*frame_p = (uint8_t *) (src_p + *pos);
+			*frame_len = len;
+			*pos += len;
+			return 1;
+		}
+
+		/* warn once per resync */
+		if (skipped_len == 0)
+			log_printf (LOGT_WARNING, "%s. Skipping garbage...\n", skip_reason);
+		len = 1 + scan_dhav_magic (src_p + *pos + 1, src_len - *pos - 16);
+		*pos += len;
+		skipped_len += len;
+	}
+
+	*frame_len = 0;
+	return 0;
+}
+
+/* returns the position of the first whole and valid DHAV video I-frame
+   starting at (or after) pos within src, src_len if none.
+   H.265 I-frames must be random access points (as told by
+   dt_collect_dhav_frame_info), DHAV does not ensure it.
+   DHAV data may be split there into parts to be converted
+   independently (see dt_tsproc_period, dt_mkv_append_part). */
+size_t dt_find_dhav_i_frame (const uint8_t *src_p, size_t src_len, size_t pos)
+{
+	const char *skip_reason;
+	size_t len;
+
+	while ((pos < src_len) && ((src_len - pos) >= 16)) {
+		if ((*(src_p + pos + 4) == 0xfd) && ((len = dhav_frame_len (src_p + pos, src_len - pos, &skip_reason)) != 0) && \
+			(dhav_is_random_access (src_p + pos, len) == true))
+			return pos;
+		pos += 1 + scan_dhav_magic (src_p + pos + 1, src_len - pos - 16);
+	}
+
+	return src_len;
+}
+
+/* returns the position of the last DHAV video I-frame with an EPOCH
+   at (or before) the given one, the first I-frame if none is
+   (src_len if there are no I-frames at all).
+   coarse binary search over the whole src, which assumes
+   EPOCH to increase along it (no DVR clock adjustments). */
+size_t dt_find_dhav_i_frame_at_epoch (const uint8_t *src_p, size_t src_len, uint32_t epoch)
+{
+	size_t lo, hi, mid, pos;
+
+	/* lo: I-frame at or before epoch ; from hi on: I-frames after epoch */
+	if ((lo = dt_find_dhav_i_frame (src_p, src_len, 0)) == src_len)
+		return src_len;
+	if (BT_LM2NV_U32(src_p + lo + 16) > epoch)
+		return lo;
+	hi = src_len;
+
+	while ((hi - lo) > 1) {
+		mid = lo + ((hi - lo) / 2);
+		pos = dt_find_dhav_i_frame (src_p, src_len, mid);
+		if (pos >= hi)
+			hi = mid;	/* no I-frame from mid up to hi */
+		else if (BT_LM2NV_U32(src_p + pos + 16) <= epoch)
+			lo = pos;
+		else
+			hi = pos;
+	}
+
+	return lo;
+}
+
 /* returns the offset (relative to src) of the next NAL sequence (00 00 01),
    -1, if not found */
 int search_mpeg_NAL (uint8_t *src, size_t len)
 {
-	int i = 0;
+	size_t i;
 
-	while (i < (len - 2)) {
-		if ((*(src + i + 0) == 0x00) && \
-			(*(src + i + 1) == 0x00) && \
-			(*(src + i + 2) == 0x01)) {
-			return i;
-		}
-		i++;
-	}
-	return -1;
+	if (len < 3)
+		return -1;
+	if ((i = scan_start_code (src, len - 2)) == (len - 2))
+		return -1;
+	return i;
 }
 
 /* same as dstf_process_dhav_stream_to_frames,
    except it treats incoming RAW H.264 data */
-int dstf_process_raw_h264_stream_to_frames (dstf_t *dstf, uint8_t *src_p, size_t src_len, uint8_t *dst_p, size_t *dst_len, size_t max_dst_len)
+int dstf_process_raw_h264_stream_to_frames (dstf_t *dstf, uint8_t *src_p, size_t src_len, uint8_t **frame_p, size_t *frame_len)
 {
-	size_t q_free;		/* post-offset free data */
-	size_t q_tot_free;	/* all free data after queue packing */
 	uint8_t *framep;
 	bool skip_garbage;
 	int next_NAL;
-	size_t frame_len;
-
-	q_free = dstf->sq_maxlen - (dstf->sq_len + dstf->sq_offs);
-	q_tot_free = dstf->sq_maxlen - dstf->sq_len;
 
-	*dst_len = 0;
+	*frame_len = 0;
 
 	if (src_len > 0) {
 		/* incoming stream data */
-		if (src_len > q_tot_free) {
+		if (dstf_append (dstf, src_p, src_len) != 0) {
 			/* internal error: no buffer space to fit this data. */
 			return -1;
 		}
-		if (src_len > q_free) {
-			/* pack queue */
-			memcpy_overlap (dstf->sq_p, (dstf->sq_p + dstf->sq_offs), dstf->sq_len);
-			dstf->sq_offs = 0;
-		}
-
-		/* load new data into queue */
-		memcpy ((dstf->sq_p + dstf->sq_offs + dstf->sq_len), src_p, src_len);
-		dstf->sq_len += src_len;
 	}
 
 	/* process queue data */
@@ -478,9 +712,9 @@ int dstf_process_raw_h264_stream_to_frames (dstf_t *dstf, uint8_t *src_p, size_t
 	/* search for first NAL sequence */
 	next_NAL = search_mpeg_NAL (framep, dstf->sq_len);
 	if (next_NAL < 0) {
-		framep += dstf->sq_len;
-		(dstf->sq_offs) += dstf->sq_len;
-		(dstf->sq_len) = 0;
+		/* keep the last 2 bytes, those may be the beginning of a NAL sequence */
+		dstf_consume (dstf, dstf->sq_len - 2);
+		dstf->nal_scan_len = 0;
 
 		/* first NAL not found.
 		   insufficient data remains for evaluation, more data needed */
@@ -488,9 +722,9 @@ int dstf_process_raw_h264_stream_to_frames (dstf_t *dstf, uint8_t *src_p, size_t
 	}
 	if (next_NAL != 0) {
 		log_printf (LOGT_WARNING, "No NAL sequence. Skipping garbage...\n");
-		framep += next_NAL;
-		(dstf->sq_offs) += next_NAL;
-		(dstf->sq_len) -= next_NAL;
+		dstf_consume (dstf, next_NAL);
+		framep = dstf->sq_p + dstf->sq_offs;
+		dstf->nal_scan_len = 0;
 	}
 
 	if (dstf->sq_len < 8) {
@@ -498,14 +732,20 @@ int dstf_process_raw_h264_stream_to_frames (dstf_t *dstf, uint8_t *src_p, size_t
 		return 0;
 	}
 
-	/* search for the second NAL sequence */
-	next_NAL = search_mpeg_NAL (framep + 4, dstf->sq_len - 4);
+	/* search for the second NAL sequence,
+	   resuming past what was scanned by the previous calls
+	   (large frames arrive in many small chunks) */
+	next_NAL = search_mpeg_NAL (framep + 4 + dstf->nal_scan_len, dstf->sq_len - 4 - dstf->nal_scan_len);
 	if (next_NAL < 0) {
 		/* beginning of next frame not found, unable to
-		   determine size of full frame yet, thus it is considered incomplete */
+		   determine size of full frame yet, thus it is considered incomplete.
+		   the last 2 bytes will be scanned again, as part of a NAL sequence */
+		dstf->nal_scan_len = dstf->sq_len - 4 - 2;
 		return 0;
 	}
-	frame_len = next_NAL + 4;	/* frame_len includes heading NAL */
+	next_NAL += dstf->nal_scan_len;
+	dstf->nal_scan_len = 0;
+	*frame_len = next_NAL + 4;	/* frame_len includes heading NAL */
 
 
 
@@ -513,21 +753,12 @@ int dstf_process_raw_h264_stream_to_frames (dstf_t *dstf, uint8_t *src_p, size_t
 
 
 
-	if (max_dst_len < frame_len) {
-		/* insufficient dst buffer for this single frame */
-		log_printf (LOGT_ERROR, "Insufficient dst buffer for this single frame.\n");
-		return -3;
-	}
-
 	/* set queue to next frame
-	   (does not change queue array itself,
-	   and those vars will not be used from now on) */
-	dstf->sq_len = dstf->sq_len - frame_len;
-	dstf->sq_offs = dstf->sq_offs + frame_len;
-
-	memcpy (dst_p, framep, frame_len);
-	*dst_len = frame_len;
+	   (does not change queue memory itself, the frame remains
+	   in place until more data is appended) */
+	dstf_consume (dstf, *frame_len);
 
+	*frame_p = framep;
 	return 1;
 }
 
@@ -535,45 +766,356 @@ int dstf_process_raw_h264_stream_to_frames (dstf_t *dstf, uint8_t *src_p, size_t
 
 /* ********************************* */
 
-/* related to DHAV-subfields (entries within extended header data) */
-#define DHAV_SF_STRIPLEN_MAX 8
-#define DHAV_SF_ARRAY uint8_t dhav_subfields_array[DHAV_SF_STRIPLEN_MAX * 256]
-#define DHAV_SF_DATA(fn,dn) dhav_subfields_array[((fn) << 3) + (dn)]
-#define DHAV_SF_LOAD_EXTHEADER_DATA(ehd,ehl) dhav_sf_parse_ext_head ((ehd), (ehl), dhav_subfields_array)
+/* related to DHAV-subfields (entries within extended header data):
+   <id> followed by 3 data bytes (7 for id 0x88) */
+#define DHAV_SF_LEN(id) (((id) == 0x88) ? 8 : 4)
 
-static void dhav_sf_parse_ext_head (uint8_t *ext_head, const uint8_t ext_head_len, uint8_t *dhav_subfields_array)
+/* locates subfield id within extended header data, only as needed
+   (most frames require none). if repeated, the last one applies.
+   returns pointer to subfield (starting with id), NULL if absent or truncated */
+static const uint8_t *dhav_sf_find (const uint8_t *ext_head, const uint8_t ext_head_len, const uint8_t id)
 {
-	uint8_t id;
-	uint8_t id_len = 0;
-	uint8_t id_pos = 0;
-	int i;
-	int hl = ext_head_len;
-	int pos = 0;
+	const uint8_t *sf_p = NULL;
+	size_t pos = 0;
+
+	while ((pos < ext_head_len) && ((pos + DHAV_SF_LEN(ext_head[pos])) <= ext_head_len)) {
+		if (ext_head[pos] == id)
+			sf_p = ext_head + pos;
+		pos += DHAV_SF_LEN(ext_head[pos]);
+	}
+
+	return sf_p;
+}
+
 
-	/* zero subfields */
-	for (i = 0; i < (DHAV_SF_STRIPLEN_MAX * 256); i++) {
-		dhav_subfields_array[i] = 0;		
+/* iterates NAL units within Annex B data (start code prefixed):
+   *pos must be 0 at the first call, the NAL unit (header included,
+   start code and trailing zeroes excluded) goes to *nal_start, *nal_len.
+   returns true if a NAL unit was found, false at the end of data */
+static bool mc_next_nal (const uint8_t *src_p, size_t src_len, size_t *pos, size_t *nal_start, size_t *nal_len)
+{
+	size_t nal_end;
+
+	if (src_len < 4)
+		return false;	/* no NAL unit */
+
+	/* start codes are searched fully contained within src (pos == src_len - 2: none) */
+	if (*pos == 0)
+		*pos = scan_start_code (src_p, src_len - 2);
+	while (*pos < (src_len - 2)) {
+		*nal_start = *pos + 3;
+		if (*nal_start < (src_len - 2))
+			*pos = *nal_start + scan_start_code (src_p + *nal_start, src_len - 2 - *nal_start);
+		else
+			*pos = src_len - 2;
+		nal_end = (*pos < (src_len - 2)) ? *pos : src_len;
+
+		/* trailing zeroes belong to the next start code (or are padding) */
+		while ((nal_end > *nal_start) && (src_p[nal_end - 1] == 0x00))
+			nal_end--;
+		if ((*nal_len = nal_end - *nal_start) > 0)
+			return true;
+	}
+	return false;
+}
+
+/* H.265 NAL unit types */
+#define HEVC_NAL_TYPE(nal_header) (((nal_header) >> 1) & 0x3f)
+#define HEVC_NAL_IRAP_FIRST 16	/* BLA, IDR, CRA: random access points */
+#define HEVC_NAL_IRAP_LAST 23
+#define HEVC_NAL_VCL_LAST 31
+#define HEVC_NAL_VPS 32
+#define HEVC_NAL_SPS 33
+#define HEVC_NAL_PPS 34
+#define HEVC_NAL_AUD 35
+
+/* true: the H.265 access unit is a random access point (key frame),
+   as told by its first slice */
+static bool hevc_is_key_frame (const uint8_t *src_p, size_t src_len)
+{
+	size_t pos = 0;
+	size_t nal_start;
+	size_t nal_len;
+	uint8_t nal_type;
+
+	while (mc_next_nal (src_p, src_len, &pos, &nal_start, &nal_len) == true) {
+		nal_type = HEVC_NAL_TYPE(src_p[nal_start]);
+		if (nal_type <= HEVC_NAL_VCL_LAST)
+			return ((nal_type >= HEVC_NAL_IRAP_FIRST) && (nal_type <= HEVC_NAL_IRAP_LAST));
 	}
+	return false;
+}
 
-	while (hl != 0) {
-		if (id_len == 0) {
-			id_pos = 0;
+/* bit reader, for the few SPS fields needed */
+typedef struct {
+	const uint8_t *p;
+	size_t len;	/* bytes */
+	size_t bit;	/* current position (bits) */
+} hevc_bits_t;
+
+/* reads past the end return zeroes */
+static uint32_t hevc_bits_get (hevc_bits_t *b, int n)
+{
+	uint32_t v = 0;
 
-			id = ext_head[pos];
-			id_len = (id == 0x88) ? 8 : 4;	// only subfield 0x88 has 8 bytes, other types: 4 bytes
+	while (n-- > 0) {
+		v <<= 1;
+		if (b->bit < (b->len * 8))
+			v |= (b->p[b->bit >> 3] >> (7 - (b->bit & 0x07))) & 0x01;
+		b->bit++;
+	}
+	return v;
+}
+
+/* Exp-Golomb, unsigned */
+static uint32_t hevc_bits_ue (hevc_bits_t *b)
+{
+	int zeroes = 0;
+
+	while ((hevc_bits_get (b, 1) == 0) && (zeroes < 31))
+		zeroes++;
+	return (((uint32_t) 1 << zeroes) - 1 + hevc_bits_get (b, zeroes));
+}
+
+/* builds the H.265 decoder configuration record (hvcC), for the MKV CodecPrivate,
+   from the VPS/SPS/PPS found within the access unit (Annex B) */
+/* returns the length written (up to MKV_HVCC_MAX_LEN - 4), 0 if no parameter sets */
+static size_t hevc_build_hvcc (const uint8_t *src_p, size_t src_len, uint8_t *dst_p)
+{
+	const uint8_t *ps_p[3] = { NULL, NULL, NULL };	/* VPS, SPS, PPS */
+	size_t ps_len[3];
+	uint8_t sps[HEVC_PARMSET_MAX_LEN];	/* RBSP (without emulation prevention bytes) */
+	size_t sps_len = 0;
+	hevc_bits_t b;
+	size_t pos = 0;
+	size_t nal_start;
+	size_t nal_len;
+	uint8_t nal_type;
+	uint32_t max_sub_layers;	/* minus 1 */
+	uint32_t temporal_id_nesting;
+	uint32_t chroma_format;
+	uint32_t bit_depth_luma;	/* minus 8 */
+	uint32_t bit_depth_chroma;	/* minus 8 */
+	bool sub_layer_profile[8];
+	bool sub_layer_level[8];
+	uint8_t *p = dst_p;
+	size_t i;
+
+	/* parameter sets precede the slices */
+	while (mc_next_nal (src_p, src_len, &pos, &nal_start, &nal_len) == true) {
+		nal_type = HEVC_NAL_TYPE(src_p[nal_start]);
+		if (nal_type <= HEVC_NAL_VCL_LAST)
+			break;
+		if ((nal_type >= HEVC_NAL_VPS) && (nal_type <= HEVC_NAL_PPS) && \
+			(ps_p[nal_type - HEVC_NAL_VPS] == NULL) && (nal_len <= HEVC_PARMSET_MAX_LEN)) {
+			ps_p[nal_type - HEVC_NAL_VPS] = src_p + nal_start;
+			ps_len[nal_type - HEVC_NAL_VPS] = nal_len;
 		}
+	}
+	if ((ps_p[0] == NULL) || (ps_p[1] == NULL) || (ps_p[2] == NULL))
+		return 0;
 
-		DHAV_SF_DATA(id,id_pos) = *(ext_head + pos);
+	/* SPS: remove emulation prevention (00 00 03) */
+	for (i = 0; i < ps_len[1]; i++) {
+		if ((i >= 2) && (ps_p[1][i] == 0x03) && (ps_p[1][i - 1] == 0x00) && (ps_p[1][i - 2] == 0x00))
+			continue;
+		sps[sps_len++] = ps_p[1][i];
+	}
+	b.p = sps;
+	b.len = sps_len;
+	b.bit = 16;	/* NAL unit header */
+	hevc_bits_get (&b, 4);	/* sps_video_parameter_set_id */
+	max_sub_layers = hevc_bits_get (&b, 3);
+	temporal_id_nesting = hevc_bits_get (&b, 1);
+
+	*(p++) = 0x01;	/* configurationVersion */
+
+	/* general profile/tier/level, as is:
+	   profile_space+tier+profile_idc, compatibility flags (32 bits),
+	   constraint indicator flags (48 bits), level_idc */
+	for (i = 0; i < 12; i++)
+		*(p++) = hevc_bits_get (&b, 8);
+
+	/* skip the sub-layers profile/level */
+	for (i = 0; i < max_sub_layers; i++) {
+		sub_layer_profile[i] = hevc_bits_get (&b, 1);
+		sub_layer_level[i] = hevc_bits_get (&b, 1);
+	}
+	if (max_sub_layers > 0)
+		hevc_bits_get (&b, 2 * (8 - max_sub_layers));
+	for (i = 0; i < max_sub_layers; i++) {
+		if (sub_layer_profile[i] == true)
+			b.bit += 88;
+		if (sub_layer_level[i] == true)
+			b.bit += 8;
+	}
 
-		id_pos++;
-		pos++;
-		id_len--;
-		hl--;
+	hevc_bits_ue (&b);	/* sps_seq_parameter_set_id */
+	if ((chroma_format = hevc_bits_ue (&b)) == 3)
+		hevc_bits_get (&b, 1);	/* separate_colour_plane_flag */
+	hevc_bits_ue (&b);	/* pic_width_in_luma_samples */
+	hevc_bits_ue (&b);	/* pic_height_in_luma_samples */
+	if (hevc_bits_get (&b, 1) == 1) {
+		/* conformance window */
+		for (i = 0; i < 4; i++)
+			hevc_bits_ue (&b);
 	}
+	bit_depth_luma = hevc_bits_ue (&b);
+	bit_depth_chroma = hevc_bits_ue (&b);
+
+	*(p++) = 0xf0;	/* min_spatial_segmentation_idc: 0 */
+	*(p++) = 0x00;
+	*(p++) = 0xfc;	/* parallelismType: unknown */
+	*(p++) = 0xfc | (chroma_format & 0x03);
+	*(p++) = 0xf8 | (bit_depth_luma & 0x07);
+	*(p++) = 0xf8 | (bit_depth_chroma & 0x07);
+	*(p++) = 0x00;	/* avgFrameRate: unspecified */
+	*(p++) = 0x00;
+	/* constantFrameRate: unknown, numTemporalLayers, temporalIdNested, lengthSizeMinusOne: 3 */
+	*(p++) = (((max_sub_layers + 1) & 0x07) << 3) | ((temporal_id_nesting & 0x01) << 2) | 0x03;
+
+	/* parameter sets: one array each */
+	*(p++) = 3;
+	for (i = 0; i < 3; i++) {
+		*(p++) = 0x80 | (HEVC_NAL_VPS + i);	/* array_completeness, NAL unit type */
+		*(p++) = 0x00;	/* numNalus */
+		*(p++) = 0x01;
+		BT_NV2MM_U16(p, (uint16_t) ps_len[i]);
+		p += 2;
+		memcpy (p, ps_p[i], ps_len[i]);
+		p += ps_len[i];
+	}
+
+	return (p - dst_p);
 }
 
+/* converts an H.265 access unit (Annex B: start code-prefixed NAL units)
+   into 4-byte length-prefixed NAL units, as declared by the hvcC
+   (lengthSizeMinusOne: 3), into mc_parms->hevc_nal_buf (hevc_nal_len bytes,
+   0 if no NAL units). the access unit is walked once: whether it is
+   a random access point (see hevc_is_key_frame) goes to *key_frame.
+   returns ==0 ok, !=0 error (out of memory) */
+static int hevc_to_length_prefixed (t_mc_parms *mc_parms, const uint8_t *src_p, size_t src_len, bool *key_frame)
+{
+	size_t pos = 0;
+	size_t nal_start;
+	size_t nal_len;
+	size_t max_len;
+	uint8_t nal_type;
+	bool has_vcl = false;
+	uint8_t *dst_p;
+
+	/* at most: 3-byte start codes (growing by one byte each)
+	   of 1-byte NAL units */
+	max_len = src_len + (src_len / 4) + 4;
+	if (max_len > mc_parms->hevc_nal_buf_max) {
+		if ((dst_p = realloc (mc_parms->hevc_nal_buf, max_len)) == NULL)
+			return 1;
+		mc_parms->hevc_nal_buf = dst_p;
+		mc_parms->hevc_nal_buf_max = max_len;
+	}
+
+	*key_frame = false;
+	dst_p = mc_parms->hevc_nal_buf;
+	while (mc_next_nal (src_p, src_len, &pos, &nal_start, &nal_len) == true) {
+		nal_type = HEVC_NAL_TYPE(src_p[nal_start]);
+		if ((has_vcl == false) && (nal_type <= HEVC_NAL_VCL_LAST)) {
+			has_vcl = true;
+			*key_frame = (nal_type >= HEVC_NAL_IRAP_FIRST) && (nal_type <= HEVC_NAL_IRAP_LAST);
+		}
+		BT_NV2MM_U32(dst_p, nal_len);
+		memcpy (dst_p + 4, src_p + nal_start, nal_len);
+		dst_p += 4 + nal_len;
+	}
+	mc_parms->hevc_nal_len = dst_p - mc_parms->hevc_nal_buf;
+	return 0;
+}
+
+/* DHAV video codec IDs (subfield 0x81) */
+#define DHAV_VCODEC_H265	0x0c
+
+/* DHAV audio codec IDs (subfield 0x83) */
+#define DHAV_ACODEC_PCM_S16LE	0x0c
+#define DHAV_ACODEC_PCM_S16LE_2	0x10
+#define DHAV_ACODEC_G711_ULAW	0x0a
+#define DHAV_ACODEC_G711_ULAW_2	0x16
+#define DHAV_ACODEC_G711_ALAW	0x0e
+#define DHAV_ACODEC_AAC		0x1a
+
+/* collect audio parameters, from the first audio frame
+   (subfield 0x83: channels, codec, sample rate index) */
+static void dhav_collect_audio_parms (t_mc_parms *mc_parms, const uint8_t *ext_head, const uint8_t ext_head_len, const uint8_t *body_p, size_t body_len)
+{
+	const uint32_t dhav_sample_rates[] = { 8000, 4000, 8000, 11025, 16000, 20000, 22050, 32000, 44100, 48000, 96000, 192000, 64000 };
+	const uint32_t aac_sample_rates[] = { 96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350 };
+	const uint8_t *sf_83_p;
+	int i;
+
+	if ((sf_83_p = dhav_sf_find (ext_head, ext_head_len, 0x83)) == NULL)
+		return;
+
+	mc_parms->a_channels = (*(sf_83_p + 1) != 0) ? *(sf_83_p + 1) : 1;
+	mc_parms->a_sample_rate = (*(sf_83_p + 3) < (sizeof (dhav_sample_rates) / sizeof (uint32_t))) ? dhav_sample_rates[*(sf_83_p + 3)] : 8000;
+	switch (*(sf_83_p + 2)) {
+	case DHAV_ACODEC_PCM_S16LE:
+	case DHAV_ACODEC_PCM_S16LE_2:
+		mc_parms->a_codec = MCODEC_A_PCM_S16LE;
+		break;
+	case DHAV_ACODEC_G711_ULAW:
+	case DHAV_ACODEC_G711_ULAW_2:
+		mc_parms->a_codec = MCODEC_A_G711_ULAW;
+		break;
+	case DHAV_ACODEC_G711_ALAW:
+		mc_parms->a_codec = MCODEC_A_G711_ALAW;
+		break;
+	case DHAV_ACODEC_AAC:
+		mc_parms->a_codec = MCODEC_A_AAC;
+		if ((body_len >= 7) && (body_p[0] == 0xff) && ((body_p[1] & 0xf6) == 0xf0)) {
+			/* ADTS: the header tells the configuration */
+			mc_parms->a_aac_config[0] = ((((body_p[2] >> 6) + 1) << 3) | ((body_p[2] >> 3) & 0x07)) & 0xff;
+			mc_parms->a_aac_config[1] = (((body_p[2] >> 2) & 0x01) << 7) | ((((body_p[2] & 0x01) << 2) | (body_p[3] >> 6)) << 3);
+			mc_parms->a_channels = ((body_p[2] & 0x01) << 2) | (body_p[3] >> 6);
+			if (((body_p[2] >> 2) & 0x0f) < 13)
+				mc_parms->a_sample_rate = aac_sample_rates[(body_p[2] >> 2) & 0x0f];
+		} else {
+			/* raw AAC-LC assumed */
+			for (i = 0; (i < 13) && (aac_sample_rates[i] != mc_parms->a_sample_rate); i++);
+			if (i == 13)
+				i = 11;	/* 8000 Hz */
+			mc_parms->a_aac_config[0] = (2 << 3) | (i >> 1);
+			mc_parms->a_aac_config[1] = ((i & 0x01) << 7) | ((mc_parms->a_channels & 0x0f) << 3);
+		}
+		break;
+	default:
+		log_printf (LOGT_WARNING, "Unsupported DHAV audio codec: %x, audio will not be output.\n", *(sf_83_p + 2));
+		mc_parms->a_codec = MCODEC_A_UNSUPPORTED;
+		break;
+	}
+
+	mc_parms->has_a_parms = true;
+}
 
 #define BASE_DHAV_HDR_LEN 24
+
+/* true: decoding may start at the (whole and valid) DHAV I-frame,
+   as dt_collect_dhav_frame_info() tells the frame type */
+static bool dhav_is_random_access (const uint8_t *frame_p, size_t frame_len)
+{
+	const uint8_t *sf_81_p;
+	size_t body_offset;
+
+	if (frame_len < (BASE_DHAV_HDR_LEN + 8))
+		return false;
+	body_offset = BASE_DHAV_HDR_LEN + *(frame_p + 22);
+	if (frame_len < (body_offset + 8))
+		return false;
+
+	sf_81_p = dhav_sf_find (frame_p + BASE_DHAV_HDR_LEN, *(frame_p + 22), 0x81);
+	if ((sf_81_p == NULL) || (*(sf_81_p + 2) != DHAV_VCODEC_H265))
+		return true;	/* H.264 */
+	return (hevc_is_key_frame (frame_p + body_offset, frame_len - body_offset - 8));
+}
+
 /* collect DHAV frame information (timestamp, h264 body size etc)
    this function assumes a complete and correct single DHAV frame from src */
 /* if fix_fs == true, correct buggy dhav timestamp */
@@ -587,13 +1129,15 @@ int dt_collect_dhav_frame_info (t_mc_parms *mc_parms, uint8_t *src_p, size_t src
 	size_t DHAV_len;
 	size_t DHAV_exthead_len;
 	uint16_t v_dhav_period;	/* in msec */
-	//
-	DHAV_SF_ARRAY;	/* see dhav_sf_parse_ext_head and related macros */
+	const uint8_t *sf_80_p;	/* subfield 0x80: resolution */
+	const uint8_t *sf_81_p;	/* subfield 0x81: fps */
+	bool key_frame;
 #ifdef DEBUG
 	int i;
 #endif
 
 	mc_parms->frame_type = FT_UNDEFINED;
+	mc_parms->hevc_nal_ready = false;
 
 	if (src_len == 0)
 		return 0; /* nothing to do, do nothing */
@@ -606,9 +1150,6 @@ int dt_collect_dhav_frame_info (t_mc_parms *mc_parms, uint8_t *src_p, size_t src
 	body_offset = DHAV_len;
 	body_len = src_len - body_offset - dhav_len;
 
-	/* parse extended header data and load into array */
-	DHAV_SF_LOAD_EXTHEADER_DATA(src_p+BASE_DHAV_HDR_LEN,DHAV_exthead_len);
-
 #ifdef DEBUG
 if (DHAV_type == 0xfd) {
 	DEBUG_LOG_PRINTF ("DHAV HEAD DUMP FOLLOWS\n\t----------------------------");
@@ -638,13 +1179,20 @@ if (DHAV_type == 0xfd) {
 	case 0xfd:
 		/* video I-frame */
 
-		mc_parms->v_width = DHAV_SF_DATA(0x80,0x02) * 8;
-		mc_parms->v_height = DHAV_SF_DATA(0x80,0x03) * 8;
-		mc_parms->dhav_fps = DHAV_SF_DATA(0x81,0x03);
+		sf_80_p = dhav_sf_find (src_p + BASE_DHAV_HDR_LEN, DHAV_exthead_len, 0x80);
+		sf_81_p = dhav_sf_find (src_p + BASE_DHAV_HDR_LEN, DHAV_exthead_len, 0x81);
+		mc_parms->v_width = (sf_80_p != NULL) ? (*(sf_80_p + 2) * 8) : 0;
+		mc_parms->v_height = (sf_80_p != NULL) ? (*(sf_80_p + 3) * 8) : 0;
+		mc_parms->dhav_fps = (sf_81_p != NULL) ? *(sf_81_p + 3) : 0;
+		mc_parms->v_codec = ((sf_81_p != NULL) && (*(sf_81_p + 2) == DHAV_VCODEC_H265)) ? MCODEC_V_MPEGH_ISO_HEVC : MCODEC_V_MPEG4_ISO_AVC;
 		if (mc_parms->dhav_fps == 0) {
 			log_printf (LOGT_ERROR, "DHAV header with 0 fps defined. This is a serious error, please report this situation to developers.\n");
 			return -1;
 		}
+		if (mc_parms->v_height == 0) {
+			log_printf (LOGT_ERROR, "DHAV header with no video resolution defined. This is a serious error, please report this situation to developers.\n");
+			return -1;
+		}
 
 		/* guess aspect-ratio
 		   (there is no aspect-ratio info in DHAV headers) */
@@ -701,9 +1249,15 @@ if (DHAV_type == 0xfd) {
 		break;
 	case 0xf0:
 		/* audio */
-		/* TODO: implement support for audio */
+		if (mc_parms->has_a_parms == false)
+			dhav_collect_audio_parms (mc_parms, src_p + BASE_DHAV_HDR_LEN, DHAV_exthead_len, src_p + body_offset, body_len);
+
+		/* audio has its own DHAV timestamps, relative to the latest video frame
+		   they follow v_timestamp (and its correction, if any) */
+		mc_parms->a_timestamp_offset = (mc_parms->v_first_frame == true) ? 0 : \
+			((int64_t) ((int16_t) (BT_LM2NV_U16(src_p + 20) - mc_parms->v_dhav_ts)) * 1000000);
+
 		mc_parms->frame_type = FT_AUDIO_FRAME;
-		return 0;
 		break;
 	case 0xf1:
 		/* (unknown) */
@@ -721,7 +1275,7 @@ if (DHAV_type == 0xfd) {
 	}
 
 	/* video parms and timings apply only to video frames,
-           audio timings are not supported currently */
+	   audio timings are relative to those (see a_timestamp_offset) */
 	if ((DHAV_type == 0xfd) || (DHAV_type == 0xfc)) {
 		/* get other data from DHAV */
 		mc_parms->v_dhav_ts = BT_LM2NV_U16(src_p + 20);
@@ -745,6 +1299,19 @@ if (DHAV_type == 0xfd) {
 	mc_parms->body_p = src_p + body_offset;
 	mc_parms->body_len = body_len;
 
+	/* H.265: DHAV I-frames are not necessarily random access points,
+	   the NAL unit types tell. MKV output takes the frame
+	   length-prefixed, which is done along (one pass) */
+	if ((mc_parms->v_codec == MCODEC_V_MPEGH_ISO_HEVC) && (mc_parms->frame_type != FT_AUDIO_FRAME)) {
+		if ((mc_parms->mc_format == MC_FORM_MKV) && \
+			(hevc_to_length_prefixed (mc_parms, mc_parms->body_p, mc_parms->body_len, &key_frame) == 0)) {
+			mc_parms->hevc_nal_ready = true;
+		} else {
+			key_frame = hevc_is_key_frame (mc_parms->body_p, mc_parms->body_len);
+		}
+		mc_parms->frame_type = (key_frame == true) ? FT_VIDEO_I_FRAME : FT_VIDEO_FRAME;
+	}
+
 	return 0;
 }
 
@@ -1128,6 +1695,46 @@ last_actions:
 	tsc->v_dhav_timestamp += dhav_period;
 }
 
+/* the period (nsec) from the last video frame of a stream part
+   to the first video frame of the next part, as dt_tsproc_process()
+   would have applied it, without the history of the previous frames
+   (for parts converted independently, see dt_find_dhav_i_frame).
+   mcp holds the last frame of the first part (fps, NTSC).
+   with TSPROC_NONE it is the plain DHAV timestamp difference,
+   as dt_collect_dhav_frame_info() would calculate it. */
+uint64_t dt_tsproc_period (const t_mc_parms *mcp, tsproc_t tsproc, uint32_t epoch_prev, uint16_t dhav_ts_prev, uint32_t epoch_cur, uint16_t dhav_ts_cur)
+{
+	uint64_t dhav_period;
+	int64_t ref_period;
+	int64_t timestamp_drift;
+	int64_t timestamp_drift_abs;
+	uint64_t dhav_epoch_diff;
+
+	dhav_period = (uint64_t) ((uint16_t) (dhav_ts_cur - dhav_ts_prev)) * 1000000;
+	if ((tsproc == TSPROC_NONE) || (mcp->dhav_fps == 0))
+		return dhav_period;
+
+	ref_period = (((mcp->NTSC_timings == true) && (mcp->ntsc_exact_60hz == false)) ? 1001000000 : 1000000000) / (uint64_t) (mcp->dhav_fps);
+
+	/* time went backwards, or too far: 1-frame period */
+	if (epoch_cur < epoch_prev)
+		return ref_period;
+	dhav_epoch_diff = epoch_cur - epoch_prev;
+	if (dhav_epoch_diff > EPOCH_MAX_FORWARD_JUMP) {
+		if (dhav_epoch_diff > MAX_EPOCH_PEDANTRY_TOWARDS_TIMESTAMP)
+			return ref_period;
+		return ((((dhav_epoch_diff * 1000000000) / ref_period) + 1) * ref_period);
+	}
+
+	/* whole frames, if beyond the jitter tolerance */
+	timestamp_drift = (int64_t) dhav_period - ref_period;
+	timestamp_drift_abs = (timestamp_drift >= 0) ? timestamp_drift : (0 - timestamp_drift);
+	if (timestamp_drift_abs > (TIMESTAMP_JITTER_DAMPING_LIMIT * ref_period))
+		return (ref_period + ((timestamp_drift / ref_period) * ref_period));
+
+	return ref_period;
+}
+
 /* initialize DHAV timestamp processing/correction structure.
    requires initialized t_mc_parms. */
 t_mc_tsproc *dt_tsproc_init (const t_mc_parms *mcp, tsproc_t tsproc)
@@ -1149,6 +1756,52 @@ void dt_tsproc_close (t_mc_tsproc *tsc)
 	free (tsc);
 }
 
+/* records a cue point (see dt_finalize_mkv).
+   cues are optional, on allocation failure they are just dropped. */
+static void mkv_add_cue (t_mc_parms *mc_parms, uint64_t timecode, uint64_t cluster_pos)
+{
+	t_mkv_cue *cues;
+	size_t cues_max;
+
+	if (mc_parms->mkv_cues_n == mc_parms->mkv_cues_max) {
+		cues_max = (mc_parms->mkv_cues_max == 0) ? 1024 : (mc_parms->mkv_cues_max * 2);
+		if ((cues = realloc (mc_parms->mkv_cues, cues_max * sizeof (t_mkv_cue))) == NULL) {
+			log_printf (LOGT_WARNING, "Unable to allocate MKV cues, seeking will be slower.\n");
+			return;
+		}
+		mc_parms->mkv_cues = cues;
+		mc_parms->mkv_cues_max = cues_max;
+	}
+	mc_parms->mkv_cues[mc_parms->mkv_cues_n].timecode = timecode;
+	mc_parms->mkv_cues[mc_parms->mkv_cues_n].cluster_pos = cluster_pos;
+	mc_parms->mkv_cues_n++;
+}
+
+/* records a SimpleBlock, if mc_parms->mkv_log_blocks == true
+   (see dt_mkv_append_part).
+   returns ==0 ok, !=0 error (out of memory) */
+static int mkv_log_block (t_mc_parms *mc_parms, uint64_t pos, int64_t timestamp, bool new_cluster, bool audio)
+{
+	t_mkv_block *blocks;
+	size_t blocks_max;
+
+	if (mc_parms->mkv_log_blocks == false)
+		return 0;
+	if (mc_parms->mkv_blocks_n == mc_parms->mkv_blocks_max) {
+		blocks_max = (mc_parms->mkv_blocks_max == 0) ? 4096 : (mc_parms->mkv_blocks_max * 2);
+		if ((blocks = realloc (mc_parms->mkv_blocks, blocks_max * sizeof (t_mkv_block))) == NULL)
+			return 1;
+		mc_parms->mkv_blocks = blocks;
+		mc_parms->mkv_blocks_max = blocks_max;
+	}
+	mc_parms->mkv_blocks[mc_parms->mkv_blocks_n].pos = pos;
+	mc_parms->mkv_blocks[mc_parms->mkv_blocks_n].timestamp = timestamp;
+	mc_parms->mkv_blocks[mc_parms->mkv_blocks_n].new_cluster = new_cluster;
+	mc_parms->mkv_blocks[mc_parms->mkv_blocks_n].audio = audio;
+	mc_parms->mkv_blocks_n++;
+	return 0;
+}
+
 /* convert int FPS to float stored in u32b.
    ASSUMES C99/IEEE-754 environment. */
 static uint32_t transform_fps_to_mkvfps (const uint8_t fps_in, const bool NTSC_timings, const bool ntsc_exact_60hz)
@@ -1164,38 +1817,338 @@ static uint32_t transform_fps_to_mkvfps (const uint8_t fps_in, const bool NTSC_t
 	return fps.d;	
 }
 
-/* converts DHAV to MKV+H.264
+#define WHOLE_CLUSTER_HEADER_LOAD 22
+#define WHOLE_SIMPLEBLOCK_HEADER_LOAD 9
+
+/* writes a cluster header (unknown size, ends where the next cluster starts) */
+static uint8_t *mkv_put_cluster (uint8_t *dst_p, uint64_t timecode)
+{
+	*(dst_p++) = 0x1f; // cluster ID
+	*(dst_p++) = 0x43; // cluster ID
+	*(dst_p++) = 0xb6; // cluster ID
+	*(dst_p++) = 0x75; // cluster ID
+
+	/* cluster size (EMBL) - unknown (all 1s), ends where the next cluster starts */
+	*(dst_p++) = 0x01;
+	memset (dst_p, 0xff, 7);
+	dst_p += 7;
+
+	*(dst_p++) = 0xe7; // timecode ID
+
+	*(dst_p++) = 0x88; // sizeof abs timestamp (EMBL)
+
+	/* absolute timestamp (mili-seconds) */
+	BT_NV2MM_U64(dst_p, timecode);
+	dst_p += 8;
+
+	return dst_p;
+}
+
+/* writes a SimpleBlock header, data_len bytes of frame data follow */
+static uint8_t *mkv_put_simpleblock (uint8_t *dst_p, uint8_t track, size_t data_len, int64_t timestamp_rel, bool key_frame)
+{
+	size_t mkv_simpleblock_len;
+
+	*(dst_p++) = 0xa3; // simpleblock ID
+
+	/* track length (EMBL, 4 bytes - up to 256MiB) */
+	mkv_simpleblock_len = data_len + WHOLE_SIMPLEBLOCK_HEADER_LOAD - 5;
+	*(dst_p++) = 0x10 | ((mkv_simpleblock_len >> 24) & 0x0f);
+	*(dst_p++) = (mkv_simpleblock_len >> 16) & 0xff;
+	*(dst_p++) = (mkv_simpleblock_len >> 8) & 0xff;
+	*(dst_p++) = mkv_simpleblock_len & 0xff;
+
+	*(dst_p++) = 0x80 | track; // track number (EMBL)
+	/* timestamp, relative to cluster (signed, mili-seconds) */
+	*(dst_p++) = (timestamp_rel >> 8) & 0xff; /* relative timestamp MSB */
+	*(dst_p++) = timestamp_rel & 0xff; /* relative timestamp LSB */
+	*(dst_p++) = (key_frame == true) ? 0x80 : 0x00; /* flags (0x80: keyframe) */
+
+	return dst_p;
+}
+
+/* writes the audio TrackEntry (track 2), appended to the Tracks element
+   REQUIRES: mc_parms->has_a_parms == true, supported audio codec */
+/* returns the length written (up to MKV_AUDIO_TRACK_MAX_LEN) */
+static size_t mkv_put_audio_track (const t_mc_parms *mc_parms, uint8_t *dst_p)
+{
+	uint8_t *p = dst_p + 2;	/* TrackEntry ID and size are written last */
+	uint8_t *audio_p;
+	const char *codec_id;
+	uint8_t bit_depth;
+	union {
+		uint64_t d;
+		double f;
+	} rate;
+
+	switch (mc_parms->a_codec) {
+	case MCODEC_A_AAC:
+		codec_id = "A_AAC";
+		bit_depth = 0;
+		break;
+	case MCODEC_A_PCM_S16LE:
+		codec_id = "A_PCM/INT/LIT";
+		bit_depth = 16;
+		break;
+	default:
+		/* G.711 has no Matroska codec ID of its own */
+		codec_id = "A_MS/ACM";
+		bit_depth = 8;
+		break;
+	}
+
+	/* L3 TrackNumber */
+	*(p++) = 0xd7; *(p++) = 0x81; *(p++) = 0x02;
+	/* L3 TrackUID */
+	*(p++) = 0x73; *(p++) = 0xc5; *(p++) = 0x81; *(p++) = 0x02;
+	/* L3 FlagLacing */
+	*(p++) = 0x9c; *(p++) = 0x81; *(p++) = 0x00;
+	/* L3 Language */
+	*(p++) = 0x22; *(p++) = 0xb5; *(p++) = 0x9c;
+	*(p++) = 0x83; *(p++) = 'u'; *(p++) = 'n'; *(p++) = 'd';
+	/* L3 CodecID */
+	*(p++) = 0x86;
+	*(p++) = 0x80 | strlen (codec_id);
+	memcpy (p, codec_id, strlen (codec_id));
+	p += strlen (codec_id);
+	/* L3 TrackType (audio) */
+	*(p++) = 0x83; *(p++) = 0x81; *(p++) = 0x02;
+
+	/* L3 Audio */
+	*(p++) = 0xe1;
+	audio_p = p++;
+		/* L4 SamplingFrequency */
+		rate.f = (double) mc_parms->a_sample_rate;
+		*(p++) = 0xb5; *(p++) = 0x88;
+		BT_NV2MM_U64(p, rate.d);
+		p += 8;
+		/* L4 Channels */
+		*(p++) = 0x9f; *(p++) = 0x81; *(p++) = mc_parms->a_channels;
+		/* L4 BitDepth */
+		if (bit_depth != 0) {
+			*(p++) = 0x62; *(p++) = 0x64; *(p++) = 0x81; *(p++) = bit_depth;
+		}
+	*audio_p = 0x80 | (p - audio_p - 1);
+
+	/* L3 CodecPrivate */
+	if (mc_parms->a_codec == MCODEC_A_AAC) {
+		/* AudioSpecificConfig */
+		*(p++) = 0x63; *(p++) = 0xa2; *(p++) = 0x82;
+		*(p++) = mc_parms->a_aac_config[0];
+		*(p++) = mc_parms->a_aac_config[1];
+	} else if (mc_parms->a_codec != MCODEC_A_PCM_S16LE) {
+		/* WAVEFORMATEX */
+		*(p++) = 0x63; *(p++) = 0xa2; *(p++) = 0x80 | 18;
+		BT_NV2LM_U16(p, (mc_parms->a_codec == MCODEC_A_G711_ALAW) ? 0x0006 : 0x0007);	/* wFormatTag */
+		BT_NV2LM_U16(p + 2, mc_parms->a_channels);		/* nChannels */
+		BT_NV2LM_U32(p + 4, mc_parms->a_sample_rate);		/* nSamplesPerSec */
+		BT_NV2LM_U32(p + 8, mc_parms->a_sample_rate * mc_parms->a_channels);	/* nAvgBytesPerSec */
+		BT_NV2LM_U16(p + 12, mc_parms->a_channels);		/* nBlockAlign */
+		BT_NV2LM_U16(p + 14, 8);				/* wBitsPerSample */
+		BT_NV2LM_U16(p + 16, 0);				/* cbSize */
+		p += 18;
+	}
+
+	/* L2 TrackEntry */
+	*dst_p = 0xae;
+	*(dst_p + 1) = 0x80 | (p - dst_p - 2);
+
+	return (p - dst_p);
+}
+
+/* reads an EBML element header (ID, then data size) at *pos, up to end,
+   *pos is left at the element data.
+   returns ==0 ok, !=0 error (malformed, or data past end) */
+static int mkv_get_element (const uint8_t *p, size_t end, size_t *pos, uint32_t *id, uint64_t *size)
+{
+	int len;
+	int i;
+
+	if (*pos >= end)
+		return 1;
+	for (len = 1; (len <= 4) && ((p[*pos] & (0x100 >> len)) == 0); len++);
+	if ((len > 4) || ((*pos + len) > end))
+		return 1;
+	*id = 0;
+	for (i = 0; i < len; i++)
+		*id = (*id << 8) | p[(*pos)++];
+
+	if (*pos >= end)
+		return 1;
+	for (len = 1; (len <= 8) && ((p[*pos] & (0x100 >> len)) == 0); len++);
+	if ((len > 8) || ((*pos + len) > end))
+		return 1;
+	*size = p[(*pos)++] & (0xff >> len);
+	for (i = 1; i < len; i++)
+		*size = (*size << 8) | p[(*pos)++];
+
+	return ((*size > (end - *pos)) ? 1 : 0);
+}
+
+/* parses back the Tracks element of a main header (it ends the header):
+   every TrackEntry must fill it exactly, and the video track must
+   declare the resolution in mc_parms.
+   returns ==0 ok, !=0 error (malformed header) */
+static int mkv_check_tracks (const t_mc_parms *mc_parms, const uint8_t *head_p, size_t head_len)
+{
+	size_t pos = MKV_HOFF_Tracks;
+	size_t entry_end;
+	size_t video_end;
+	uint32_t id;
+	uint64_t size;
+	bool has_width = false;
+	bool has_height = false;
+
+	if ((mkv_get_element (head_p, head_len, &pos, &id, &size) != 0) || \
+		(id != 0x1654ae6b) || ((pos + size) != head_len))
+		return 1;
+	while (pos < head_len) {
+		/* L2 TrackEntry */
+		if ((mkv_get_element (head_p, head_len, &pos, &id, &size) != 0) || (id != 0xae))
+			return 1;
+		entry_end = pos + size;
+		while (pos < entry_end) {
+			if (mkv_get_element (head_p, entry_end, &pos, &id, &size) != 0)
+				return 1;
+			if (id != 0xe0) {
+				pos += size;
+				continue;
+			}
+
+			/* L3 Video */
+			video_end = pos + size;
+			while (pos < video_end) {
+				if (mkv_get_element (head_p, video_end, &pos, &id, &size) != 0)
+					return 1;
+				if ((id == 0xb0) && (size == 2) && \
+					((((uint32_t) head_p[pos] << 8) | head_p[pos + 1]) == (uint16_t) mc_parms->v_width))
+					has_width = true;
+				if ((id == 0xba) && (size == 2) && \
+					((((uint32_t) head_p[pos] << 8) | head_p[pos + 1]) == (uint16_t) mc_parms->v_height))
+					has_height = true;
+				pos += size;
+			}
+		}
+	}
+
+	return (((has_width == true) && (has_height == true)) ? 0 : 1);
+}
+
+/* converts an audio frame to a MKV SimpleBlock (track 2),
+   into the current cluster. see dt_convert_frame_to_mkv() */
+/* returns ==0 ok ; <0 fatal error ; >0 soft error, warning */
+static int mkv_convert_audio_frame (t_mc_parms *mc_parms, uint8_t *dst_p, size_t max_dst_len, bool first_frame, mc_frame_view_t *view)
+{
+	uint8_t *dst_start = dst_p;
+	uint8_t *src_p = mc_parms->body_p;
+	size_t src_len = mc_parms->body_len;
+	uint64_t timestamp_ms;
+	int64_t timestamp_rel;
+	bool new_cluster;
+
+	if ((first_frame == true) || (mc_parms->mkv_has_audio == false)) {
+		/* output starts with video (main header, first cluster),
+		   no audio track otherwise */
+		return 2;
+	}
+
+	/* AAC is stored without ADTS header */
+	if ((mc_parms->a_codec == MCODEC_A_AAC) && (src_len >= 7) && (src_p[0] == 0xff) && ((src_p[1] & 0xf6) == 0xf0)) {
+		src_len -= ((src_p[1] & 0x01) != 0) ? 7 : 9;
+		src_p += ((src_p[1] & 0x01) != 0) ? 7 : 9;
+	}
+	if ((src_len == 0) || (src_len > mc_parms->body_len))
+		return 3; /* nothing to do, do nothing */
+
+	if ((WHOLE_CLUSTER_HEADER_LOAD + WHOLE_SIMPLEBLOCK_HEADER_LOAD) > max_dst_len)
+		return -4; /* output buffer is too short */
+
+	/* audio shortly before the cluster start goes at its start */
+	timestamp_ms = (((int64_t) mc_parms->v_timestamp + mc_parms->a_timestamp_offset) > 0) ? \
+		(((int64_t) mc_parms->v_timestamp + mc_parms->a_timestamp_offset) / 1000000) : 0;
+	timestamp_ms = (timestamp_ms > mc_parms->mkv_timecode_base) ? (timestamp_ms - mc_parms->mkv_timecode_base) : 0;
+	if (timestamp_ms < mc_parms->mkv_cluster_timecode)
+		timestamp_ms = mc_parms->mkv_cluster_timecode;
+
+	timestamp_rel = (int64_t) timestamp_ms - (int64_t) mc_parms->mkv_cluster_timecode;
+	new_cluster = (mc_parms->mkv_cluster_open == false) || (timestamp_rel > MKV_CLUSTER_MAX_DURATION_MS);
+	if (mkv_log_block (mc_parms, mc_parms->mkv_out_len + ((new_cluster == true) ? WHOLE_CLUSTER_HEADER_LOAD : 0), \
+		(int64_t) mc_parms->v_timestamp + mc_parms->a_timestamp_offset, new_cluster, true) != 0)
+		return -5; /* out of memory */
+	if (new_cluster == true) {
+		mc_parms->mkv_cluster_pos = mc_parms->mkv_out_len;
+		dst_p = mkv_put_cluster (dst_p, timestamp_ms);
+		mc_parms->mkv_cluster_open = true;
+		mc_parms->mkv_cluster_timecode = timestamp_ms;
+		timestamp_rel = 0;
+	}
+	if (timestamp_ms > mc_parms->mkv_last_timecode)
+		mc_parms->mkv_last_timecode = timestamp_ms;
+
+	dst_p = mkv_put_simpleblock (dst_p, 2, src_len, timestamp_rel, true);
+
+	/* audio data follows, as is */
+	view->head_len = dst_p - dst_start;
+	view->body_p = src_p;
+	view->body_len = src_len;
+
+	mc_parms->mkv_out_len += view->head_len + src_len;
+
+	return 0;
+}
+
+/* converts DHAV to MKV+H.264 (or H.265, see vcodec)
    REQUIRES: src_p != dst_p
    this function assumes a complete and correct single DHAV frame from src */
-/* timestamp in micro-seconds (not mili-seconds) */
-/* sequence - sequential number for each frame */
+/* only the MKV headers (main header, cluster, SimpleBlock) are written
+   into dst, the H.264 data is not copied: view receives both the headers
+   and the frame body (in place within src), to be output one after the other
+   (see outfile_writev). view is empty unless ==0 is returned. */
+/* frames are grouped into clusters: a new cluster is started at every I-frame
+   (or when the current one would last more than MKV_CLUSTER_MAX_DURATION_MS),
+   the following frames go into that same cluster with timecodes relative to it.
+   clusters are written with unknown size, so that every frame may be sent
+   right away (live streams). cluster state is kept in mc_parms. */
+/* audio frames (if mc_parms->audio) go into track 2, within the same clusters.
+   the main header declares the audio track from the audio parameters,
+   thus it waits for those up to the second I-frame (then video only). */
 /* ATTENTION: this function must be called with first_frame==true
    until it returns ==0, then use first_frame==false */
 /* returns ==0 ok ; <0 fatal error ; >0 soft error, warning */
-#define WHOLE_CLUSTER_HEADER_LOAD 22
-#define WHOLE_SIMPLEBLOCK_HEADER_LOAD 13
-int dt_convert_frame_to_mkv (const t_mc_parms *mc_parms, uint8_t *src_dhav_p, size_t src_dhav_len, uint8_t *dst_p, size_t *dst_len, size_t max_dst_len, bool first_frame, mcodec_t vcodec)
+int dt_convert_frame_to_mkv (t_mc_parms *mc_parms, uint8_t *src_dhav_p, size_t src_dhav_len, uint8_t *dst_p, size_t max_dst_len, bool first_frame, mcodec_t vcodec, mc_frame_view_t *view)
 {
 	uint8_t *src_p;
 	size_t src_len;
-	uint64_t timestamp_us = mc_parms->v_timestamp / 1000;
-	size_t mkv_cluster_len;
-	size_t mkv_simpleblock_len;
+	uint64_t timestamp_ms;
+	int64_t timestamp_rel;
+	bool new_cluster;
+	uint64_t cluster_pos;
+	uint8_t *dst_start = dst_p;
+	size_t head_len;
 	size_t whole_payload;
 	uint32_t fps_dhav_f;
 	int x, y;
 	const char tanidvr_sw_str[] = "TaniDVR "VERSION"\0";
 	const char str_MCODEC_V_MPEG4_ISO_AVC[32] = "V_MPEG4/ISO/AVC\0";
 	const char str_MCODEC_V_MPEG4_ISO_ASP[32] = "V_MPEG4/ISO/ASP\0";
+	const char str_MCODEC_V_MPEGH_ISO_HEVC[32] = "V_MPEGH/ISO/HEVC\0";
+	uint8_t hvcc[MKV_HVCC_MAX_LEN];
+	size_t hvcc_len = 0;
+	bool key_frame;
 
-	*dst_len = 0;
+	view->head_p = dst_p;
+	view->head_len = 0;
+	view->body_p = NULL;
+	view->body_len = 0;
 
 	if (src_dhav_len == 0)
 		return 3; /* nothing to do, do nothing */
 
+	if (mc_parms->frame_type == FT_AUDIO_FRAME)
+		return (mkv_convert_audio_frame (mc_parms, dst_p, max_dst_len, first_frame, view));
 	if ( (mc_parms->frame_type != FT_VIDEO_I_FRAME) && \
 	   (mc_parms->frame_type != FT_VIDEO_FRAME) ) {
-		/* only h264 video frames are supported */
+		/* only h264 video and audio frames are supported */
 		return 2;
 	}
 	if (mc_parms->has_v_parms == false) {
@@ -1203,23 +2156,79 @@ int dt_convert_frame_to_mkv (const t_mc_parms *mc_parms, uint8_t *src_dhav_p, si
 		   unable to get enough video parameters yet */
 		return 1;
 	}
+	if ((first_frame == true) && (vcodec == MCODEC_V_MPEGH_ISO_HEVC)) {
+		/* H.265: output starts at a random access point,
+		   its parameter sets go into the main header */
+		if (mc_parms->frame_type != FT_VIDEO_I_FRAME)
+			return 1;
+		if ((hvcc_len = hevc_build_hvcc (mc_parms->body_p, mc_parms->body_len, hvcc)) == 0) {
+			log_printf (LOGT_WARNING, "H.265 key frame without parameter sets (VPS/SPS/PPS), skipped.\n");
+			return 1;
+		}
+	}
+	if ((first_frame == true) && (mc_parms->audio == true) && (mc_parms->mkv_audio_wait < 2)) {
+		if (mc_parms->has_a_parms == false) {
+			/* no audio parameters yet, for the main header */
+			if (mc_parms->frame_type == FT_VIDEO_I_FRAME)
+				mc_parms->mkv_audio_wait++;
+			if (mc_parms->mkv_audio_wait < 2)
+				return 1;
+			log_printf (LOGT_WARNING, "No audio found in stream, output has video only.\n");
+		} else if (mc_parms->frame_type != FT_VIDEO_I_FRAME) {
+			/* audio found while waiting, output starts at the next I-frame */
+			return 1;
+		}
+	}
 
 	/* only the body of DHAV frame (the h264 data itself)
            will be used from src_dhav */
 	src_p = mc_parms->body_p;
 	src_len = mc_parms->body_len;
 
-	whole_payload = WHOLE_CLUSTER_HEADER_LOAD + WHOLE_SIMPLEBLOCK_HEADER_LOAD + src_len;
+	/* H.265: NAL units are length-prefixed (see hevc_build_hvcc),
+	   the frame body is converted instead of written in place
+	   (usually done already, by dt_collect_dhav_frame_info) */
+	if (vcodec == MCODEC_V_MPEGH_ISO_HEVC) {
+		if ((mc_parms->hevc_nal_ready == false) && \
+			(hevc_to_length_prefixed (mc_parms, src_p, src_len, &key_frame) != 0))
+			return -5; /* out of memory */
+		mc_parms->hevc_nal_ready = false;
+		if (mc_parms->hevc_nal_len == 0)
+			return 2; /* no NAL units, nothing to output */
+		src_p = mc_parms->hevc_nal_buf;
+		src_len = mc_parms->hevc_nal_len;
+	}
+
+	/* a new main header restarts timecodes (eg. a new output file) */
+	if (first_frame == true) {
+		mc_parms->mkv_timecode_base = mc_parms->v_timestamp / 1000000;
+		mc_parms->mkv_cluster_open = false;
+		mc_parms->mkv_last_timecode = 0;
+	}
+	timestamp_ms = mc_parms->v_timestamp / 1000000;
+	timestamp_ms = (timestamp_ms > mc_parms->mkv_timecode_base) ? (timestamp_ms - mc_parms->mkv_timecode_base) : 0;
+
+	/* start a new cluster, or append to the current one ? */
+	timestamp_rel = (int64_t) timestamp_ms - (int64_t) mc_parms->mkv_cluster_timecode;
+	new_cluster = (mc_parms->mkv_cluster_open == false) || \
+		(mc_parms->frame_type == FT_VIDEO_I_FRAME) || \
+		(timestamp_rel < 0) || (timestamp_rel > MKV_CLUSTER_MAX_DURATION_MS);
+	if (new_cluster == true)
+		timestamp_rel = 0;
+
+	whole_payload = WHOLE_SIMPLEBLOCK_HEADER_LOAD + src_len;
+	if (new_cluster == true)
+		whole_payload += WHOLE_CLUSTER_HEADER_LOAD;
 
 	/* if first frame, add main MKV header */
 	if ((first_frame == true) && (mc_parms->has_v_parms == true)) {
-		whole_payload += WHOLE_MAIN_HEADER_LOAD;
 		memcpy (dst_p, mkv_head, WHOLE_MAIN_HEADER_LOAD);
+		head_len = WHOLE_MAIN_HEADER_LOAD;
 
 		/* update video codec parameter into main MKV header */
 		if (vcodec == MCODEC_V_MPEG4_ISO_AVC) {
 			memcpy (dst_p + MKV_HOFF_CodecStr, str_MCODEC_V_MPEG4_ISO_AVC, 15);
-		} else {
+		} else if (vcodec == MCODEC_V_MPEG4_ISO_ASP) {
 			memcpy (dst_p + MKV_HOFF_CodecStr, str_MCODEC_V_MPEG4_ISO_ASP, 15);
 		}
 
@@ -1233,6 +2242,39 @@ int dt_convert_frame_to_mkv (const t_mc_parms *mc_parms, uint8_t *src_dhav_p, si
 		fps_dhav_f = transform_fps_to_mkvfps (mc_parms->dhav_fps, mc_parms->NTSC_timings, mc_parms->ntsc_exact_60hz);
 		BT_NV2MM_U32(dst_p + MKV_HOFF_FrameRate, fps_dhav_f);
 
+		/* H.265: longer CodecID, and hvcC as CodecPrivate
+		   (both end the video TrackEntry, which ends the main header).
+		   everything after CodecID is moved by one byte, thus the
+		   MKV_HOFF_* offsets past MKV_HOFF_CodecStr no longer apply */
+		if (vcodec == MCODEC_V_MPEGH_ISO_HEVC) {
+			memmove (dst_p + MKV_HOFF_CodecStr + 16, dst_p + MKV_HOFF_CodecStr + 15, MKV_HOFF_CodecPrivate - (MKV_HOFF_CodecStr + 15));
+			*(dst_p + MKV_HOFF_CodecStr - 1) = 0x80 | 16;
+			memcpy (dst_p + MKV_HOFF_CodecStr, str_MCODEC_V_MPEGH_ISO_HEVC, 16);
+			head_len = MKV_HOFF_CodecPrivate + 1;
+			*(dst_p + head_len++) = 0x63;	/* CodecPrivate ID */
+			*(dst_p + head_len++) = 0xa2;
+			*(dst_p + head_len++) = 0x40 | ((hvcc_len >> 8) & 0x3f);	/* 2 bytes EMBL */
+			*(dst_p + head_len++) = hvcc_len & 0xff;
+			memcpy (dst_p + head_len, hvcc, hvcc_len);
+			head_len += hvcc_len;
+			BT_NV2MM_U64(dst_p + MKV_HOFF_TrackEntry + 1, (uint64_t) (head_len - MKV_HOFF_TrackEntry - 9));
+			*(dst_p + MKV_HOFF_TrackEntry + 1) = 0x01;	/* 8 bytes EMBL */
+		}
+
+		/* audio track, after the video one */
+		mc_parms->mkv_has_audio = (mc_parms->audio == true) && (mc_parms->has_a_parms == true) && (mc_parms->a_codec != MCODEC_A_UNSUPPORTED);
+		if (mc_parms->mkv_has_audio == true)
+			head_len += mkv_put_audio_track (mc_parms, dst_p + head_len);
+
+		BT_NV2MM_U64(dst_p + MKV_HOFF_Tracks + 4, (uint64_t) (head_len - MKV_HOFF_Tracks - 12));
+		*(dst_p + MKV_HOFF_Tracks + 4) = 0x01;	/* 8 bytes EMBL */
+		whole_payload += head_len;
+
+		if (mkv_check_tracks (mc_parms, dst_p, head_len) != 0) {
+			log_printf (LOGT_FATAL, "Malformed MKV main header (Tracks), conversion aborted.\n");
+			return -6;
+		}
+
 		/* update software strings in MKV header */
 		x = strlen (tanidvr_sw_str);
 		/* MuxingApp */
@@ -1247,78 +2289,1022 @@ int dt_convert_frame_to_mkv (const t_mc_parms *mc_parms, uint8_t *src_dhav_p, si
 		*(dst_p + MKV_HOFF_Language + 1) = (uint8_t) 'n';
 		*(dst_p + MKV_HOFF_Language + 2) = (uint8_t) 'd';
 
-		/* TimecodeScale (1 us) */
-		*(dst_p + MKV_HOFF_TimecodeScale) = (uint8_t) 0x00;
-		*(dst_p + MKV_HOFF_TimecodeScale + 1) = (uint8_t) 0x03;
-		*(dst_p + MKV_HOFF_TimecodeScale + 2) = (uint8_t) 0xe8;
-
-		dst_p += WHOLE_MAIN_HEADER_LOAD;
+		/* TimecodeScale (1 ms), required by the 16-bit relative
+		   SimpleBlock timecodes to cover a whole cluster */
+		*(dst_p + MKV_HOFF_TimecodeScale) = (uint8_t) 0x0f;
+		*(dst_p + MKV_HOFF_TimecodeScale + 1) = (uint8_t) 0x42;
+		*(dst_p + MKV_HOFF_TimecodeScale + 2) = (uint8_t) 0x40;
+
+		/* Duration is unknown while streaming, turn it into Void */
+		*(dst_p + MKV_HOFF_Duration) = (uint8_t) 0xec;
+		*(dst_p + MKV_HOFF_Duration + 1) = (uint8_t) 0x89;
+		memset (dst_p + MKV_HOFF_Duration + 2, 0, 9);
+
+		/* keep it, for finalization */
+		memcpy (mc_parms->mkv_head, dst_p, head_len);
+		mc_parms->mkv_head_len = head_len;
+		mc_parms->mkv_has_head = true;
+		mc_parms->mkv_out_len = 0;
+		mc_parms->mkv_cues_n = 0;
+		mc_parms->mkv_blocks_n = 0;
+
+		dst_p += head_len;
 	}
 
-	if (whole_payload > max_dst_len)
+	if ((whole_payload - src_len) > max_dst_len)
 		return -4; /* output buffer is too short */
 
-	/* MKV Cluster */
-	*(dst_p++) = 0x1f; // cluster ID
-	*(dst_p++) = 0x43; // cluster ID
-	*(dst_p++) = 0xb6; // cluster ID
-	*(dst_p++) = 0x75; // cluster ID
+	if (new_cluster == true) {
+		cluster_pos = mc_parms->mkv_out_len + (dst_p - dst_start);
+		mc_parms->mkv_cluster_pos = cluster_pos;
 
-	/* cluster size (EMBL) */
-	/* cluster size = sizeof (whole cluster) - sizeof (cluster ID) - sizeof (cluster size)
-	   -> cluter size = sizeof (whole cluster) - 12; */
-	mkv_cluster_len = src_len + WHOLE_CLUSTER_HEADER_LOAD + WHOLE_SIMPLEBLOCK_HEADER_LOAD - 12;
-	*(dst_p++) = 0x01;
-	*(dst_p++) = (mkv_cluster_len >> 48) & 0xff;
-	*(dst_p++) = (mkv_cluster_len >> 40) & 0xff;
-	*(dst_p++) = (mkv_cluster_len >> 32) & 0xff;
-	*(dst_p++) = (mkv_cluster_len >> 24) & 0xff;
-	*(dst_p++) = (mkv_cluster_len >> 16) & 0xff;
-	*(dst_p++) = (mkv_cluster_len >> 8) & 0xff;
-	*(dst_p++) = mkv_cluster_len & 0xff;
+		/* MKV Cluster */
+		dst_p = mkv_put_cluster (dst_p, timestamp_ms);
 
-	*(dst_p++) = 0xe7; // timecode ID
+		mc_parms->mkv_cluster_open = true;
+		mc_parms->mkv_cluster_timecode = timestamp_ms;
 
-	*(dst_p++) = 0x88; // sizeof abs timestamp (EMBL)
+		if (mc_parms->frame_type == FT_VIDEO_I_FRAME)
+			mkv_add_cue (mc_parms, timestamp_ms, cluster_pos - MKV_HOFF_SegmentData);
+	}
+	if (timestamp_ms > mc_parms->mkv_last_timecode)
+		mc_parms->mkv_last_timecode = timestamp_ms;
 
-	/* absolute timestamp (micro-seconds) */
-	*(dst_p++) = (timestamp_us >> 56) & 0xff;
-	*(dst_p++) = (timestamp_us >> 48) & 0xff;
-	*(dst_p++) = (timestamp_us >> 40) & 0xff;
-	*(dst_p++) = (timestamp_us >> 32) & 0xff;
-	*(dst_p++) = (timestamp_us >> 24) & 0xff;
-	*(dst_p++) = (timestamp_us >> 16) & 0xff;
-	*(dst_p++) = (timestamp_us >> 8) & 0xff;
-	*(dst_p++) = timestamp_us & 0xff;
+	if (mkv_log_block (mc_parms, mc_parms->mkv_out_len + (dst_p - dst_start), (int64_t) mc_parms->v_timestamp, new_cluster, false) != 0)
+		return -5; /* out of memory */
 
 	/* MKV SimpleBlock */
-	*(dst_p++) = 0xa3; // simpleblock ID
+	dst_p = mkv_put_simpleblock (dst_p, 1, src_len, timestamp_rel, (mc_parms->frame_type == FT_VIDEO_I_FRAME));
 
-	/* track length (EMBL) */
-	mkv_simpleblock_len = src_len + WHOLE_SIMPLEBLOCK_HEADER_LOAD - 9;
-	*(dst_p++) = 0x01;
-	*(dst_p++) = (mkv_simpleblock_len >> 48) & 0xff;
-	*(dst_p++) = (mkv_simpleblock_len >> 40) & 0xff;
-	*(dst_p++) = (mkv_simpleblock_len >> 32) & 0xff;
-	*(dst_p++) = (mkv_simpleblock_len >> 24) & 0xff;
-	*(dst_p++) = (mkv_simpleblock_len >> 16) & 0xff;
-	*(dst_p++) = (mkv_simpleblock_len >> 8) & 0xff;
-	*(dst_p++) = mkv_simpleblock_len & 0xff;
+	/* video data follows (H.264: as is, H.265: length-prefixed) */
+	view->head_len = dst_p - dst_start;
+	view->body_p = src_p;
+	view->body_len = src_len;
+
+	mc_parms->mkv_out_len += whole_payload;
+
+	return 0;
+}
+
+/* length of the data dt_finalize_mkv() appends to output */
+#define WHOLE_CUES_HEADER_LOAD 12
+#define WHOLE_CUEPOINT_LOAD 27
+size_t dt_finalize_mkv_len (const t_mc_parms *mc_parms)
+{
+	return (WHOLE_CUES_HEADER_LOAD + (mc_parms->mkv_cues_n * WHOLE_CUEPOINT_LOAD));
+}
+
+/* finalizes MKV output written by dt_convert_frame_to_mkv(),
+   for seekable outputs only.
+   dst_p receives the Cues element, to be appended to output
+   (see dt_finalize_mkv_len() for the required length).
+   head_p receives an updated main header (mc_parms->mkv_head_len bytes),
+   to overwrite the one at the start of output: Segment size, Duration,
+   and a SeekHead (written into the reserved Void) are filled in. */
+/* returns ==0 ok ; <0 fatal error ; >0 nothing to do (no MKV header was output) */
+#define WHOLE_SEEK_LOAD 21
+int dt_finalize_mkv (t_mc_parms *mc_parms, uint8_t *dst_p, size_t *dst_len, size_t max_dst_len, uint8_t *head_p)
+{
+	uint8_t *p;
+	uint64_t segment_len;
+	uint64_t cues_pos;
+	size_t i;
+	union {
+		uint64_t d;
+		double f;
+	} duration;
+	const uint32_t seek_ids[3] = { 0x1549a966, 0x1654ae6b, 0x1c53bb6b };	/* Info, Tracks, Cues */
+	uint64_t seek_pos[3];
+
+	*dst_len = 0;
+
+	if (mc_parms->mkv_has_head == false)
+		return 1;
+	if (dt_finalize_mkv_len (mc_parms) > max_dst_len)
+		return -4; /* output buffer is too short */
+
+	cues_pos = mc_parms->mkv_out_len - MKV_HOFF_SegmentData;
+	seek_pos[0] = MKV_HOFF_Info - MKV_HOFF_SegmentData;
+	seek_pos[1] = MKV_HOFF_Tracks - MKV_HOFF_SegmentData;
+	seek_pos[2] = cues_pos;
+
+	/* L1 Cues */
+	p = dst_p;
+	BT_NV2MM_U32(p, 0x1c53bb6b);
+	p += 4;
+	BT_NV2MM_U64(p, (uint64_t) (mc_parms->mkv_cues_n * WHOLE_CUEPOINT_LOAD));
+	*p = 0x01;	/* 8 bytes EMBL */
+	p += 8;
+	for (i = 0; i < mc_parms->mkv_cues_n; i++) {
+		*(p++) = 0xbb; // CuePoint ID
+		*(p++) = 0x80 | (WHOLE_CUEPOINT_LOAD - 2);
+		*(p++) = 0xb3; // CueTime ID
+		*(p++) = 0x88;
+		BT_NV2MM_U64(p, mc_parms->mkv_cues[i].timecode);
+		p += 8;
+		*(p++) = 0xb7; // CueTrackPositions ID
+		*(p++) = 0x8d;
+		*(p++) = 0xf7; // CueTrack ID
+		*(p++) = 0x81;
+		*(p++) = 0x01;
+		*(p++) = 0xf1; // CueClusterPosition ID
+		*(p++) = 0x88;
+		BT_NV2MM_U64(p, mc_parms->mkv_cues[i].cluster_pos);
+		p += 8;
+	}
+	*dst_len = p - dst_p;
+
+	/* updated main header */
+	memcpy (head_p, mc_parms->mkv_head, mc_parms->mkv_head_len);
+
+	/* Segment size (8 bytes EMBL, same as the "unknown" placeholder) */
+	segment_len = mc_parms->mkv_out_len + *dst_len - MKV_HOFF_SegmentData;
+	BT_NV2MM_U64(head_p + MKV_HOFF_SegmentSize, segment_len);
+	*(head_p + MKV_HOFF_SegmentSize) = 0x01;	/* 8 bytes EMBL */
+
+	/* L1 SeekHead, then Void for the remaining of the reserved space */
+	p = head_p + MKV_HOFF_Void;
+	BT_NV2MM_U32(p, 0x114d9b74);
+	p += 4;
+	*(p++) = 0x80 | (3 * WHOLE_SEEK_LOAD);
+	for (i = 0; i < 3; i++) {
+		*(p++) = 0x4d; // Seek ID
+		*(p++) = 0xbb; // Seek ID
+		*(p++) = 0x80 | (WHOLE_SEEK_LOAD - 3);
+		*(p++) = 0x53; // SeekID ID
+		*(p++) = 0xab; // SeekID ID
+		*(p++) = 0x84;
+		BT_NV2MM_U32(p, seek_ids[i]);
+		p += 4;
+		*(p++) = 0x53; // SeekPosition ID
+		*(p++) = 0xac; // SeekPosition ID
+		*(p++) = 0x88;
+		BT_NV2MM_U64(p, seek_pos[i]);
+		p += 8;
+	}
+	*(p++) = 0xec; // Void ID
+	*p = 0x80 | (MKV_CLEN_Void - (p + 1 - (head_p + MKV_HOFF_Void)));
+	memset (p + 1, 0, (*p & 0x7f));
+
+	/* Duration (mili-seconds, IEEE-754 double), replaces the Void placeholder */
+	duration.f = (double) mc_parms->mkv_last_timecode;
+	if (mc_parms->dhav_fps != 0)
+		duration.f += (double) 1000 / (double) mc_parms->dhav_fps;	/* last frame lasts for a frame period */
+	p = head_p + MKV_HOFF_Duration;
+	*(p++) = 0x44; // Duration ID
+	*(p++) = 0x89; // Duration ID
+	*(p++) = 0x88;
+	BT_NV2MM_U64(p, duration.d);
+
+	return 0;
+}
 
-	*(dst_p++) = 0x81; // ??? (EMBL?)
-	/* note: since each frame has its cluster
-           (thus its own timestamp, we will not use
-           the relative one (sets to 0x0000) */
-	*(dst_p++) = 0x00; /* relative timestamp MSB */ // era 0x00
-	*(dst_p++) = 0x00; /* relative timestamp LSB */
-	*(dst_p++) = (mc_parms->frame_type == FT_VIDEO_I_FRAME) ? 0x01 : 0x00; /* flags */
+/* position of the timecode within a cluster (see mkv_put_cluster) */
+#define MKV_COFF_Timecode 14
+/* position of the relative timecode within a SimpleBlock (see mkv_put_simpleblock) */
+#define MKV_BOFF_Timecode 6
+
+/* continues the MKV output of mc_parms with another part of the stream,
+   converted independently into its own MKV output (part_p, main header
+   included), which is appended without its main header.
+   the part must be converted with mkv_log_blocks == true: its cluster and
+   SimpleBlock timecodes are rewritten in place, as if the part had been
+   converted along with mc_parms, with timestamps (nsec) shifted by
+   timestamp_offset. the whole nsec timestamps are taken, so that
+   frame periods of fractional mili-seconds (NTSC) round as they would.
+   cues and duration are updated for dt_finalize_mkv().
+   returns ==0 ok, !=0 nothing to append (part has no output) */
+int dt_mkv_append_part (t_mc_parms *mc_parms, const t_mc_parms *part, uint8_t *part_p, int64_t timestamp_offset)
+{
+	const t_mkv_block *block;
+	uint8_t *block_p;
+	int64_t timestamp;
+	uint64_t timecode;
+	uint64_t cluster_timecode = 0;
+	uint64_t cluster_pos;
+	int64_t timecode_rel;
+	size_t cue_n = 0;
+	size_t i;
+
+	if ((part->mkv_has_head == false) || (mc_parms->mkv_has_head == false))
+		return 1;
 
-	/* copy H.264 data */
-	memcpy (dst_p, src_p, src_len);
-	dst_p += src_len;;
+	for (i = 0; i < part->mkv_blocks_n; i++) {
+		block = &(part->mkv_blocks[i]);
+		block_p = part_p + block->pos;
+
+		/* as dt_convert_frame_to_mkv (audio: mkv_convert_audio_frame) */
+		timestamp = block->timestamp + timestamp_offset;
+		timecode = (timestamp > 0) ? ((uint64_t) timestamp / 1000000) : 0;
+		timecode = (timecode > mc_parms->mkv_timecode_base) ? (timecode - mc_parms->mkv_timecode_base) : 0;
+		if ((block->audio == true) && (timecode < cluster_timecode))
+			timecode = cluster_timecode;
+
+		if (block->new_cluster == true) {
+			cluster_timecode = timecode;
+			cluster_pos = block->pos - WHOLE_CLUSTER_HEADER_LOAD;
+			BT_NV2MM_U64(part_p + cluster_pos + MKV_COFF_Timecode, cluster_timecode);
+
+			/* cues are in cluster order (some may be missing, see mkv_add_cue) */
+			while ((cue_n < part->mkv_cues_n) && (part->mkv_cues[cue_n].cluster_pos < (cluster_pos - MKV_HOFF_SegmentData)))
+				cue_n++;
+			if ((cue_n < part->mkv_cues_n) && (part->mkv_cues[cue_n].cluster_pos == (cluster_pos - MKV_HOFF_SegmentData))) {
+				mkv_add_cue (mc_parms, cluster_timecode, \
+					part->mkv_cues[cue_n].cluster_pos - part->mkv_head_len + mc_parms->mkv_out_len);
+				cue_n++;
+			}
+		}
 
-	*dst_len = whole_payload;
+		timecode_rel = (int64_t) timecode - (int64_t) cluster_timecode;
+		*(block_p + MKV_BOFF_Timecode) = (timecode_rel >> 8) & 0xff;
+		*(block_p + MKV_BOFF_Timecode + 1) = timecode_rel & 0xff;
+		if (timecode > mc_parms->mkv_last_timecode)
+			mc_parms->mkv_last_timecode = timecode;
+	}
+	mc_parms->mkv_out_len += part->mkv_out_len - part->mkv_head_len;
 
 	return 0;
 }
 
+
+
+/* ********************************* */
+
+/* fragmented MP4 (ISO BMFF, CMAF-compatible):
+   an init segment (ftyp, moov) followed by one moof+mdat fragment per GOP.
+   H.264 only, NAL units are stored length-prefixed (avcC),
+   with the parameter sets taken out of the samples. */
+
+/* decode times (1/90000 sec) */
+#define FMP4_TIMESCALE 90000
+#define FMP4_TS_TO_DT(mcp,ts) ((((ts) > (mcp)->fmp4_timestamp_base) ? ((ts) - (mcp)->fmp4_timestamp_base) : 0) * 9 / 100000)
+
+/* trun sample flags */
+#define FMP4_SAMPLE_FLAGS_KEY 0x02000000	/* depends on no other */
+#define FMP4_SAMPLE_FLAGS_NONKEY 0x01010000	/* depends on others, non-sync */
+
+/* writes the size of a box started at box_p, ending at end_p */
+static void fmp4_box_end (uint8_t *box_p, const uint8_t *end_p)
+{
+	uint32_t box_len = end_p - box_p;
+
+	BT_NV2MM_U32(box_p, box_len);
+}
+
+/* starts a box (the size is written by fmp4_box_end),
+   returns pointer to its contents */
+static uint8_t *fmp4_box_start (uint8_t *p, const char *type)
+{
+	memcpy (p + 4, type, 4);
+	return (p + 8);
+}
+
+/* starts a full box (box + version + flags) */
+static uint8_t *fmp4_fullbox_start (uint8_t *p, const char *type, uint8_t version, uint32_t flags)
+{
+	uint32_t vf = ((uint32_t) version << 24) | (flags & 0xffffff);
+
+	p = fmp4_box_start (p, type);
+	BT_NV2MM_U32(p, vf);
+	return (p + 4);
+}
+
+static uint8_t *fmp4_put_u32 (uint8_t *p, uint32_t v)
+{
+	BT_NV2MM_U32(p, v);
+	return (p + 4);
+}
+
+static uint8_t *fmp4_put_u16 (uint8_t *p, uint16_t v)
+{
+	BT_NV2MM_U16(p, v);
+	return (p + 2);
+}
+
+/* unity transformation matrix (mvhd, tkhd) */
+static uint8_t *fmp4_put_matrix (uint8_t *p)
+{
+	const uint32_t matrix[9] = { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 };
+	int i;
+
+	for (i = 0; i < 9; i++)
+		p = fmp4_put_u32 (p, matrix[i]);
+	return p;
+}
+
+/* makes room for len more bytes of sample data (current fragment).
+   returns ==0 ok, !=0 error (out of memory) */
+static int fmp4_mdat_reserve (t_mc_parms *mc_parms, size_t len)
+{
+	unsigned int cur = mc_parms->fmp4_mdat_cur;
+	size_t new_max = mc_parms->fmp4_mdat_max[cur];
+	uint8_t *new_p;
+
+	if ((mc_parms->fmp4_mdat_len + len) <= new_max)
+		return 0;
+
+	if (new_max == 0)
+		new_max = T_MC_PARMS_DHAV_STF;
+	while (new_max < (mc_parms->fmp4_mdat_len + len))
+		new_max *= 2;
+	if ((new_p = realloc (mc_parms->fmp4_mdat[cur], new_max)) == NULL)
+		return 1;
+	mc_parms->fmp4_mdat[cur] = new_p;
+	mc_parms->fmp4_mdat_max[cur] = new_max;
+	return 0;
+}
+
+/* appends a frame (H.264 Annex B: start code-prefixed NAL units)
+   to the current fragment, as length-prefixed NAL units.
+   parameter sets are kept aside (for the init segment), AUDs are dropped.
+   returns ==0 ok, !=0 error (out of memory) */
+static int fmp4_add_sample (t_mc_parms *mc_parms, const uint8_t *src_p, size_t src_len)
+{
+	t_fmp4_sample *sample = &(mc_parms->fmp4_samples[mc_parms->fmp4_samples_n]);
+	size_t mdat_start = mc_parms->fmp4_mdat_len;
+	size_t pos;
+	size_t nal_start;
+	size_t nal_end;
+	size_t nal_len;
+	uint8_t *dst_p;
+
+	if (src_len < 4)
+		return 0;	/* no NAL unit */
+
+	/* start codes are searched fully contained within src (pos == src_len - 2: none) */
+	pos = scan_start_code (src_p, src_len - 2);
+	while (pos < (src_len - 2)) {
+		nal_start = pos + 3;
+		if (nal_start < (src_len - 2))
+			pos = nal_start + scan_start_code (src_p + nal_start, src_len - 2 - nal_start);
+		else
+			pos = src_len - 2;
+		nal_end = (pos < (src_len - 2)) ? pos : src_len;
+
+		/* trailing zeroes belong to the next start code (or are padding) */
+		while ((nal_end > nal_start) && (src_p[nal_end - 1] == 0x00))
+			nal_end--;
+		if ((nal_len = nal_end - nal_start) == 0)
+			continue;
+
+		switch (src_p[nal_start] & 0x1f) {
+		case 7:	/* SPS */
+			if (nal_len <= FMP4_PARMSET_MAX_LEN) {
+				memcpy (mc_parms->fmp4_sps, src_p + nal_start, nal_len);
+				mc_parms->fmp4_sps_len = nal_len;
+			}
+			break;
+		case 8:	/* PPS */
+			if (nal_len <= FMP4_PARMSET_MAX_LEN) {
+				memcpy (mc_parms->fmp4_pps, src_p + nal_start, nal_len);
+				mc_parms->fmp4_pps_len = nal_len;
+			}
+			break;
+		case 9:	/* access unit delimiter, not used within MP4 */
+			break;
+		default:
+			if (fmp4_mdat_reserve (mc_parms, 4 + nal_len) != 0)
+				return 1;
+			dst_p = mc_parms->fmp4_mdat[mc_parms->fmp4_mdat_cur] + mc_parms->fmp4_mdat_len;
+			dst_p = fmp4_put_u32 (dst_p, nal_len);
+			memcpy (dst_p, src_p + nal_start, nal_len);
+			mc_parms->fmp4_mdat_len += 4 + nal_len;
+			break;
+		}
+	}
+
+	if (mc_parms->fmp4_mdat_len == mdat_start)
+		return 0;	/* nothing but parameter sets */
+	sample->timestamp = mc_parms->v_timestamp;
+	sample->len = mc_parms->fmp4_mdat_len - mdat_start;
+	sample->key_frame = (mc_parms->frame_type == FT_VIDEO_I_FRAME);
+	mc_parms->fmp4_samples_n++;
+	return 0;
+}
+
+/* writes the init segment (ftyp, moov) into dst.
+   REQUIRES: parameter sets (fmp4_sps, fmp4_pps) */
+static uint8_t *fmp4_write_init (t_mc_parms *mc_parms, uint8_t *dst_p)
+{
+	uint8_t *moov_p, *trak_p, *mdia_p, *minf_p, *dinf_p, *dref_p, *url_p;
+	uint8_t *stbl_p, *stsd_p, *avc1_p, *avcc_p, *box_p, *mvex_p;
+	uint8_t *p = dst_p;
+	uint32_t display_width;
+	const uint8_t *sps = mc_parms->fmp4_sps;
+	const char brands[5][4] = { "iso6", "iso6", "cmfc", "isom", "avc1" };
+	const char handler_name[] = "TaniDVR";
+	int i;
+
+	/* ftyp */
+	box_p = p;
+	p = fmp4_box_start (p, "ftyp");
+	memcpy (p, brands[0], 4);	/* major brand */
+	p = fmp4_put_u32 (p + 4, 0);	/* minor version */
+	for (i = 1; i < 5; i++) {
+		memcpy (p, brands[i], 4);	/* compatible brands */
+		p += 4;
+	}
+	fmp4_box_end (box_p, p);
+
+	moov_p = p;
+	p = fmp4_box_start (p, "moov");
+
+	/* mvhd */
+	box_p = p;
+	p = fmp4_fullbox_start (p, "mvhd", 0, 0);
+	p = fmp4_put_u32 (p, 0);		/* creation time */
+	p = fmp4_put_u32 (p, 0);		/* modification time */
+	p = fmp4_put_u32 (p, FMP4_TIMESCALE);
+	p = fmp4_put_u32 (p, 0);		/* duration: unknown (fragmented) */
+	p = fmp4_put_u32 (p, 0x00010000);	/* rate 1.0 */
+	p = fmp4_put_u16 (p, 0x0100);		/* volume 1.0 */
+	memset (p, 0, 10);			/* reserved */
+	p = fmp4_put_matrix (p + 10);
+	memset (p, 0, 24);			/* pre_defined */
+	p = fmp4_put_u32 (p + 24, 2);		/* next track ID */
+	fmp4_box_end (box_p, p);
+
+	trak_p = p;
+	p = fmp4_box_start (p, "trak");
+
+	/* tkhd (enabled, in movie), display size as 16.16 fixed point */
+	display_width = (mc_parms->v_height * mc_parms->v_aspect_x) / mc_parms->v_aspect_y;
+	box_p = p;
+	p = fmp4_fullbox_start (p, "tkhd", 0, 0x000003);
+	p = fmp4_put_u32 (p, 0);		/* creation time */
+	p = fmp4_put_u32 (p, 0);		/* modification time */
+	p = fmp4_put_u32 (p, 1);		/* track ID */
+	p = fmp4_put_u32 (p, 0);		/* reserved */
+	p = fmp4_put_u32 (p, 0);		/* duration: unknown (fragmented) */
+	memset (p, 0, 16);			/* reserved, layer, alternate group, volume, reserved */
+	p = fmp4_put_matrix (p + 16);
+	p = fmp4_put_u32 (p, display_width << 16);
+	p = fmp4_put_u32 (p, mc_parms->v_height << 16);
+	fmp4_box_end (box_p, p);
+
+	mdia_p = p;
+	p = fmp4_box_start (p, "mdia");
+
+	/* mdhd */
+	box_p = p;
+	p = fmp4_fullbox_start (p, "mdhd", 0, 0);
+	p = fmp4_put_u32 (p, 0);		/* creation time */
+	p = fmp4_put_u32 (p, 0);		/* modification time */
+	p = fmp4_put_u32 (p, FMP4_TIMESCALE);
+	p = fmp4_put_u32 (p, 0);		/* duration: unknown (fragmented) */
+	p = fmp4_put_u16 (p, 0x55c4);		/* language: "und" */
+	p = fmp4_put_u16 (p, 0);		/* pre_defined */
+	fmp4_box_end (box_p, p);
+
+	/* hdlr */
+	box_p = p;
+	p = fmp4_fullbox_start (p, "hdlr", 0, 0);
+	p = fmp4_put_u32 (p, 0);		/* pre_defined */
+	memcpy (p, "vide", 4);
+	memset (p + 4, 0, 12);			/* reserved */
+	p += 16;
+	memcpy (p, handler_name, sizeof (handler_name));
+	p += sizeof (handler_name);
+	fmp4_box_end (box_p, p);
+
+	minf_p = p;
+	p = fmp4_box_start (p, "minf");
+
+	/* vmhd */
+	box_p = p;
+	p = fmp4_fullbox_start (p, "vmhd", 0, 0x000001);
+	memset (p, 0, 8);			/* graphics mode, opcolor */
+	p += 8;
+	fmp4_box_end (box_p, p);
+
+	/* dinf/dref: media data within the same file */
+	dinf_p = p;
+	p = fmp4_box_start (p, "dinf");
+	dref_p = p;
+	p = fmp4_fullbox_start (p, "dref", 0, 0);
+	p = fmp4_put_u32 (p, 1);		/* entry count */
+	url_p = p;
+	p = fmp4_fullbox_start (p, "url ", 0, 0x000001);
+	fmp4_box_end (url_p, p);
+	fmp4_box_end (dref_p, p);
+	fmp4_box_end (dinf_p, p);
+
+	stbl_p = p;
+	p = fmp4_box_start (p, "stbl");
+
+	/* stsd */
+	stsd_p = p;
+	p = fmp4_fullbox_start (p, "stsd", 0, 0);
+	p = fmp4_put_u32 (p, 1);		/* entry count */
+
+	avc1_p = p;
+	p = fmp4_box_start (p, "avc1");
+	memset (p, 0, 6);			/* reserved */
+	p = fmp4_put_u16 (p + 6, 1);		/* data reference index */
+	memset (p, 0, 16);			/* pre_defined, reserved */
+	p += 16;
+	p = fmp4_put_u16 (p, mc_parms->v_width);
+	p = fmp4_put_u16 (p, mc_parms->v_height);
+	p = fmp4_put_u32 (p, 0x00480000);	/* 72 dpi */
+	p = fmp4_put_u32 (p, 0x00480000);	/* 72 dpi */
+	p = fmp4_put_u32 (p, 0);		/* reserved */
+	p = fmp4_put_u16 (p, 1);		/* frame count */
+	memset (p, 0, 32);			/* compressor name */
+	p += 32;
+	p = fmp4_put_u16 (p, 0x0018);		/* depth */
+	p = fmp4_put_u16 (p, 0xffff);		/* pre_defined */
+
+	/* avcC (profile and level taken from SPS) */
+	avcc_p = p;
+	p = fmp4_box_start (p, "avcC");
+	*(p++) = 1;				/* configuration version */
+	*(p++) = sps[1];			/* profile */
+	*(p++) = sps[2];			/* profile compatibility */
+	*(p++) = sps[3];			/* level */
+	*(p++) = 0xfc | 3;			/* NAL length: 4 bytes */
+	*(p++) = 0xe0 | 1;			/* SPS count */
+	p = fmp4_put_u16 (p, mc_parms->fmp4_sps_len);
+	memcpy (p, mc_parms->fmp4_sps, mc_parms->fmp4_sps_len);
+	p += mc_parms->fmp4_sps_len;
+	*(p++) = 1;				/* PPS count */
+	p = fmp4_put_u16 (p, mc_parms->fmp4_pps_len);
+	memcpy (p, mc_parms->fmp4_pps, mc_parms->fmp4_pps_len);
+	p += mc_parms->fmp4_pps_len;
+	if ((sps[1] == 100) || (sps[1] == 110) || (sps[1] == 122) || (sps[1] == 144)) {
+		/* high profiles, assumes 4:2:0 8-bit (as from DVRs) */
+		*(p++) = 0xfc | 1;		/* chroma format */
+		*(p++) = 0xf8 | 0;		/* luma bit depth - 8 */
+		*(p++) = 0xf8 | 0;		/* chroma bit depth - 8 */
+		*(p++) = 0;			/* SPS extension count */
+	}
+	fmp4_box_end (avcc_p, p);
+
+	/* pasp (there is no aspect-ratio info in DHAV, see v_aspect_*) */
+	box_p = p;
+	p = fmp4_box_start (p, "pasp");
+	p = fmp4_put_u32 (p, mc_parms->v_aspect_x * mc_parms->v_height);
+	p = fmp4_put_u32 (p, mc_parms->v_aspect_y * mc_parms->v_width);
+	fmp4_box_end (box_p, p);
+
+	fmp4_box_end (avc1_p, p);
+	fmp4_box_end (stsd_p, p);
+
+	/* empty sample tables (samples are in fragments) */
+	box_p = p;
+	p = fmp4_fullbox_start (p, "stts", 0, 0);
+	p = fmp4_put_u32 (p, 0);
+	fmp4_box_end (box_p, p);
+	box_p = p;
+	p = fmp4_fullbox_start (p, "stsc", 0, 0);
+	p = fmp4_put_u32 (p, 0);
+	fmp4_box_end (box_p, p);
+	box_p = p;
+	p = fmp4_fullbox_start (p, "stsz", 0, 0);
+	p = fmp4_put_u32 (p, 0);
+	p = fmp4_put_u32 (p, 0);
+	fmp4_box_end (box_p, p);
+	box_p = p;
+	p = fmp4_fullbox_start (p, "stco", 0, 0);
+	p = fmp4_put_u32 (p, 0);
+	fmp4_box_end (box_p, p);
+
+	fmp4_box_end (stbl_p, p);
+	fmp4_box_end (minf_p, p);
+	fmp4_box_end (mdia_p, p);
+	fmp4_box_end (trak_p, p);
+
+	/* mvex/trex: the movie is fragmented */
+	mvex_p = p;
+	p = fmp4_box_start (p, "mvex");
+	box_p = p;
+	p = fmp4_fullbox_start (p, "trex", 0, 0);
+	p = fmp4_put_u32 (p, 1);		/* track ID */
+	p = fmp4_put_u32 (p, 1);		/* default sample description index */
+	p = fmp4_put_u32 (p, 0);		/* default sample duration */
+	p = fmp4_put_u32 (p, 0);		/* default sample size */
+	p = fmp4_put_u32 (p, 0);		/* default sample flags */
+	fmp4_box_end (box_p, p);
+	fmp4_box_end (mvex_p, p);
+
+	fmp4_box_end (moov_p, p);
+	return p;
+}
+
+/* writes the headers of the current fragment (moof, mdat header) into dst,
+   view receives the sample data, then a new fragment is started.
+   next_timestamp: timestamp of the frame after the last sample (its duration).
+   returns pointer past the written headers */
+static uint8_t *fmp4_write_fragment (t_mc_parms *mc_parms, uint8_t *dst_p, uint64_t next_timestamp, mc_frame_view_t *view)
+{
+	t_fmp4_sample *sample = mc_parms->fmp4_samples;
+	uint8_t *moof_p, *traf_p, *trun_p, *data_offset_p, *box_p;
+	uint8_t *p = dst_p;
+	uint64_t dt;
+	uint64_t dt_next;
+	size_t i;
+
+	moof_p = p;
+	p = fmp4_box_start (p, "moof");
+
+	/* mfhd */
+	box_p = p;
+	p = fmp4_fullbox_start (p, "mfhd", 0, 0);
+	p = fmp4_put_u32 (p, ++(mc_parms->fmp4_sequence));
+	fmp4_box_end (box_p, p);
+
+	traf_p = p;
+	p = fmp4_box_start (p, "traf");
+
+	/* tfhd (default-base-is-moof) */
+	box_p = p;
+	p = fmp4_fullbox_start (p, "tfhd", 0, 0x020000);
+	p = fmp4_put_u32 (p, 1);		/* track ID */
+	fmp4_box_end (box_p, p);
+
+	/* tfdt */
+	dt = FMP4_TS_TO_DT(mc_parms, sample[0].timestamp);
+	box_p = p;
+	p = fmp4_fullbox_start (p, "tfdt", 1, 0);
+	BT_NV2MM_U64(p, dt);
+	p += 8;
+	fmp4_box_end (box_p, p);
+
+	/* trun (data offset, sample duration/size/flags) */
+	trun_p = p;
+	p = fmp4_fullbox_start (p, "trun", 0, 0x000701);
+	p = fmp4_put_u32 (p, mc_parms->fmp4_samples_n);
+	data_offset_p = p;
+	p += 4;
+	for (i = 0; i < mc_parms->fmp4_samples_n; i++) {
+		dt_next = FMP4_TS_TO_DT(mc_parms, ((i + 1) < mc_parms->fmp4_samples_n) ? sample[i + 1].timestamp : next_timestamp);
+		p = fmp4_put_u32 (p, (dt_next > dt) ? (dt_next - dt) : 0);
+		p = fmp4_put_u32 (p, sample[i].len);
+		p = fmp4_put_u32 (p, (sample[i].key_frame == true) ? FMP4_SAMPLE_FLAGS_KEY : FMP4_SAMPLE_FLAGS_NONKEY);
+		dt = dt_next;
+	}
+	fmp4_box_end (trun_p, p);
+
+	fmp4_box_end (traf_p, p);
+	fmp4_box_end (moof_p, p);
+
+	/* sample data starts right after the mdat header */
+	fmp4_put_u32 (data_offset_p, (p - moof_p) + 8);
+	p = fmp4_put_u32 (p, mc_parms->fmp4_mdat_len + 8);
+	memcpy (p, "mdat", 4);
+	p += 4;
+
+	view->body_p = mc_parms->fmp4_mdat[mc_parms->fmp4_mdat_cur];
+	view->body_len = mc_parms->fmp4_mdat_len;
+
+	/* the next fragment goes into the other buffer (view remains valid) */
+	mc_parms->fmp4_mdat_cur ^= 1;
+	mc_parms->fmp4_mdat_len = 0;
+	mc_parms->fmp4_samples_n = 0;
+
+	return p;
+}
+
+/* converts DHAV to fragmented MP4 (H.264)
+   this function assumes a complete and correct single DHAV frame from src */
+/* frames are collected into a fragment, output when the next GOP starts
+   (or when the fragment gets too long, see FMP4_FRAGMENT_MAX_*).
+   the init segment is output along the first frame, which must be
+   an I-frame carrying the parameter sets (SPS/PPS).
+   only the headers are written into dst (at least FMP4_HEAD_MAX_LEN bytes),
+   view receives both the headers and the sample data (not copied).
+   the sample data remains valid until the next call. */
+/* ATTENTION: this function must be called with first_frame==true
+   until it returns ==0, then use first_frame==false.
+   a pending fragment is discarded when first_frame==true (see dt_finalize_fmp4) */
+/* returns ==0 ok (view may be empty) ; <0 fatal error ; >0 soft error, warning */
+int dt_convert_frame_to_fmp4 (t_mc_parms *mc_parms, uint8_t *src_dhav_p, size_t src_dhav_len, uint8_t *dst_p, size_t max_dst_len, bool first_frame, mc_frame_view_t *view)
+{
+	bool new_fragment;
+
+	view->head_p = dst_p;
+	view->head_len = 0;
+	view->body_p = NULL;
+	view->body_len = 0;
+
+	if (src_dhav_len == 0)
+		return 3; /* nothing to do, do nothing */
+
+	if ( (mc_parms->frame_type != FT_VIDEO_I_FRAME) && \
+	   (mc_parms->frame_type != FT_VIDEO_FRAME) ) {
+		/* only h264 video frames are supported */
+		return 2;
+	}
+	if (mc_parms->has_v_parms == false) {
+		/* dt_collect_dhav_frame_info() was
+		   unable to get enough video parameters yet */
+		return 1;
+	}
+	if (max_dst_len < FMP4_HEAD_MAX_LEN)
+		return -4; /* output buffer is too short */
+
+	if (first_frame == true) {
+		/* the init segment requires parameter sets, from an I-frame */
+		if (mc_parms->frame_type != FT_VIDEO_I_FRAME)
+			return 1;
+		mc_parms->fmp4_samples_n = 0;
+		mc_parms->fmp4_mdat_len = 0;
+	} else {
+		new_fragment = (mc_parms->fmp4_samples_n > 0) && \
+			((mc_parms->frame_type == FT_VIDEO_I_FRAME) || \
+			(mc_parms->fmp4_samples_n == FMP4_FRAGMENT_MAX_SAMPLES) || \
+			((mc_parms->fmp4_mdat_len + mc_parms->body_len) > FMP4_FRAGMENT_MAX_LEN));
+		if (new_fragment == true)
+			dst_p = fmp4_write_fragment (mc_parms, dst_p, mc_parms->v_timestamp, view);
+	}
+
+	if (fmp4_add_sample (mc_parms, mc_parms->body_p, mc_parms->body_len) != 0)
+		return -5; /* out of memory */
+
+	if (first_frame == true) {
+		if ((mc_parms->fmp4_sps_len == 0) || (mc_parms->fmp4_pps_len == 0)) {
+			/* no parameter sets yet, wait for the next I-frame */
+			mc_parms->fmp4_samples_n = 0;
+			mc_parms->fmp4_mdat_len = 0;
+			return 1;
+		}
+		mc_parms->fmp4_timestamp_base = mc_parms->v_timestamp;
+		mc_parms->fmp4_sequence = 0;
+		dst_p = fmp4_write_init (mc_parms, dst_p);
+	}
+
+	view->head_len = dst_p - view->head_p;
+	return 0;
+}
+
+/* completes fMP4 output written by dt_convert_frame_to_fmp4():
+   outputs the pending fragment (see dt_convert_frame_to_fmp4 for dst and view).
+   the last frame is assumed to last as long as the previous one. */
+/* returns ==0 ok ; <0 fatal error ; >0 nothing to do */
+int dt_finalize_fmp4 (t_mc_parms *mc_parms, uint8_t *dst_p, size_t max_dst_len, mc_frame_view_t *view)
+{
+	t_fmp4_sample *sample = mc_parms->fmp4_samples;
+	size_t n = mc_parms->fmp4_samples_n;
+	uint64_t next_timestamp;
+
+	view->head_p = dst_p;
+	view->head_len = 0;
+	view->body_p = NULL;
+	view->body_len = 0;
+
+	if (n == 0)
+		return 1;
+	if (max_dst_len < FMP4_HEAD_MAX_LEN)
+		return -4; /* output buffer is too short */
+
+	if ((n > 1) && (sample[n - 1].timestamp > sample[n - 2].timestamp))
+		next_timestamp = sample[n - 1].timestamp + (sample[n - 1].timestamp - sample[n - 2].timestamp);
+	else
+		next_timestamp = sample[n - 1].timestamp + ((mc_parms->dhav_fps != 0) ? (1000000000 / mc_parms->dhav_fps) : 0);
+
+	view->head_len = fmp4_write_fragment (mc_parms, dst_p, next_timestamp, view) - dst_p;
+	return 0;
+}
+
+
+/* ********************************* */
+
+/* MPEG transport stream: a single program, with a single video stream.
+   PAT/PMT are repeated before every I-frame, so that receivers
+   may join at any I-frame (broadcast-style). */
+
+#define MPEGTS_PACKET_LEN 188
+#define MPEGTS_PID_PAT 0x0000
+#define MPEGTS_PID_PMT 0x1000
+#define MPEGTS_PID_VIDEO 0x0100
+
+/* indexes of mc_parms->ts_cc[] */
+#define MPEGTS_CC_PAT 0
+#define MPEGTS_CC_PMT 1
+#define MPEGTS_CC_VIDEO 2
+
+/* PTS (90kHz) of the first frame; PCR runs this much behind PTS,
+   leaving receivers time to decode */
+#define MPEGTS_PTS_OFFSET 63000
+
+/* PSI section CRC (CRC-32/MPEG-2) */
+static uint32_t mpegts_crc32 (const uint8_t *p, size_t len)
+{
+	uint32_t crc = 0xffffffff;
+	int i;
+
+	while (len-- > 0) {
+		crc ^= (uint32_t) *(p++) << 24;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 0x80000000) ? ((crc << 1) ^ 0x04c11db7) : (crc << 1);
+	}
+	return crc;
+}
+
+/* writes a packet carrying a PSI section (PAT/PMT), padded */
+static uint8_t *mpegts_put_psi (t_mc_parms *mc_parms, uint8_t *dst_p, uint16_t pid, int cc_index, const uint8_t *section_p, size_t section_len)
+{
+	uint32_t crc;
+
+	*(dst_p++) = 0x47;
+	*(dst_p++) = 0x40 | (pid >> 8);		/* payload unit start */
+	*(dst_p++) = pid & 0xff;
+	*(dst_p++) = 0x10 | (mc_parms->ts_cc[cc_index]++ & 0x0f);	/* payload only */
+	mc_parms->ts_cc[cc_index] &= 0x0f;
+	*(dst_p++) = 0x00;			/* pointer field */
+
+	memcpy (dst_p, section_p, section_len);
+	crc = mpegts_crc32 (section_p, section_len);
+	BT_NV2MM_U32(dst_p + section_len, crc);
+	memset (dst_p + section_len + 4, 0xff, MPEGTS_PACKET_LEN - 5 - section_len - 4);
+
+	return (dst_p + MPEGTS_PACKET_LEN - 5);
+}
+
+/* writes a PTS (or DTS) field */
+static void mpegts_put_timestamp (uint8_t *p, uint8_t prefix, uint64_t ts)
+{
+	ts &= 0x1ffffffffULL;	/* 33-bit, wraps around */
+	*(p++) = (prefix << 4) | ((ts >> 29) & 0x0e) | 0x01;
+	*(p++) = (ts >> 22) & 0xff;
+	*(p++) = ((ts >> 14) & 0xfe) | 0x01;
+	*(p++) = (ts >> 7) & 0xff;
+	*p = ((ts << 1) & 0xfe) | 0x01;
+}
+
+/* converts DHAV to MPEG-TS (H.264 or H.265), or RAW (MPEG-4 ASP) to MPEG-TS
+   REQUIRES: src_p != dst_p ; max_dst_len >= MPEGTS_OUT_MAX_LEN(src_dhav_len)
+   this function assumes a complete and correct single DHAV frame from src */
+/* each frame becomes a PES packet (the frame body split among TS packets,
+   hence copied), PCR is carried along every frame.
+   PTS derive from v_timestamp (corrected, if timestamp correction is enabled).
+   DVR streams have no B-frames: DTS would equal PTS, thus it is not coded. */
+/* ATTENTION: this function must be called with first_frame==true
+   until it returns ==0, then use first_frame==false */
+/* returns ==0 ok ; <0 fatal error ; >0 soft error, warning */
+int dt_convert_frame_to_mpegts (t_mc_parms *mc_parms, uint8_t *src_dhav_p, size_t src_dhav_len, uint8_t *dst_p, size_t *dst_len, size_t max_dst_len, bool first_frame, mcodec_t vcodec)
+{
+	const uint8_t pat[] = {
+		0x00, 0xb0, 0x0d,		/* table ID, section length */
+		0x00, 0x01, 0xc1, 0x00, 0x00,	/* transport stream ID, version, section number, last section number */
+		0x00, 0x01,			/* program number */
+		0xe0 | (MPEGTS_PID_PMT >> 8), MPEGTS_PID_PMT & 0xff
+	};
+	uint8_t pmt[] = {
+		0x02, 0xb0, 0x12,		/* table ID, section length */
+		0x00, 0x01, 0xc1, 0x00, 0x00,	/* program number, version, section number, last section number */
+		0xe0 | (MPEGTS_PID_VIDEO >> 8), MPEGTS_PID_VIDEO & 0xff,	/* PCR PID */
+		0xf0, 0x00,			/* program info length */
+		0x1b,				/* stream type: H.264 (updated below) */
+		0xe0 | (MPEGTS_PID_VIDEO >> 8), MPEGTS_PID_VIDEO & 0xff,
+		0xf0, 0x00			/* ES info length */
+	};
+	const uint8_t aud[6] = { 0x00, 0x00, 0x00, 0x01, 0x09, 0xf0 };	/* H.264 access unit delimiter */
+	const uint8_t aud_hevc[7] = { 0x00, 0x00, 0x00, 0x01, 0x46, 0x01, 0x50 };	/* H.265 access unit delimiter */
+	uint8_t pes_head[14 + sizeof (aud_hevc)];
+	size_t nal_pos = 0;
+	size_t nal_start;
+	size_t nal_len;
+	size_t pes_head_len;
+	uint8_t *src_p;
+	size_t src_len;
+	uint8_t *dst_start = dst_p;
+	uint64_t pts;
+	uint64_t pcr;
+	size_t pes_len;		/* PES header + body */
+	size_t pes_pos;
+	size_t room;		/* payload room in the current TS packet */
+	size_t chunk;
+	size_t head_chunk;
+	uint8_t af_len;		/* adaptation field length */
+	bool key_frame;
+	bool first_packet;
+
+	*dst_len = 0;
+
+	if (src_dhav_len == 0)
+		return 3; /* nothing to do, do nothing */
+
+	if ( (mc_parms->frame_type != FT_VIDEO_I_FRAME) && \
+	   (mc_parms->frame_type != FT_VIDEO_FRAME) ) {
+		/* only video frames are supported */
+		return 2;
+	}
+	if (mc_parms->has_v_parms == false) {
+		/* dt_collect_dhav_frame_info() was
+		   unable to get enough video parameters yet */
+		return 1;
+	}
+	key_frame = (mc_parms->frame_type == FT_VIDEO_I_FRAME);
+	if ((first_frame == true) && (key_frame == false))
+		return 1; /* start at an I-frame, so that output is decodable right away */
+
+	src_p = mc_parms->body_p;
+	src_len = mc_parms->body_len;
+	if (max_dst_len < MPEGTS_OUT_MAX_LEN(src_len))
+		return -4; /* output buffer is too short */
+
+	if (first_frame == true)
+		mc_parms->ts_timestamp_base = mc_parms->v_timestamp;
+	pcr = (((mc_parms->v_timestamp > mc_parms->ts_timestamp_base) ? (mc_parms->v_timestamp - mc_parms->ts_timestamp_base) : 0) * 9) / 100000;
+	pts = pcr + MPEGTS_PTS_OFFSET;
+
+	/* program tables */
+	if (key_frame == true) {
+		if (vcodec == MCODEC_V_MPEG4_ISO_ASP)
+			pmt[12] = 0x10;	/* stream type: MPEG-4 Visual */
+		if (vcodec == MCODEC_V_MPEGH_ISO_HEVC)
+			pmt[12] = 0x24;	/* stream type: H.265 */
+		dst_p = mpegts_put_psi (mc_parms, dst_p, MPEGTS_PID_PAT, MPEGTS_CC_PAT, pat, sizeof (pat));
+		dst_p = mpegts_put_psi (mc_parms, dst_p, MPEGTS_PID_PMT, MPEGTS_CC_PMT, pmt, sizeof (pmt));
+	}
+
+	/* PES header (unbounded length, allowed for video), PTS only */
+	pes_head[0] = 0x00;
+	pes_head[1] = 0x00;
+	pes_head[2] = 0x01;
+	pes_head[3] = 0xe0;		/* stream ID: video */
+	pes_head[4] = 0x00;		/* PES packet length: unbounded */
+	pes_head[5] = 0x00;
+	pes_head[6] = 0x80;		/* marker bits */
+	pes_head[7] = 0x80;		/* PTS present */
+	pes_head[8] = 0x05;		/* PES header data length */
+	mpegts_put_timestamp (pes_head + 9, 0x02, pts);
+	pes_head_len = 14;
+
+	/* H.264/H.265 access units must start with a delimiter */
+	if ((vcodec != MCODEC_V_MPEG4_ISO_ASP) && \
+		(mc_next_nal (src_p, src_len, &nal_pos, &nal_start, &nal_len) == true)) {
+		if ((vcodec == MCODEC_V_MPEG4_ISO_AVC) && ((src_p[nal_start] & 0x1f) != 9)) {
+			memcpy (pes_head + pes_head_len, aud, sizeof (aud));
+			pes_head_len += sizeof (aud);
+		}
+		if ((vcodec == MCODEC_V_MPEGH_ISO_HEVC) && (HEVC_NAL_TYPE(src_p[nal_start]) != HEVC_NAL_AUD)) {
+			memcpy (pes_head + pes_head_len, aud_hevc, sizeof (aud_hevc));
+			pes_head_len += sizeof (aud_hevc);
+		}
+	}
+
+	/* split the PES packet among TS packets */
+	pes_len = pes_head_len + src_len;
+	pes_pos = 0;
+	first_packet = true;
+	while (pes_pos < pes_len) {
+		room = MPEGTS_PACKET_LEN - 4;
+		af_len = 0;
+		if (first_packet == true)
+			af_len = 1 + 6;	/* flags, PCR */
+		if ((pes_len - pes_pos) < (room - ((af_len > 0) ? (1 + af_len) : 0))) {
+			/* last packet: stuffing fills the adaptation field */
+			af_len = room - (pes_len - pes_pos) - 1;
+		}
+		if ((af_len > 0) || (room - (pes_len - pes_pos) == 1))
+			room -= 1 + af_len;
+		chunk = ((pes_len - pes_pos) < room) ? (pes_len - pes_pos) : room;
+
+		*(dst_p++) = 0x47;
+		*(dst_p++) = ((first_packet == true) ? 0x40 : 0x00) | (MPEGTS_PID_VIDEO >> 8);
+		*(dst_p++) = MPEGTS_PID_VIDEO & 0xff;
+		*(dst_p++) = ((room < (MPEGTS_PACKET_LEN - 4)) ? 0x30 : 0x10) | (mc_parms->ts_cc[MPEGTS_CC_VIDEO]++ & 0x0f);
+		mc_parms->ts_cc[MPEGTS_CC_VIDEO] &= 0x0f;
+
+		if (room < (MPEGTS_PACKET_LEN - 4)) {
+			/* adaptation field */
+			*(dst_p++) = af_len;
+			if (af_len > 0) {
+				*dst_p = 0x00;
+				if (first_packet == true) {
+					*dst_p |= 0x10;		/* PCR */
+					if (key_frame == true)
+						*dst_p |= 0x40;	/* random access point */
+					dst_p++;
+					*(dst_p++) = (pcr >> 25) & 0xff;
+					*(dst_p++) = (pcr >> 17) & 0xff;
+					*(dst_p++) = (pcr >> 9) & 0xff;
+					*(dst_p++) = (pcr >> 1) & 0xff;
+					*(dst_p++) = ((pcr << 7) & 0x80) | 0x7e;	/* reserved, extension (0) */
+					*(dst_p++) = 0x00;
+					memset (dst_p, 0xff, af_len - 7);	/* stuffing */
+					dst_p += af_len - 7;
+				} else {
+					dst_p++;
+					memset (dst_p, 0xff, af_len - 1);	/* stuffing */
+					dst_p += af_len - 1;
+				}
+			}
+		}
+
+		/* payload: PES header first, then the frame body */
+		head_chunk = 0;
+		if (pes_pos < pes_head_len) {
+			head_chunk = ((pes_head_len - pes_pos) < chunk) ? (pes_head_len - pes_pos) : chunk;
+			memcpy (dst_p, pes_head + pes_pos, head_chunk);
+		}
+		memcpy (dst_p + head_chunk, src_p + (pes_pos + head_chunk - pes_head_len), chunk - head_chunk);
+		dst_p += chunk;
+		pes_pos += chunk;
+		first_packet = false;
+	}
+
+	*dst_len = dst_p - dst_start;
+	return 0;
+}
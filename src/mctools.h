@@ -25,13 +25,49 @@
 #include <stdlib.h>
 #include <stdbool.h>
 
+/* dstf queue length: initial, and max (grown on demand for larger frames) */
 #define T_MC_PARMS_DHAV_STF 1000000
+#define DSTF_MAX_LEN (64 * 1048576)
 
 #define TIMESTAMP_DRIFT_EVAL_MIN_SAMPLES 1000
 
+/* MKV clusters last at most this (mili-seconds), even without I-frames.
+   must be <=32767 (16-bit signed relative SimpleBlock timecodes) */
+#define MKV_CLUSTER_MAX_DURATION_MS 5000
+
+/* max length of the audio TrackEntry, appended to the main MKV header */
+#define MKV_AUDIO_TRACK_MAX_LEN 128
+
+/* H.265 parameter sets (VPS/SPS/PPS) longer than this are not supported */
+#define HEVC_PARMSET_MAX_LEN 256
+
+/* max length of the H.265 CodecPrivate (hvcC), in the main MKV header */
+#define MKV_HVCC_MAX_LEN (4 + 23 + (3 * (5 + HEVC_PARMSET_MAX_LEN)))
+
+/* max length of the main MKV header, as written before the first cluster
+   (see t_mc_parms->mkv_head_len for the actual one) */
+#define MKV_MAIN_HEADER_LEN (416 + 4 + MKV_HVCC_MAX_LEN + MKV_AUDIO_TRACK_MAX_LEN)
+
+/* fMP4 fragments hold a GOP, split if longer than any of these */
+#define FMP4_FRAGMENT_MAX_SAMPLES 512
+#define FMP4_FRAGMENT_MAX_LEN (128 * 1048576)
+
+/* H.264 parameter sets (SPS/PPS) longer than this are ignored */
+#define FMP4_PARMSET_MAX_LEN 256
+
+/* MPEG-TS output of a frame: max length, for a frame body of len bytes
+   (PAT, PMT, PES header, stuffing), see dt_convert_frame_to_mpegts() */
+#define MPEGTS_OUT_MAX_LEN(len) (((((len) + 64) / 176) + 4) * 188)
+
+/* max length of the headers output along a fMP4 fragment
+   (init segment, moof, mdat header), see dt_convert_frame_to_fmp4() */
+#define FMP4_HEAD_MAX_LEN (1024 + (2 * FMP4_PARMSET_MAX_LEN) + (FMP4_FRAGMENT_MAX_SAMPLES * 12))
+
 typedef enum {
 	MC_FORM_DHAV,
 	MC_FORM_MKV,
+	MC_FORM_FMP4,
+	MC_FORM_MPEGTS,
 	MC_FORM_RAW_H264,
 	MC_FORM_DVR_NATIVE,
 	MC_FORM_DVR_UNKNOWN
@@ -51,9 +87,36 @@ typedef enum {
 
 typedef enum {
 	MCODEC_V_MPEG4_ISO_AVC,
-	MCODEC_V_MPEG4_ISO_ASP
+	MCODEC_V_MPEG4_ISO_ASP,
+	MCODEC_V_MPEGH_ISO_HEVC,
+	MCODEC_A_UNSUPPORTED,
+	MCODEC_A_G711_ALAW,
+	MCODEC_A_G711_ULAW,
+	MCODEC_A_PCM_S16LE,
+	MCODEC_A_AAC
 } mcodec_t;
 
+/* MKV cue point: where a cluster starting with an I-frame is */
+typedef struct {
+	uint64_t timecode;	/* mili-seconds */
+	uint64_t cluster_pos;	/* relative to Segment data */
+} t_mkv_cue;
+
+/* MKV SimpleBlock, as output (see mkv_log_blocks) */
+typedef struct {
+	uint64_t pos;		/* relative to output start (see mkv_out_len) */
+	int64_t timestamp;	/* nsec, as v_timestamp (audio: a_timestamp_offset included) */
+	bool new_cluster;	/* true: the block starts a cluster (output right before it) */
+	bool audio;
+} t_mkv_block;
+
+/* fMP4 sample (a frame) of the fragment being built */
+typedef struct {
+	uint64_t timestamp;	/* v_timestamp (nsec) */
+	uint32_t len;		/* bytes, within fmp4_mdat */
+	bool key_frame;
+} t_fmp4_sample;
+
 typedef struct {
 	t_mc_format mc_format;	/* target container format */
 	bool v_first_frame;	/* used internally - true: pending or currently processing first usable frame (happens to be an I-frame) */
@@ -71,12 +134,65 @@ typedef struct {
 	uint16_t v_dhav_ts;	/* DHAV (truncated, relative) timestamp collected from frame header (mili-seconds) */
 	bool NTSC_timings;	/* true: video source is NTSC ; false: video source is PAL */
 	uint8_t dhav_fps;	/* frames/sec as reported by DHAV */
+	mcodec_t v_codec;	/* video codec as reported by DHAV (H.264 or H.265) */
 
 	/* used for direct-from-DHAV (buggy) v_timestamp calculation */
 	uint16_t v_dhav_ts_prev;	/* dhav previous frame timestamp, does not start with 0, in msec */
 
 	uint8_t *body_p;	/* pointer to raw h264 data, audio or other raw media inside the DHAV frame */
 	size_t body_len;	/* length of body data */
+
+	bool audio;		/* (CLI option) MKV: output an audio track, if the stream has audio */
+	bool has_a_parms;	/* if true, this struct has valid a_* data (only after first audio frame) */
+	mcodec_t a_codec;
+	uint8_t a_channels;
+	uint32_t a_sample_rate;	/* Hz */
+	uint8_t a_aac_config[2];	/* AAC AudioSpecificConfig */
+	int64_t a_timestamp_offset;	/* current audio frame timestamp, relative to v_timestamp (nsec) */
+
+	/* MKV cluster builder, see dt_convert_frame_to_mkv() */
+	bool mkv_cluster_open;		/* true: frames are appended to the current cluster */
+	uint64_t mkv_cluster_timecode;	/* absolute timecode of the current cluster (mili-seconds) */
+	uint64_t mkv_last_timecode;	/* absolute timecode of the last frame (mili-seconds) */
+	uint64_t mkv_timecode_base;	/* v_timestamp (mili-seconds) at the main header, MKV timecodes start from 0 */
+	uint64_t mkv_out_len;		/* MKV data output so far, main header included (bytes) */
+	uint64_t mkv_cluster_pos;	/* position of the current cluster in output (see mkv_out_len) */
+	bool mkv_has_audio;		/* true: the main header declares the audio track */
+	unsigned int mkv_audio_wait;	/* I-frames skipped waiting for audio parameters, before the main header */
+
+	/* MKV finalization, see dt_finalize_mkv() */
+	bool mkv_has_head;		/* true: mkv_head is valid */
+	uint8_t mkv_head[MKV_MAIN_HEADER_LEN];	/* main header, as output */
+	size_t mkv_head_len;
+	t_mkv_cue *mkv_cues;		/* keyframe clusters (NULL if none) */
+	size_t mkv_cues_n;
+	size_t mkv_cues_max;
+	bool mkv_log_blocks;		/* true: every SimpleBlock is logged into mkv_blocks (see dt_mkv_append_part) */
+	t_mkv_block *mkv_blocks;
+	size_t mkv_blocks_n;
+	size_t mkv_blocks_max;
+	uint8_t *hevc_nal_buf;		/* H.265 frame body, length-prefixed (see dt_convert_frame_to_mkv) */
+	size_t hevc_nal_buf_max;
+	size_t hevc_nal_len;
+	bool hevc_nal_ready;		/* true: hevc_nal_buf holds the current frame (see dt_collect_dhav_frame_info) */
+
+	/* fMP4 fragment builder, see dt_convert_frame_to_fmp4() */
+	uint8_t fmp4_sps[FMP4_PARMSET_MAX_LEN];	/* H.264 parameter sets, as last seen */
+	size_t fmp4_sps_len;		/* 0: none yet */
+	uint8_t fmp4_pps[FMP4_PARMSET_MAX_LEN];
+	size_t fmp4_pps_len;		/* 0: none yet */
+	uint64_t fmp4_timestamp_base;	/* v_timestamp at the init segment, decode times start from 0 */
+	uint32_t fmp4_sequence;		/* fragments output since the init segment */
+	t_fmp4_sample fmp4_samples[FMP4_FRAGMENT_MAX_SAMPLES];	/* current fragment */
+	size_t fmp4_samples_n;
+	uint8_t *fmp4_mdat[2];		/* sample data (length-prefixed NAL units): current fragment, and the one last output */
+	size_t fmp4_mdat_max[2];
+	size_t fmp4_mdat_len;		/* current fragment */
+	unsigned int fmp4_mdat_cur;	/* index of the current fragment in fmp4_mdat[] */
+
+	/* MPEG-TS packetizer, see dt_convert_frame_to_mpegts() */
+	uint8_t ts_cc[3];		/* continuity counters: PAT, PMT, video PIDs */
+	uint64_t ts_timestamp_base;	/* v_timestamp at the first frame, PTS start from a fixed offset */
 } t_mc_parms;
 
 typedef struct {
@@ -109,13 +225,24 @@ typedef struct {
 
 /* used by DHAV/H.264 stream to frames converter */
 typedef struct {
-	uint8_t sq[T_MC_PARMS_DHAV_STF];
-	uint8_t *sq_p;
+	uint8_t *sq_p;	/* mirrored (sq_maxlen bytes mapped twice in a row) if sq_mirrored */
 	size_t sq_offs;	/* offset. -- start of valid data = (sq_p + sq_offs) */
 	size_t sq_len;	/* useful data. -- boundary of used data = (sq_len + sq_offs + sq_p) */
 	size_t sq_maxlen;
+	bool sq_mirrored;
+	uint64_t skipped_len;	/* garbage skipped since last valid frame (DHAV only) */
+	size_t nal_scan_len;	/* frame data already searched for the next NAL sequence (RAW H.264 only) */
 } dstf_t;
 
+/* a converted frame: container headers followed by the frame body,
+   the body is not copied (it points into the source frame) */
+typedef struct {
+	uint8_t *head_p;
+	size_t head_len;
+	uint8_t *body_p;
+	size_t body_len;
+} mc_frame_view_t;
+
 
 extern t_mc_format identify_mc_format (uint8_t *src, size_t src_len);
 
@@ -124,16 +251,28 @@ extern int dt_collect_raw_h264_frame_info (t_mc_parms *mc_parms, uint8_t *src_p,
 
 extern t_mc_parms *mc_init (t_mc_format mc_format, bool assume_ntsc60hz);
 extern void mc_close (t_mc_parms *mc_parms);
-extern int dt_convert_frame_to_mkv (const t_mc_parms *mc_parms, uint8_t *src_dhav_p, size_t src_dhav_len, uint8_t *dst_p, size_t *dst_len, size_t max_dst_len, bool first_frame, mcodec_t vcodec);
+extern int dt_convert_frame_to_mkv (t_mc_parms *mc_parms, uint8_t *src_dhav_p, size_t src_dhav_len, uint8_t *dst_p, size_t max_dst_len, bool first_frame, mcodec_t vcodec, mc_frame_view_t *view);
+extern size_t dt_finalize_mkv_len (const t_mc_parms *mc_parms);
+extern int dt_finalize_mkv (t_mc_parms *mc_parms, uint8_t *dst_p, size_t *dst_len, size_t max_dst_len, uint8_t *head_p);
+extern int dt_mkv_append_part (t_mc_parms *mc_parms, const t_mc_parms *part, uint8_t *part_p, int64_t timestamp_offset);
+extern int dt_convert_frame_to_fmp4 (t_mc_parms *mc_parms, uint8_t *src_dhav_p, size_t src_dhav_len, uint8_t *dst_p, size_t max_dst_len, bool first_frame, mc_frame_view_t *view);
+extern int dt_finalize_fmp4 (t_mc_parms *mc_parms, uint8_t *dst_p, size_t max_dst_len, mc_frame_view_t *view);
+extern int dt_convert_frame_to_mpegts (t_mc_parms *mc_parms, uint8_t *src_dhav_p, size_t src_dhav_len, uint8_t *dst_p, size_t *dst_len, size_t max_dst_len, bool first_frame, mcodec_t vcodec);
 
 extern dstf_t *dstf_init (void);
 extern void dstf_close (dstf_t *dstf);
-extern int dstf_process_dhav_stream_to_frames (dstf_t *dstf, uint8_t *src_p, size_t src_len, uint8_t *dst_p, size_t *dst_len, size_t max_dst_len);
-int dstf_process_raw_h264_stream_to_frames (dstf_t *dstf, uint8_t *src_p, size_t src_len, uint8_t *dst_p, size_t *dst_len, size_t max_dst_len);
+extern void dstf_reset (dstf_t *dstf);
+extern int dstf_append (dstf_t *dstf, const uint8_t *src_p, size_t src_len);
+extern int dstf_process_dhav_stream_to_frames (dstf_t *dstf, uint8_t *src_p, size_t src_len, uint8_t **frame_p, size_t *frame_len);
+extern int dstf_process_raw_h264_stream_to_frames (dstf_t *dstf, uint8_t *src_p, size_t src_len, uint8_t **frame_p, size_t *frame_len);
+extern int dt_next_dhav_frame (const uint8_t *src_p, size_t src_len, size_t *pos, uint8_t **frame_p, size_t *frame_len);
+extern size_t dt_find_dhav_i_frame (const uint8_t *src_p, size_t src_len, size_t pos);
+extern size_t dt_find_dhav_i_frame_at_epoch (const uint8_t *src_p, size_t src_len, uint32_t epoch);
 
 extern int dt_tsproc_process (t_mc_tsproc *tsc);
 extern t_mc_tsproc *dt_tsproc_init (const t_mc_parms *mcp, tsproc_t tsproc);
 extern void dt_tsproc_close (t_mc_tsproc *tsc);
+extern uint64_t dt_tsproc_period (const t_mc_parms *mcp, tsproc_t tsproc, uint32_t epoch_prev, uint16_t dhav_ts_prev, uint32_t epoch_cur, uint16_t dhav_ts_cur);
 
 #endif
 
@@ -20,11 +20,15 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <sys/un.h>
+#include <fcntl.h>
 #include "network.h"
 
 typedef int SOCKET;
@@ -50,16 +54,128 @@ int net_open (t_net_connection *net_connection, const char *hostname, unsigned s
 	if (net_connection->net_sockfd < 0)
 		return (-1 * net_connection->net_sockfd);
 
-	net_connection->net_sockrfp = fdopen (net_connection->net_sockfd, "r");
-	net_connection->net_sockwfp = fdopen (net_connection->net_sockfd, "w");
-
 	return 0;
 }
 
 void net_close (t_net_connection *net_connection)
 {
-	fclose (net_connection->net_sockrfp);
-	fclose (net_connection->net_sockwfp);
+	close (net_connection->net_sockfd);
+}
+
+/* sends the whole data (blocking, subject to send timeout).
+   returns ==0 ok, !=0 error (including timeout) */
+int net_send (t_net_connection *net_connection, const uint8_t *data_p, size_t data_len)
+{
+	ssize_t sent;
+
+	while (data_len > 0) {
+		/* MSG_NOSIGNAL: report a dropped connection as an error, not SIGPIPE */
+		sent = send (net_connection->net_sockfd, data_p, data_len, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			return 1;
+		}
+		data_p += sent;
+		data_len -= sent;
+	}
+
+	return 0;
+}
+
+/* receives whatever is available, up to buf_len
+   (blocks until at least one byte arrives, subject to recv timeout).
+   returns >0 bytes received, ==0 connection closed remotely, <0 error (including timeout) */
+ssize_t net_recv (t_net_connection *net_connection, uint8_t *buf, size_t buf_len)
+{
+	ssize_t got;
+
+	do {
+		got = recv (net_connection->net_sockfd, buf, buf_len, 0);
+	} while ((got < 0) && (errno == EINTR));
+
+	return got;
+}
+
+/* opens a non-blocking listening TCP socket.
+   hostname: local address to bind to, NULL for any.
+   returns >=0 socket fd ; <0 error */
+int net_listen_tcp (const char *hostname, unsigned short int port)
+{
+	struct addrinfo hints;
+	struct addrinfo *ai;
+	char portstr[10];
+	int sockfd;
+	int on = 1;
+
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	snprintf (portstr, sizeof (portstr), "%hu", port);
+	if (getaddrinfo (hostname, portstr, &hints, &ai) != 0)
+		return -1;
+
+	if ((sockfd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
+		freeaddrinfo (ai);
+		return -2;
+	}
+	setsockopt (sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+	if ((bind (sockfd, ai->ai_addr, ai->ai_addrlen) != 0) || (listen (sockfd, 16) != 0) || \
+		(fcntl (sockfd, F_SETFL, fcntl (sockfd, F_GETFL) | O_NONBLOCK) != 0)) {
+		close (sockfd);
+		freeaddrinfo (ai);
+		return -3;
+	}
+
+	freeaddrinfo (ai);
+	return sockfd;
+}
+
+/* opens a non-blocking listening Unix-domain socket.
+   a stale socket file at path is replaced.
+   returns >=0 socket fd ; <0 error */
+int net_listen_unix (const char *path)
+{
+	struct sockaddr_un sa;
+	int sockfd;
+
+	memset (&sa, 0, sizeof (sa));
+	sa.sun_family = AF_UNIX;
+	if (strlen (path) >= sizeof (sa.sun_path))
+		return -1;
+	strcpy (sa.sun_path, path);
+
+	if ((sockfd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -2;
+	unlink (path);
+	if ((bind (sockfd, (struct sockaddr *) &sa, sizeof (sa)) != 0) || (listen (sockfd, 16) != 0) || \
+		(fcntl (sockfd, F_SETFL, fcntl (sockfd, F_GETFL) | O_NONBLOCK) != 0)) {
+		close (sockfd);
+		return -3;
+	}
+
+	return sockfd;
+}
+
+/* accepts a pending connection from a listening socket (see net_listen_*),
+   the new connection is made non-blocking.
+   returns >=0 socket fd ; <0 nothing pending, or error */
+int net_accept_nonblocking (int listen_fd)
+{
+	int sockfd;
+
+	do {
+		sockfd = accept (listen_fd, NULL, NULL);
+	} while ((sockfd < 0) && (errno == EINTR));
+	if (sockfd < 0)
+		return -1;
+	if (fcntl (sockfd, F_SETFL, fcntl (sockfd, F_GETFL) | O_NONBLOCK) != 0) {
+		close (sockfd);
+		return -2;
+	}
+
+	return sockfd;
 }
 
 /* if timeout_<tx|rx> != NULL, set timeouts accordingly */
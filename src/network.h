@@ -20,12 +20,11 @@
 #ifndef HAS_NETWORK_H
 #define HAS_NETWORK_H
 
-#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
 #include <sys/time.h>
 
 typedef struct {
-	FILE *net_sockrfp;
-	FILE *net_sockwfp;
 	int net_sockfd;
 	struct timeval timeout_rx; /* network recv timeout */
 	struct timeval timeout_tx; /* network send timeout */
@@ -33,6 +32,11 @@ typedef struct {
 
 extern int net_open (t_net_connection *net_connection, const char *hostname, unsigned short int port, unsigned int sock_timeout_us);
 extern void net_close (t_net_connection *net_connection);
+extern int net_send (t_net_connection *net_connection, const uint8_t *data_p, size_t data_len);
+extern ssize_t net_recv (t_net_connection *net_connection, uint8_t *buf, size_t buf_len);
+extern int net_listen_tcp (const char *hostname, unsigned short int port);
+extern int net_listen_unix (const char *path);
+extern int net_accept_nonblocking (int listen_fd);
 
 #endif
 
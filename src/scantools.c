@@ -0,0 +1,186 @@
+/* scantools.c */
+/* fast search of stream markers */
+
+/* TaniDVR
+ * Copyright (c) 2011-2015 Daniel Mealha Cabrita
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "scantools.h"
+
+/* SIMD versions are built for x86 with GCC-compatible compilers only,
+   and selected at runtime according to the CPU */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+/* plain C version, memchr() is usually well optimized by libc */
+static size_t scan_dhav_magic_c (const uint8_t *src, size_t n)
+{
+	const uint8_t *p = src;
+	const uint8_t *end = src + n;
+
+	while ((p < end) && ((p = memchr (p, 'D', end - p)) != NULL)) {
+		if ((p[1] == 'H') && (p[2] == 'A') && (p[3] == 'V'))
+			return (p - src);
+		p++;
+	}
+	return n;
+}
+
+/* looks for the 0x01 first, the rarest byte within the start code */
+static size_t scan_start_code_c (const uint8_t *src, size_t n)
+{
+	const uint8_t *p = src + 2;
+	const uint8_t *end = src + n + 2;
+
+	while ((p < end) && ((p = memchr (p, 0x01, end - p)) != NULL)) {
+		if ((p[-1] == 0x00) && (p[-2] == 0x00))
+			return (p - 2 - src);
+		p++;
+	}
+	return n;
+}
+
+#ifdef SCAN_X86
+/* a bit is set for each position where "DHAV" starts,
+   (four overlapping loads, one per character) */
+__attribute__((target("sse2")))
+static size_t scan_dhav_magic_sse2 (const uint8_t *src, size_t n)
+{
+	const __m128i c_d = _mm_set1_epi8 ('D');
+	const __m128i c_h = _mm_set1_epi8 ('H');
+	const __m128i c_a = _mm_set1_epi8 ('A');
+	const __m128i c_v = _mm_set1_epi8 ('V');
+	unsigned int mask;
+	size_t i;
+
+	for (i = 0; (i + 16) <= n; i += 16) {
+		mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *) (src + i)), c_d));
+		if (mask == 0)
+			continue;	/* the common case on garbage */
+		mask &= _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *) (src + i + 1)), c_h));
+		mask &= _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *) (src + i + 2)), c_a));
+		mask &= _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *) (src + i + 3)), c_v));
+		if (mask != 0)
+			return (i + __builtin_ctz (mask));
+	}
+	return (i + scan_dhav_magic_c (src + i, n - i));
+}
+
+__attribute__((target("avx2")))
+static size_t scan_dhav_magic_avx2 (const uint8_t *src, size_t n)
+{
+	const __m256i c_d = _mm256_set1_epi8 ('D');
+	const __m256i c_h = _mm256_set1_epi8 ('H');
+	const __m256i c_a = _mm256_set1_epi8 ('A');
+	const __m256i c_v = _mm256_set1_epi8 ('V');
+	unsigned int mask;
+	size_t i;
+
+	for (i = 0; (i + 32) <= n; i += 32) {
+		mask = _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (_mm256_loadu_si256 ((const __m256i *) (src + i)), c_d));
+		if (mask == 0)
+			continue;
+		mask &= _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (_mm256_loadu_si256 ((const __m256i *) (src + i + 1)), c_h));
+		mask &= _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (_mm256_loadu_si256 ((const __m256i *) (src + i + 2)), c_a));
+		mask &= _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (_mm256_loadu_si256 ((const __m256i *) (src + i + 3)), c_v));
+		if (mask != 0)
+			return (i + __builtin_ctz (mask));
+	}
+	return (i + scan_dhav_magic_sse2 (src + i, n - i));
+}
+
+__attribute__((target("sse2")))
+static size_t scan_start_code_sse2 (const uint8_t *src, size_t n)
+{
+	const __m128i c_0 = _mm_setzero_si128 ();
+	const __m128i c_1 = _mm_set1_epi8 (0x01);
+	unsigned int mask;
+	size_t i;
+
+	for (i = 0; (i + 16) <= n; i += 16) {
+		mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *) (src + i + 2)), c_1));
+		if (mask == 0)
+			continue;
+		mask &= _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *) (src + i + 1)), c_0));
+		mask &= _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *) (src + i)), c_0));
+		if (mask != 0)
+			return (i + __builtin_ctz (mask));
+	}
+	return (i + scan_start_code_c (src + i, n - i));
+}
+
+__attribute__((target("avx2")))
+static size_t scan_start_code_avx2 (const uint8_t *src, size_t n)
+{
+	const __m256i c_0 = _mm256_setzero_si256 ();
+	const __m256i c_1 = _mm256_set1_epi8 (0x01);
+	unsigned int mask;
+	size_t i;
+
+	for (i = 0; (i + 32) <= n; i += 32) {
+		mask = _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (_mm256_loadu_si256 ((const __m256i *) (src + i + 2)), c_1));
+		if (mask == 0)
+			continue;
+		mask &= _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (_mm256_loadu_si256 ((const __m256i *) (src + i + 1)), c_0));
+		mask &= _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (_mm256_loadu_si256 ((const __m256i *) (src + i)), c_0));
+		if (mask != 0)
+			return (i + __builtin_ctz (mask));
+	}
+	return (i + scan_start_code_sse2 (src + i, n - i));
+}
+#endif
+
+static size_t (*scan_dhav_magic_impl) (const uint8_t *src, size_t n) = scan_dhav_magic_c;
+static size_t (*scan_start_code_impl) (const uint8_t *src, size_t n) = scan_start_code_c;
+
+#ifdef SCAN_X86
+/* runtime CPU dispatch, done once before main() */
+__attribute__((constructor))
+static void scan_init (void)
+{
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("avx2")) {
+		scan_dhav_magic_impl = scan_dhav_magic_avx2;
+		scan_start_code_impl = scan_start_code_avx2;
+	} else if (__builtin_cpu_supports ("sse2")) {
+		scan_dhav_magic_impl = scan_dhav_magic_sse2;
+		scan_start_code_impl = scan_start_code_sse2;
+	}
+}
+#endif
+
+/* returns the offset of the first "DHAV" starting within src[0 .. n-1],
+   n if none. src must be readable up to src[n + 2]
+   (the whole "DHAV" is compared). */
+size_t scan_dhav_magic (const uint8_t *src, size_t n)
+{
+	return (scan_dhav_magic_impl (src, n));
+}
+
+/* returns the offset of the first MPEG start code (00 00 01)
+   starting within src[0 .. n-1], n if none.
+   src must be readable up to src[n + 1]. */
+size_t scan_start_code (const uint8_t *src, size_t n)
+{
+	return (scan_start_code_impl (src, n));
+}
+
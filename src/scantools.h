@@ -0,0 +1,31 @@
+/* scantools.h */
+/* fast search of stream markers */
+
+/* TaniDVR
+ * Copyright (c) 2011-2015 Daniel Mealha Cabrita
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SCANTOOLS_H
+#define SCANTOOLS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+extern size_t scan_dhav_magic (const uint8_t *src, size_t n);
+extern size_t scan_start_code (const uint8_t *src, size_t n);
+
+#endif
+
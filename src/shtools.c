@@ -20,6 +20,7 @@
 
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -135,7 +136,8 @@ void sht_signalblock_mgr (sht_sigmgr_op_t op, uint32_t sf)
 		sigaddset (&bmask, SIGSEGV);
 		sigaddset (&bmask, SIGBUS);
 	}
-	sigprocmask (((op == SHT_OP_BLOCK) ? SIG_BLOCK : SIG_UNBLOCK), &bmask, NULL);
+	/* same as sigprocmask() for single-threaded processes, per-thread otherwise */
+	pthread_sigmask (((op == SHT_OP_BLOCK) ? SIG_BLOCK : SIG_UNBLOCK), &bmask, NULL);
 }
 
 /* call this before anything */
@@ -30,6 +30,7 @@
 #include "filetools.h"
 #include "mctools.h"
 #include "dvrcontrol.h"
+#include "hls.h"
 #include "shtools.h"
 #include "config.h"	/* autotools-generated */
 
@@ -40,9 +41,21 @@ struct struct_command_options {
 	const char *dvr_user;
 	const char *dvr_password;
 	int dvr_channel;
+	int n_dvr_channels;
+	int dvr_channels[DVRCTL_MAX_CHANNELS];
+	bool channel_mux;
+	bool threaded;
 	int dvr_sub_channel;
 	int media_container;
 	const char *out_file;
+	unsigned int segment_duration;	/* seconds */
+	unsigned int segment_size;	/* user input in MiB, later converted to bytes */
+	unsigned int output_queue;	/* user input in MiB, later converted to bytes */
+	outfile_drop_t output_drop;
+	const char *listen_address;
+	unsigned int hls_window;	/* segments, 0 = HLS disabled */
+	bool index;
+	bool audio;
 	unsigned int keep_alive;	/* user input in ms, later converted to us (x1000) */
 	unsigned int timeout;		/* inactivity timeout for considering DVR connection dead */
 	unsigned int net_protocol_dialect;
@@ -130,6 +143,58 @@ void dump_device_information (t_devinfo *devinfo)
 	printf ("\n");
 }
 
+/* parses a channel list such as "0", "0,2,5" or "0-3,8"
+   into command_options.dvr_channels.
+   returns ==0 ok, !=0 error */
+int parse_channel_list (const char *chlist)
+{
+	const char *p = chlist;
+	char *endp;
+	long ch_first, ch_last, ch;
+	int i;
+
+	command_options.n_dvr_channels = 0;
+
+	while (1) {
+		ch_first = strtol (p, &endp, 10);
+		if (endp == p)
+			return 1;
+		p = endp;
+		ch_last = ch_first;
+		if (*p == '-') {
+			p++;
+			ch_last = strtol (p, &endp, 10);
+			if (endp == p)
+				return 1;
+			p = endp;
+		}
+		if ((ch_first < 0) || (ch_last > 255) || (ch_first > ch_last))
+			return 1;
+
+		for (ch = ch_first; ch <= ch_last; ch++) {
+			/* ignore duplicates */
+			for (i = 0; i < command_options.n_dvr_channels; i++) {
+				if (command_options.dvr_channels[i] == ch)
+					break;
+			}
+			if (i < command_options.n_dvr_channels)
+				continue;
+			if (command_options.n_dvr_channels >= DVRCTL_MAX_CHANNELS)
+				return 1;
+			command_options.dvr_channels[command_options.n_dvr_channels++] = ch;
+		}
+
+		if (*p == '\0')
+			break;
+		if (*p != ',')
+			return 1;
+		p++;
+	}
+
+	command_options.dvr_channel = command_options.dvr_channels[0];
+	return 0;
+}
+
 void process_command_line_arguments (int argc, char **argv)
 {
 	int option_index = 0;
@@ -149,8 +214,18 @@ void process_command_line_arguments (int argc, char **argv)
 		{"dvr-passwd", 1, 0, 'w'},
 		{"dvr-channel", 1, 0, 'c'},
 		{"dvr-sub-channel", 1, 0, 's'},
+		{"channel-mux", 0, 0, 'M'},
+		{"threaded", 0, 0, 'T'},
 		{"media-container", 1, 0, 'n'},
+		{"audio", 0, 0, 'A'},
 		{"out-file", 1, 0, 'f'},
+		{"segment-duration", 1, 0, 'd'},
+		{"segment-size", 1, 0, 'z'},
+		{"output-queue", 1, 0, 'Q'},
+		{"output-drop", 1, 0, 'D'},
+		{"listen", 1, 0, 'L'},
+		{"hls", 1, 0, 'H'},
+		{"index", 0, 0, 'I'},
 		{"keep-alive", 1, 0, 'k'},
 		{"timeout", 1, 0, 'e'},
 		{"sixty-hertz-ntsc", 0, 0, 'x'},
@@ -161,16 +236,28 @@ void process_command_line_arguments (int argc, char **argv)
 
 	command_options.dvr_port = 37777;
 	command_options.dvr_channel = 0;
+	command_options.n_dvr_channels = 1;
+	command_options.dvr_channels[0] = 0;
+	command_options.channel_mux = false;
+	command_options.threaded = false;
 	command_options.dvr_sub_channel = 0;
 	command_options.media_container = 1;
 	command_options.out_file = "\0"; /* empty = stdout */
+	command_options.segment_duration = 0;
+	command_options.segment_size = 0;
+	command_options.output_queue = 0;
+	command_options.output_drop = OUTFILE_DROP_NONE;
+	command_options.listen_address = NULL;
+	command_options.hls_window = 0;
+	command_options.index = false;
+	command_options.audio = false;
 	command_options.keep_alive = 100;
 	command_options.timeout = 5000;
 	command_options.net_protocol_dialect = 0;
 	command_options.ntsc_exact_60hz = false;
 	command_options.tsproc = TSPROC_DO_CORRECT;
 
-	while ((option = getopt_long (argc, argv, "a:hm:t:p:u:w:c:s:n:f:k:e:xr:", long_options, &option_index)) != EOF) {
+	while ((option = getopt_long (argc, argv, "a:hm:t:p:u:w:c:MTs:n:Af:d:z:Q:D:L:H:k:e:xr:I", long_options, &option_index)) != EOF) {
 		switch (option) {
 			case 'h':
 				printf ("TaniDVR " VERSION "\n"
@@ -199,7 +286,18 @@ void process_command_line_arguments (int argc, char **argv)
 						"-p, --dvr-port\n\tNetwork port (default 37777)\n\n"
 						"-u, --dvr-user\n\tDVR user (may not work if not admin!)\n\n"
 						"-w, --dvr-password\n\tDVR password\n\n"
-						"-c, --dvr-channel\n\t0-255 (default 0)\n\n"
+						"-c, --dvr-channel\n\t0-255 (default 0)\n"
+							"\tA list of channels (eg. 0,2,5 or 0-3,8) records them all\n"
+							"\tat once, sharing a single DVR session.\n"
+							"\tIn such case <filename> must contain %%N, which is\n"
+							"\treplaced by the channel number (eg. cam%%N.mkv).\n\n"
+						"-M, --channel-mux\n\t(default: not enabled)\n"
+							"\tIf defined, all the channels from -c are streamed through\n"
+							"\ta single DVR connection, instead of one per channel.\n"
+							"\tRequires channels 0-15 and a DHAV-capable DVR.\n\n"
+						"-T, --threaded\n\t(default: not enabled)\n"
+							"\tIf defined, the DVR connection is handled by a thread\n"
+							"\tinstead of helper processes, avoiding the pipe copies.\n\n"
 						"-s, --dvr-sub-channel\n"
 							"\t0 - main (default)\n"
 							"\t1 - secondary\n"
@@ -211,8 +309,51 @@ void process_command_line_arguments (int argc, char **argv)
 						"-n, --media-container\n"
 							"\t0 - DVR native: DHAV (.dav|.dhav) or RAW H.264 (depends on the DVR itself)\n"
 							"\t1 - Matroska (.mkv) (default)\n"
+							"\t2 - Fragmented MP4 (.mp4), one fragment per GOP (H.264 only)\n"
+							"\t3 - MPEG transport stream (.ts)\n"
 							"\n"
-						"-f, --out-file\n\t<filename> (default: empty -- console stdout)\n\n"
+						"-A, --audio\n\t(default: not enabled)\n"
+							"\tAdd the audio track (G.711, PCM or AAC), if the stream has audio.\n"
+							"\tMatroska only. Output starts once audio was found,\n"
+							"\tor at the second I-frame otherwise.\n\n"
+						"-f, --out-file\n\t<filename> (default: empty -- console stdout)\n"
+							"\tIf present, %%N is replaced by the channel number.\n\n"
+						"-d, --segment-duration\n\t<seconds> (default: 0 -- disabled)\n"
+							"\tStart a new output file at the first I-frame after\n"
+							"\tthis long. <filename> must contain strftime(3)\n"
+							"\tconversions (eg. cam%%N-%%Y%%m%%d-%%H%%M%%S.mkv).\n\n"
+						"-z, --segment-size\n\t<MiB> (default: 0 -- disabled)\n"
+							"\tSame as -d, but based on output file length.\n\n"
+						"-Q, --output-queue\n\t<MiB> (default: 0 -- disabled)\n"
+							"\tQueue output data (per channel) and write it in large\n"
+							"\tbatches from a dedicated thread, so that a slow disk\n"
+							"\tdoes not stall the DVR connection.\n\n"
+						"-D, --output-drop\n"
+							"\t0 - Wait when the output queue is full (default)\n"
+							"\t1 - Drop frames when the output queue is full,\n"
+							"\t    resuming at the next I-frame\n\n"
+						"-L, --listen\n\t<[host:]port> or unix:<path> (default: not enabled)\n"
+							"\tServe the DVR stream, as received (DHAV or RAW H.264),\n"
+							"\tto any number of local clients, regardless of -n.\n"
+							"\tA slow client skips to the next I-frame instead of\n"
+							"\tstalling the others. New clients start at once, with\n"
+							"\tthe frames since the last I-frame (cached).\n"
+							"\tWith several channels, the port is incremented per\n"
+							"\tchannel (in -c order), or %%N in <path> is replaced\n"
+							"\tby the channel number.\n"
+							"\tIf -f is not defined, no output file is written.\n\n"
+						"-H, --hls\n\t<segments> (default: 0 -- disabled)\n"
+							"\tWrite HTTP Live Streaming output (requires -n 2):\n"
+							"\t<filename> is the playlist (eg. cam%%N.m3u8), listing\n"
+							"\tthe last <segments> segments (1 to %d). Segments\n"
+							"\tare cut at the first I-frame after -d seconds\n"
+							"\t(default: %d), or earlier so as not to exceed\n"
+							"\t%d seconds more. Older segment files are removed.\n\n"
+						"-I, --index\n\t(default: not enabled)\n"
+							"\tWrite a keyframe index alongside each output file\n"
+							"\t(<filename>.idx): offset, DVR time and size of every\n"
+							"\tI-frame, so that a time can be found without scanning\n"
+							"\tthe recording. Requires -f, excludes -H.\n\n"
 						"-k, --keep-alive\n\t<mili_seconds> (default: 100ms)\n"
 							"\tSend innocuous packets to the DVR in order to avoid the\n"
 							"\tconnection to be dropped gratuitously.\n"
@@ -231,7 +372,7 @@ void process_command_line_arguments (int argc, char **argv)
 							"\t    the buggy DHAV stream timestamps\n"
 							"\t1 - Perform timestamp correction (default)\n\n"
 						"-h, --help\n\tDisplay help text (this one).\n\n"
-						"\n");
+						"\n", HLS_MAX_WINDOW, HLS_DEFAULT_SEGMENT_DURATION, HLS_TARGET_DURATION_MARGIN);
 				exit (0);
 				break;
 			case 'a':
@@ -248,6 +389,8 @@ void process_command_line_arguments (int argc, char **argv)
 				switch (command_options.operation_mode) {
 				case 0:
 				case 1:
+				case 2:
+				case 3:
 					break;
 				default:
 					log_printf (LOGT_ERROR, "Invalid operation mode.\n");
@@ -276,12 +419,17 @@ void process_command_line_arguments (int argc, char **argv)
 				command_options.dvr_password = optarg;
 				break;
 			case 'c':
-				sscanf (optarg, "%d", &(command_options.dvr_channel));
-				if ((command_options.dvr_channel < 0) || (command_options.dvr_channel > 255)) {
+				if (parse_channel_list (optarg) != 0) {
 					log_printf (LOGT_ERROR, "Invalid DVR channel.\n");
 					exit (1);
 				}
 				break;
+			case 'M':
+				command_options.channel_mux = true;
+				break;
+			case 'T':
+				command_options.threaded = true;
+				break;
 			case 's':
 				sscanf (optarg, "%d", &(command_options.dvr_sub_channel));
 				if ((command_options.dvr_sub_channel < 0) || (command_options.dvr_sub_channel > 1)) {
@@ -294,6 +442,8 @@ void process_command_line_arguments (int argc, char **argv)
 				switch (command_options.media_container) {
 				case 0:
 				case 1:
+				case 2:
+				case 3:
 					break;
 				default:
 					log_printf (LOGT_ERROR, "Invalid media container.\n");
@@ -304,6 +454,55 @@ void process_command_line_arguments (int argc, char **argv)
 			case 'f':
 				command_options.out_file = optarg;
 				break;
+			case 'd':
+				sscanf (optarg, "%d", &p);
+				if ((p > 31622400) || (p < 0)) {
+					log_printf (LOGT_ERROR, "Out-of-range segment duration.\n");
+					exit (1);
+				}
+				command_options.segment_duration = p;
+				break;
+			case 'z':
+				sscanf (optarg, "%d", &p);
+				if ((p > 1048576) || (p < 0)) {
+					log_printf (LOGT_ERROR, "Out-of-range segment size.\n");
+					exit (1);
+				}
+				command_options.segment_size = p;
+				break;
+			case 'Q':
+				sscanf (optarg, "%d", &p);
+				if ((p > 4096) || (p < 0)) {
+					log_printf (LOGT_ERROR, "Out-of-range output queue size.\n");
+					exit (1);
+				}
+				command_options.output_queue = p;
+				break;
+			case 'D':
+				sscanf (optarg, "%d", &p);
+				switch (p) {
+				case 0:	command_options.output_drop = OUTFILE_DROP_NONE;	break;
+				case 1:	command_options.output_drop = OUTFILE_DROP_FRAMES;	break;
+				default:
+					log_printf (LOGT_ERROR, "Invalid output drop policy.\n");
+					exit (1);
+					break;
+				}
+				break;
+			case 'L':
+				command_options.listen_address = optarg;
+				break;
+			case 'H':
+				sscanf (optarg, "%d", &p);
+				if ((p > HLS_MAX_WINDOW) || (p < 0)) {
+					log_printf (LOGT_ERROR, "Out-of-range HLS playlist length.\n");
+					exit (1);
+				}
+				command_options.hls_window = p;
+				break;
+			case 'I':
+				command_options.index = true;
+				break;
 			case 'k':
 				sscanf (optarg, "%d", &p);
 				if ((p > 1000000) || (p < 0)) {
@@ -320,6 +519,9 @@ void process_command_line_arguments (int argc, char **argv)
 				}
 				command_options.timeout = p;
 				break;
+			case 'A':
+				command_options.audio = true;
+				break;
 			case 'x':
 				command_options.ntsc_exact_60hz = true;
 				break;
@@ -372,6 +574,57 @@ void process_command_line_arguments (int argc, char **argv)
 		log_printf (LOGT_ERROR, "It is required to define a DVR password.\n");
 		exit (1);
 	}
+	if (command_options.channel_mux == true) {
+		for (p = 0; p < command_options.n_dvr_channels; p++) {
+			if (command_options.dvr_channels[p] > 15) {
+				log_printf (LOGT_ERROR, "Channel multiplexing supports channels 0 to 15 only.\n");
+				exit (1);
+			}
+		}
+	}
+	if ((command_options.n_dvr_channels > 1) && \
+		((command_options.listen_address == NULL) || (command_options.out_file[0] != '\0'))) {
+		if (outfile_name_has_channel (command_options.out_file) == false) {
+			log_printf (LOGT_ERROR, "Multiple channels require an output filename containing %%N.\n");
+			exit (1);
+		}
+	}
+	if ((command_options.audio == true) && (command_options.media_container != 1)) {
+		log_printf (LOGT_ERROR, "Audio output requires Matroska (-n 1).\n");
+		exit (1);
+	}
+	if (command_options.hls_window != 0) {
+		if ((command_options.media_container != 2) || (command_options.out_file[0] == '\0') || (command_options.segment_size != 0)) {
+			log_printf (LOGT_ERROR, "HLS output requires fragmented MP4 (-n 2) and a playlist filename (-f), and excludes -z.\n");
+			exit (1);
+		}
+	} else if ((command_options.segment_duration != 0) || (command_options.segment_size != 0)) {
+		if (outfile_name_has_time (command_options.out_file) == false) {
+			log_printf (LOGT_ERROR, "Segmented recording requires an output filename containing strftime conversions (eg. %%Y%%m%%d-%%H%%M%%S).\n");
+			exit (1);
+		}
+	}
+	if ((command_options.listen_address != NULL) && (command_options.out_file[0] == '\0')) {
+		if ((command_options.segment_duration != 0) || (command_options.segment_size != 0) || (command_options.output_queue != 0)) {
+			log_printf (LOGT_ERROR, "Segmented recording and output queue require an output file (-f).\n");
+			exit (1);
+		}
+	}
+	if ((command_options.listen_address != NULL) && (command_options.n_dvr_channels > 1)) {
+		if ((strncmp (command_options.listen_address, "unix:", 5) == 0) && \
+			(outfile_name_has_channel (command_options.listen_address) == false)) {
+			log_printf (LOGT_ERROR, "Multiple channels require a listening socket path containing %%N.\n");
+			exit (1);
+		}
+	}
+	if ((command_options.index == true) && ((command_options.out_file[0] == '\0') || (command_options.hls_window != 0))) {
+		log_printf (LOGT_ERROR, "Keyframe index requires an output file (-f), and excludes -H.\n");
+		exit (1);
+	}
+	if ((command_options.output_drop != OUTFILE_DROP_NONE) && (command_options.output_queue == 0)) {
+		log_printf (LOGT_ERROR, "Output drop policy requires an output queue (-Q).\n");
+		exit (1);
+	}
 	/* NOTE: the following depends on defined_dvr_user and defined_dvr_password both being TRUE */
 	if ((strlen (command_options.dvr_user) + strlen (command_options.dvr_password)) >  MAX_USER_PASSWD_LEN) {
 		log_printf (LOGT_ERROR, "The maximum allowed total size for both \"user\" and \"password\" strings is %d characters.\n", MAX_USER_PASSWD_LEN);
@@ -404,9 +657,24 @@ int main (int argc, char **argv, char *env[])
 	dvrctl.user = command_options.dvr_user;
 	dvrctl.passwd = command_options.dvr_password;
 	dvrctl.channel = command_options.dvr_channel;
+	dvrctl.n_channels = command_options.n_dvr_channels;
+	dvrctl.channel_mux = command_options.channel_mux;
+	dvrctl.threaded = command_options.threaded;
+	dvrctl.segment_duration = command_options.segment_duration;
+	dvrctl.segment_size = (uint64_t) command_options.segment_size * 1048576;	/* this one in bytes */
+	dvrctl.output_queue_len = (size_t) command_options.output_queue * 1048576;	/* this one in bytes */
+	dvrctl.output_drop = command_options.output_drop;
+	dvrctl.listen_address = command_options.listen_address;
+	dvrctl.hls_window = command_options.hls_window;
+	dvrctl.index = command_options.index;
+	if ((dvrctl.hls_window != 0) && (dvrctl.segment_duration == 0))
+		dvrctl.segment_duration = HLS_DEFAULT_SEGMENT_DURATION;
+	for (i = 0; i < dvrctl.n_channels; i++)
+		dvrctl.channels[i] = command_options.dvr_channels[i];
 	dvrctl.sub_channel = command_options.dvr_sub_channel;
 	dvrctl.keep_alive_us = command_options.keep_alive * 1000;	/* this one in micro-seconds */
 	dvrctl.timeout_us = command_options.timeout * 1000;		/* this one in micro-seconds */
+	dvrctl.audio = command_options.audio;
 	dvrctl.ntsc_exact_60hz = command_options.ntsc_exact_60hz;
 	dvrctl.tsproc = command_options.tsproc;
 	dvrctl.net_protocol_dialect = command_options.net_protocol_dialect;
@@ -431,16 +699,20 @@ int main (int argc, char **argv, char *env[])
 		}
 		close_session (&conn_control);	// ignore logout fail, some DVRs always fail at this
 
-		/* check if channel is valid */
-		if ((devinfo.n_channels > 0) && (dvrctl.channel >= devinfo.n_channels)) {
-			log_printf (LOGT_ERROR,
-				"Invalid channel specified. This device supports channels 0 to %d.\n",
-				devinfo.n_channels - 1);
-			exit (1);
+		/* check if channels are valid */
+		for (i = 0; i < dvrctl.n_channels; i++) {
+			if ((devinfo.n_channels > 0) && (dvrctl.channels[i] >= devinfo.n_channels)) {
+				log_printf (LOGT_ERROR,
+					"Invalid channel specified (%d). This device supports channels 0 to %d.\n",
+					dvrctl.channels[i], devinfo.n_channels - 1);
+				exit (1);
+			}
 		}
 
 		/* stream video */
-		stream_media_dvr_to_file (&dvrctl, command_options.media_container, command_options.out_file);
+		/* with -L and no -f, clients are the only output */
+		stream_media_dvr_to_file (&dvrctl, command_options.media_container, \
+			((command_options.listen_address != NULL) && (command_options.out_file[0] == '\0')) ? NULL : command_options.out_file);
 		break;
 	}
 